@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "ftp_accounts.h"
+#include "ftp_ratelimit.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#define FTP_ACCOUNTS_MIN_SLOTS 64
+#define FTP_ACCOUNTS_ARENA_CHUNK (64 * 1024)
+
+// User names live in arena chunks so a 50k-user table is a handful of
+// allocations, and freeing an old table after a reload stays cheap.
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
+
+struct ftp_account_table {
+    ftp_account_t *slots;
+    size_t capacity;              // power of two, kept at most half full
+    size_t count;
+    arena_chunk_t *arena;
+};
+
+// ---- SHA-256 (FIPS 180-4) ----------------------------------------------
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t *ctx, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256_init(sha256_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->length += len;
+    while (len > 0) {
+        size_t n = sizeof(ctx->block) - ctx->used;
+        if (n > len) n = len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used == sizeof(ctx->block)) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_t *ctx, unsigned char out[FTP_ACCOUNT_DIGEST_LEN]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) sha256_update(ctx, &pad, 1);
+    unsigned char len_be[8];
+    for (int i = 0; i < 8; i++) len_be[i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(ctx, len_be, 8);
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+static void password_digest(const unsigned char *salt, const char *password, unsigned char *out) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, salt, FTP_ACCOUNT_SALT_LEN);
+    sha256_update(&ctx, password, strlen(password));
+    sha256_final(&ctx, out);
+}
+
+// ---- table ---------------------------------------------------------------
+
+uint64_t ftp_accounts_hash_name(const char *username) {
+    // FNV-1a; names come from the admin's file, not from clients.
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+ftp_account_table_t *ftp_accounts_new(void) {
+    ftp_account_table_t *table = calloc(1, sizeof(*table));
+    if (!table) return NULL;
+    table->capacity = FTP_ACCOUNTS_MIN_SLOTS;
+    table->slots = calloc(table->capacity, sizeof(*table->slots));
+    if (!table->slots) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void ftp_accounts_free(ftp_account_table_t *table) {
+    if (!table) return;
+    while (table->arena) {
+        arena_chunk_t *chunk = table->arena;
+        table->arena = chunk->next;
+        free(chunk);
+    }
+    free(table->slots);
+    free(table);
+}
+
+size_t ftp_accounts_count(const ftp_account_table_t *table) {
+    return table->count;
+}
+
+static char *arena_strdup(ftp_account_table_t *table, const char *text) {
+    size_t len = strlen(text) + 1;
+    arena_chunk_t *chunk = table->arena;
+    if (!chunk || chunk->size - chunk->used < len) {
+        size_t size = len > FTP_ACCOUNTS_ARENA_CHUNK ? len : FTP_ACCOUNTS_ARENA_CHUNK;
+        chunk = malloc(sizeof(*chunk) + size);
+        if (!chunk) return NULL;
+        chunk->next = table->arena;
+        chunk->used = 0;
+        chunk->size = size;
+        table->arena = chunk;
+    }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, text, len);
+    chunk->used += len;
+    return copy;
+}
+
+static ftp_account_t *table_slot(ftp_account_t *slots, size_t capacity, const char *username, uint64_t hash) {
+    size_t mask = capacity - 1;
+    for (size_t i = (size_t)hash & mask; ; i = (i + 1) & mask) {
+        ftp_account_t *slot = &slots[i];
+        if (!slot->username || (slot->hash == hash && strcmp(slot->username, username) == 0)) {
+            return slot;
+        }
+    }
+}
+
+static int table_grow(ftp_account_table_t *table) {
+    size_t capacity = table->capacity * 2;
+    ftp_account_t *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) return -1;
+    for (size_t i = 0; i < table->capacity; i++) {
+        ftp_account_t *old = &table->slots[i];
+        if (old->username) {
+            *table_slot(slots, capacity, old->username, old->hash) = *old;
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 0;
+}
+
+static int hex_decode(const char *hex, size_t hex_len, unsigned char *out, size_t out_len) {
+    if (hex_len != out_len * 2) return -1;
+    for (size_t i = 0; i < out_len; i++) {
+        unsigned value = 0;
+        if (sscanf(hex + i * 2, "%2x", &value) != 1) return -1;
+        out[i] = (unsigned char)value;
+    }
+    return 0;
+}
+
+// Parses "$sha256$<salt>$<digest>"; returns -1 if secret has another form.
+static int parse_hashed(const char *secret, ftp_account_t *account) {
+    static const char prefix[] = "$sha256$";
+    if (strncmp(secret, prefix, sizeof(prefix) - 1) != 0) return -1;
+    const char *salt = secret + sizeof(prefix) - 1;
+    const char *digest = strchr(salt, '$');
+    if (!digest) return -1;
+    if (hex_decode(salt, (size_t)(digest - salt), account->salt, sizeof(account->salt)) < 0 ||
+        hex_decode(digest + 1, strlen(digest + 1), account->digest, sizeof(account->digest)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_accounts_add(ftp_account_table_t *table, const char *username, const char *secret, long long rate) {
+    ftp_account_t account;
+    memset(&account, 0, sizeof(account));
+    if (strncmp(secret, "$sha256$", 8) == 0) {
+        if (parse_hashed(secret, &account) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        if (getrandom(account.salt, sizeof(account.salt), 0) != (ssize_t)sizeof(account.salt)) {
+            return -1;
+        }
+        password_digest(account.salt, secret, account.digest);
+    }
+    account.hash = ftp_accounts_hash_name(username);
+    account.rate = rate;
+
+    if ((table->count + 1) * 2 > table->capacity && table_grow(table) < 0) {
+        return -1;
+    }
+    ftp_account_t *slot = table_slot(table->slots, table->capacity, username, account.hash);
+    if (slot->username) {
+        return 0;
+    }
+    account.username = arena_strdup(table, username);
+    if (!account.username) return -1;
+    *slot = account;
+    table->count++;
+    return 0;
+}
+
+ftp_account_table_t *ftp_accounts_load(const char *path, int *skipped) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    ftp_account_table_t *table = ftp_accounts_new();
+    if (!table) {
+        fclose(f);
+        return NULL;
+    }
+    int bad = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char user[64], secret[160], limit[32];
+        if (line[0] == '#' || strlen(line) < 3) continue;
+        int fields = sscanf(line, "%63s %159s %31s", user, secret, limit);
+        long long rate = 0;
+        if (fields < 2 || (fields == 3 && ftp_parse_rate(limit, &rate) < 0)) {
+            bad++;
+            continue;
+        }
+        if (ftp_accounts_add(table, user, secret, rate) < 0) {
+            if (errno != EINVAL) {
+                int saved = errno;
+                ftp_accounts_free(table);
+                fclose(f);
+                errno = saved;
+                return NULL;
+            }
+            bad++;
+        }
+    }
+    fclose(f);
+    if (skipped) *skipped = bad;
+    return table;
+}
+
+const ftp_account_t *ftp_accounts_find(const ftp_account_table_t *table, const char *username) {
+    const ftp_account_t *slot = table_slot(table->slots, table->capacity, username, ftp_accounts_hash_name(username));
+    return slot->username ? slot : NULL;
+}
+
+int ftp_account_check(const ftp_account_t *account, const char *password) {
+    unsigned char digest[FTP_ACCOUNT_DIGEST_LEN];
+    password_digest(account->salt, password, digest);
+    unsigned char diff = 0;
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        diff |= (unsigned char)(digest[i] ^ account->digest[i]);
+    }
+    return diff == 0;
+}
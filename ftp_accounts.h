@@ -0,0 +1,41 @@
+#ifndef FTP_ACCOUNTS_H
+#define FTP_ACCOUNTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Immutable account table: an open-addressing hash of user names holding
+// salted SHA-256 password hashes. A table is built once and never changed
+// after it is published, so readers need no lock.
+//
+// accounts.txt lines are "user secret [rate]". The secret is either a
+// plain password, hashed with a random salt while loading, or
+// "$sha256$<salt hex>$<digest hex>" with digest = SHA-256(salt || password).
+#define FTP_ACCOUNT_SALT_LEN 16
+#define FTP_ACCOUNT_DIGEST_LEN 32
+
+typedef struct {
+    const char *username;          // NULL marks an empty slot
+    uint64_t hash;
+    long long rate;                // bytes per second from the third column, 0 = none
+    unsigned char salt[FTP_ACCOUNT_SALT_LEN];
+    unsigned char digest[FTP_ACCOUNT_DIGEST_LEN];
+} ftp_account_t;
+
+typedef struct ftp_account_table ftp_account_table_t;
+
+ftp_account_table_t *ftp_accounts_new(void);
+// Adds one account; an existing user name keeps its first entry.
+int ftp_accounts_add(ftp_account_table_t *table, const char *username, const char *secret, long long rate);
+// Returns NULL with errno set if the file cannot be read. Malformed lines
+// are counted in *skipped (if non-NULL) and left out.
+ftp_account_table_t *ftp_accounts_load(const char *path, int *skipped);
+void ftp_accounts_free(ftp_account_table_t *table);
+size_t ftp_accounts_count(const ftp_account_table_t *table);
+
+const ftp_account_t *ftp_accounts_find(const ftp_account_table_t *table, const char *username);
+// 1 if password matches, compared in constant time.
+int ftp_account_check(const ftp_account_t *account, const char *password);
+uint64_t ftp_accounts_hash_name(const char *username);
+
+#endif // FTP_ACCOUNTS_H
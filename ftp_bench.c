@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include "ftp_client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Headless load generator: N sessions run a weighted mix of commands
+// against one server and the results are printed as JSON.
+#define BENCH_MAX_SESSIONS 1024
+#define BENCH_MAX_SIZES 16
+#define BENCH_NAME_MAX 96
+#define BENCH_RECONNECT_MS 100
+
+typedef enum {
+    OP_LIST,
+    OP_RETR,
+    OP_STOR,
+    OP_DELE,
+    OP_RNFR,
+    OP_COUNT
+} bench_op_t;
+
+static const char *const op_names[OP_COUNT] = { "LIST", "RETR", "STOR", "DELE", "RNFR" };
+
+typedef struct {
+    long long size;
+    int weight;
+    char local[BENCH_NAME_MAX];   // source for STOR
+    char remote[BENCH_NAME_MAX];  // seeded on the server for RETR
+} size_class_t;
+
+typedef struct {
+    long long *latency_us;
+    size_t count;
+    size_t cap;
+    long long errors;
+    long long bytes;
+} op_stats_t;
+
+typedef struct {
+    int id;
+    unsigned seed;
+    pthread_t thread;
+    ftp_client_t client;
+    int connected;
+    op_stats_t ops[OP_COUNT];
+    char (*owned)[BENCH_NAME_MAX];   // files this session stored and may delete or rename
+    size_t owned_count;
+    size_t owned_cap;
+    unsigned long next_name;
+    long long finished_us;
+} bench_worker_t;
+
+static struct {
+    const char *host;
+    int port;
+    const char *user;
+    const char *pass;
+    int sessions;
+    int duration;                 // seconds, used when ops_per_session is 0
+    long long ops_per_session;
+    int compression;
+    const char *output;
+    int weights[OP_COUNT];
+    int weight_total;
+    size_class_t sizes[BENCH_MAX_SIZES];
+    int size_count;
+    int size_weight_total;
+    char local_dir[64];
+    int stop;
+} bench = { "127.0.0.1", 2121, "vu", "vu", 8, 10, 0, 0, NULL, { 10, 50, 25, 10, 5 }, 0, { { 0, 0, "", "" } }, 0, 0, "", 0 };
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h HOST      server address (127.0.0.1)\n"
+            "  -p PORT      server port (2121)\n"
+            "  -u USER      user name (vu)\n"
+            "  -P PASS      password (vu)\n"
+            "  -c N         concurrent sessions (8)\n"
+            "  -d SECONDS   run time (10)\n"
+            "  -n OPS       commands per session instead of a run time\n"
+            "  -m MIX       command weights, e.g. list=10,retr=50,stor=25,dele=10,rnfr=5\n"
+            "  -s SIZES     file size weights, e.g. 4K=40,64K=30,1M=25,16M=5\n"
+            "  -z LEVEL     MODE Z level 1-9 (0 = off)\n"
+            "  -t PROFILE   client socket tuning: auto, lan, wan or lowmem (auto)\n"
+            "  -o FILE      write the JSON report to FILE instead of stdout\n",
+            prog);
+}
+
+static int parse_size(const char *text, long long *size) {
+    char *end = NULL;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || errno != 0 || value < 0) return -1;
+    long long scale = 1;
+    if (*end == 'K' || *end == 'k') scale = 1024LL;
+    else if (*end == 'M' || *end == 'm') scale = 1024LL * 1024;
+    else if (*end == 'G' || *end == 'g') scale = 1024LL * 1024 * 1024;
+    else if (*end != '\0') return -1;
+    if (scale > 1 && end[1] != '\0') return -1;
+    *size = value * scale;
+    return 0;
+}
+
+// "name=weight,..." with name given to on_item; returns -1 on bad input.
+static int parse_weights(const char *text, int (*on_item)(const char *name, int weight)) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", text);
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        char *end = NULL;
+        long weight = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end != '\0' || weight < 0 || weight > 1000000) return -1;
+        if (on_item(item, (int)weight) < 0) return -1;
+    }
+    return 0;
+}
+
+static int set_op_weight(const char *name, int weight) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (strcasecmp(name, op_names[op]) == 0) {
+            bench.weights[op] = weight;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown command '%s' in the mix\n", name);
+    return -1;
+}
+
+static int add_size_class(const char *name, int weight) {
+    long long size = 0;
+    if (bench.size_count == BENCH_MAX_SIZES || parse_size(name, &size) < 0) {
+        fprintf(stderr, "Bad file size '%s'\n", name);
+        return -1;
+    }
+    if (weight == 0) return 0;
+    bench.sizes[bench.size_count].size = size;
+    bench.sizes[bench.size_count].weight = weight;
+    bench.size_count++;
+    return 0;
+}
+
+static int pick_weighted(unsigned *seed, const int *weights, int count, int total) {
+    int r = rand_r(seed) % total;
+    for (int i = 0; i < count; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return count - 1;
+}
+
+static size_class_t *pick_size(bench_worker_t *worker) {
+    int weights[BENCH_MAX_SIZES];
+    for (int i = 0; i < bench.size_count; i++) {
+        weights[i] = bench.sizes[i].weight;
+    }
+    return &bench.sizes[pick_weighted(&worker->seed, weights, bench.size_count, bench.size_weight_total)];
+}
+
+static int write_local_file(const char *path, long long size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    // Random bytes, so MODE Z runs do not compress unrealistically well.
+    char block[64 * 1024];
+    unsigned seed = (unsigned)size;
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (char)rand_r(&seed);
+    }
+    long long left = size;
+    while (left > 0) {
+        size_t chunk = left < (long long)sizeof(block) ? (size_t)left : sizeof(block);
+        ssize_t n = write(fd, block, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    return close(fd);
+}
+
+static int session_open(ftp_client_t *client) {
+    memset(client, 0, sizeof(*client));
+    if (ftp_connect(client, bench.host, bench.port) < 0) return -1;
+    if (ftp_login(client, bench.user, bench.pass) < 0 ||
+        (bench.compression > 0 && ftp_set_compression(client, bench.compression) < 0)) {
+        ftp_disconnect(client);
+        return -1;
+    }
+    return 0;
+}
+
+static void stats_add(op_stats_t *stats, long long latency_us, long long bytes, int failed) {
+    if (failed) {
+        stats->errors++;
+        return;
+    }
+    if (stats->count == stats->cap) {
+        size_t cap = stats->cap ? stats->cap * 2 : 1024;
+        long long *grown = realloc(stats->latency_us, cap * sizeof(*grown));
+        if (!grown) return;
+        stats->latency_us = grown;
+        stats->cap = cap;
+    }
+    stats->latency_us[stats->count++] = latency_us;
+    stats->bytes += bytes;
+}
+
+static int owned_push(bench_worker_t *worker, const char *name) {
+    if (worker->owned_count == worker->owned_cap) {
+        size_t cap = worker->owned_cap ? worker->owned_cap * 2 : 64;
+        char (*grown)[BENCH_NAME_MAX] = realloc(worker->owned, cap * sizeof(*grown));
+        if (!grown) return -1;
+        worker->owned = grown;
+        worker->owned_cap = cap;
+    }
+    snprintf(worker->owned[worker->owned_count++], BENCH_NAME_MAX, "%s", name);
+    return 0;
+}
+
+static void owned_remove(bench_worker_t *worker, size_t index) {
+    worker->owned_count--;
+    if (index != worker->owned_count) {
+        memcpy(worker->owned[index], worker->owned[worker->owned_count], BENCH_NAME_MAX);
+    }
+}
+
+static void next_remote_name(bench_worker_t *worker, char *name) {
+    snprintf(name, BENCH_NAME_MAX, "bench_%d_%d_%lu", (int)getpid(), worker->id, worker->next_name++);
+}
+
+typedef struct {
+    long long bytes;
+} list_count_t;
+
+static int count_list_line(const char *line, void *ctx) {
+    ((list_count_t *)ctx)->bytes += (long long)strlen(line) + 2;
+    return 0;
+}
+
+static void worker_run_op(bench_worker_t *worker, bench_op_t op) {
+    // Nothing of ours to delete or rename yet: store something instead.
+    if ((op == OP_DELE || op == OP_RNFR) && worker->owned_count == 0) {
+        op = OP_STOR;
+    }
+    char name[BENCH_NAME_MAX];
+    long long bytes = 0;
+    int rc = -1;
+    size_t index = worker->owned_count ? (size_t)rand_r(&worker->seed) % worker->owned_count : 0;
+    long long started = now_us();
+    switch (op) {
+        case OP_LIST: {
+            list_count_t count = { 0 };
+            rc = ftp_list_stream(&worker->client, count_list_line, &count);
+            bytes = count.bytes;
+            break;
+        }
+        case OP_RETR: {
+            size_class_t *size = pick_size(worker);
+            rc = ftp_retr(&worker->client, size->remote, "/dev/null");
+            bytes = size->size;
+            break;
+        }
+        case OP_STOR: {
+            size_class_t *size = pick_size(worker);
+            next_remote_name(worker, name);
+            rc = ftp_stor(&worker->client, size->local, name);
+            bytes = size->size;
+            break;
+        }
+        case OP_DELE:
+            rc = ftp_dele(&worker->client, worker->owned[index]);
+            break;
+        case OP_RNFR:
+            next_remote_name(worker, name);
+            rc = ftp_rename(&worker->client, worker->owned[index], name);
+            break;
+        case OP_COUNT:
+            break;
+    }
+    long long latency = now_us() - started;
+    stats_add(&worker->ops[op], latency, bytes, rc < 0);
+
+    if (op == OP_STOR && rc == 0) {
+        owned_push(worker, name);
+    } else if (op == OP_DELE) {
+        owned_remove(worker, index);   // gone either way, or never ours to begin with
+    } else if (op == OP_RNFR && rc == 0) {
+        snprintf(worker->owned[index], BENCH_NAME_MAX, "%s", name);
+    }
+    // The client marks a lost connection but leaves its socket open.
+    if (rc < 0 && !worker->client.connected) {
+        if (worker->client.control_fd >= 0) close(worker->client.control_fd);
+        worker->connected = 0;
+    }
+}
+
+static void *worker_run(void *arg) {
+    bench_worker_t *worker = arg;
+    long long done = 0;
+    while (!__atomic_load_n(&bench.stop, __ATOMIC_RELAXED) &&
+           (bench.ops_per_session == 0 || done < bench.ops_per_session)) {
+        if (!worker->connected) {
+            if (session_open(&worker->client) < 0) {
+                usleep(BENCH_RECONNECT_MS * 1000);
+                continue;
+            }
+            worker->connected = 1;
+        }
+        bench_op_t op = (bench_op_t)pick_weighted(&worker->seed, bench.weights, OP_COUNT, bench.weight_total);
+        worker_run_op(worker, op);
+        done++;
+    }
+    worker->finished_us = now_us();
+
+    // Cleanup is not part of the measurement.
+    if (worker->connected) {
+        for (size_t i = 0; i < worker->owned_count; i++) {
+            ftp_dele(&worker->client, worker->owned[i]);
+        }
+        ftp_disconnect(&worker->client);
+    }
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples, in milliseconds.
+static double percentile_ms(const long long *sorted, size_t count, double q) {
+    if (count == 0) return 0.0;
+    size_t rank = (size_t)(q * count);
+    if (rank < q * count || rank == 0) rank++;
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fputc('\\', out);
+        if ((unsigned char)*text >= 0x20) fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+static void write_report(FILE *out, bench_worker_t *workers, double elapsed) {
+    op_stats_t total[OP_COUNT];
+    memset(total, 0, sizeof(total));
+    long long all_ops = 0, all_errors = 0, bytes_in = 0, bytes_out = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int i = 0; i < bench.sessions; i++) {
+            op_stats_t *stats = &workers[i].ops[op];
+            total[op].count += stats->count;
+            total[op].errors += stats->errors;
+            total[op].bytes += stats->bytes;
+        }
+        total[op].latency_us = malloc((total[op].count ? total[op].count : 1) * sizeof(long long));
+        if (!total[op].latency_us) {
+            total[op].count = 0;
+            continue;
+        }
+        size_t at = 0;
+        for (int i = 0; i < bench.sessions; i++) {
+            op_stats_t *stats = &workers[i].ops[op];
+            memcpy(total[op].latency_us + at, stats->latency_us, stats->count * sizeof(long long));
+            at += stats->count;
+        }
+        qsort(total[op].latency_us, total[op].count, sizeof(long long), compare_latency);
+        all_ops += (long long)total[op].count;
+        all_errors += total[op].errors;
+        if (op == OP_STOR) bytes_out += total[op].bytes;
+        else bytes_in += total[op].bytes;
+    }
+
+    double mib = 1024.0 * 1024.0;
+    fprintf(out, "{\n  \"config\": {\n    \"host\": ");
+    json_string(out, bench.host);
+    fprintf(out, ",\n    \"port\": %d,\n    \"user\": ", bench.port);
+    json_string(out, bench.user);
+    fprintf(out, ",\n    \"sessions\": %d,\n", bench.sessions);
+    if (bench.ops_per_session > 0) {
+        fprintf(out, "    \"ops_per_session\": %lld,\n", bench.ops_per_session);
+    } else {
+        fprintf(out, "    \"duration_s\": %d,\n", bench.duration);
+    }
+    fprintf(out, "    \"mode_z_level\": %d,\n    \"socket_profile\": \"%s\",\n    \"mix\": {", bench.compression,
+            ftp_tune_profile_name());
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(out, "%s\"%s\": %d", op ? ", " : " ", op_names[op], bench.weights[op]);
+    }
+    fprintf(out, " },\n    \"sizes\": [");
+    for (int i = 0; i < bench.size_count; i++) {
+        fprintf(out, "%s{ \"bytes\": %lld, \"weight\": %d }", i ? ", " : " ", bench.sizes[i].size, bench.sizes[i].weight);
+    }
+    fprintf(out, " ]\n  },\n");
+    fprintf(out, "  \"elapsed_s\": %.3f,\n  \"ops\": %lld,\n  \"errors\": %lld,\n  \"ops_per_sec\": %.1f,\n",
+            elapsed, all_ops, all_errors, elapsed > 0 ? all_ops / elapsed : 0.0);
+    fprintf(out, "  \"bytes_in\": %lld,\n  \"bytes_out\": %lld,\n  \"throughput_mib_s\": %.2f,\n",
+            bytes_in, bytes_out, elapsed > 0 ? (bytes_in + bytes_out) / mib / elapsed : 0.0);
+    fprintf(out, "  \"commands\": {");
+    int first = 1;
+    for (int op = 0; op < OP_COUNT; op++) {
+        op_stats_t *stats = &total[op];
+        if (stats->count == 0 && stats->errors == 0) {
+            free(stats->latency_us);
+            continue;
+        }
+        double sum = 0;
+        for (size_t i = 0; i < stats->count; i++) {
+            sum += stats->latency_us[i];
+        }
+        fprintf(out, "%s\n    \"%s\": {\n", first ? "" : ",", op_names[op]);
+        fprintf(out, "      \"ops\": %zu,\n      \"errors\": %lld,\n      \"ops_per_sec\": %.1f,\n",
+                stats->count, stats->errors, elapsed > 0 ? stats->count / elapsed : 0.0);
+        fprintf(out, "      \"bytes\": %lld,\n      \"throughput_mib_s\": %.2f,\n",
+                stats->bytes, elapsed > 0 ? stats->bytes / mib / elapsed : 0.0);
+        fprintf(out, "      \"latency_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }\n    }",
+                stats->count ? sum / stats->count / 1000.0 : 0.0,
+                percentile_ms(stats->latency_us, stats->count, 0.5),
+                percentile_ms(stats->latency_us, stats->count, 0.99),
+                percentile_ms(stats->latency_us, stats->count, 0.999),
+                stats->count ? stats->latency_us[stats->count - 1] / 1000.0 : 0.0);
+        first = 0;
+        free(stats->latency_us);
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+// Local sources for STOR and server copies for RETR, one per size class.
+static int prepare_files(void) {
+    snprintf(bench.local_dir, sizeof(bench.local_dir), "/tmp/ftp_bench.XXXXXX");
+    if (!mkdtemp(bench.local_dir)) {
+        fprintf(stderr, "Cannot create a temporary directory: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < bench.size_count; i++) {
+        size_class_t *size = &bench.sizes[i];
+        snprintf(size->local, sizeof(size->local), "%s/%lld.bin", bench.local_dir, size->size);
+        snprintf(size->remote, sizeof(size->remote), "bench_%d_seed_%lld.bin", (int)getpid(), size->size);
+        if (write_local_file(size->local, size->size) < 0) {
+            fprintf(stderr, "Cannot write %s: %s\n", size->local, strerror(errno));
+            return -1;
+        }
+    }
+    if (bench.weights[OP_RETR] == 0) return 0;
+
+    ftp_client_t client;
+    if (session_open(&client) < 0) {
+        fprintf(stderr, "Cannot log in to %s:%d as %s\n", bench.host, bench.port, bench.user);
+        return -1;
+    }
+    int rc = 0;
+    for (int i = 0; i < bench.size_count && rc == 0; i++) {
+        rc = ftp_stor(&client, bench.sizes[i].local, bench.sizes[i].remote);
+    }
+    ftp_disconnect(&client);
+    if (rc < 0) fprintf(stderr, "Cannot upload the RETR seed files\n");
+    return rc;
+}
+
+static void remove_files(void) {
+    if (bench.weights[OP_RETR] > 0) {
+        ftp_client_t client;
+        if (session_open(&client) == 0) {
+            for (int i = 0; i < bench.size_count; i++) {
+                ftp_dele(&client, bench.sizes[i].remote);
+            }
+            ftp_disconnect(&client);
+        }
+    }
+    for (int i = 0; i < bench.size_count; i++) {
+        if (bench.sizes[i].local[0]) unlink(bench.sizes[i].local);
+    }
+    if (bench.local_dir[0]) rmdir(bench.local_dir);
+}
+
+int main(int argc, char *argv[]) {
+    const char *mix = NULL;
+    const char *sizes = "4K=40,64K=30,1M=25,16M=5";
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:P:c:d:n:m:s:z:t:o:")) != -1) {
+        switch (opt) {
+            case 'h': bench.host = optarg; break;
+            case 'p': bench.port = atoi(optarg); break;
+            case 'u': bench.user = optarg; break;
+            case 'P': bench.pass = optarg; break;
+            case 'c': bench.sessions = atoi(optarg); break;
+            case 'd': bench.duration = atoi(optarg); break;
+            case 'n': bench.ops_per_session = atoll(optarg); break;
+            case 'm': mix = optarg; break;
+            case 's': sizes = optarg; break;
+            case 'z': bench.compression = atoi(optarg); break;
+            case 't':
+                if (ftp_tune_set_profile(optarg) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'o': bench.output = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (mix) {
+        memset(bench.weights, 0, sizeof(bench.weights));
+        if (parse_weights(mix, set_op_weight) < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (parse_weights(sizes, add_size_class) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        bench.weight_total += bench.weights[op];
+    }
+    for (int i = 0; i < bench.size_count; i++) {
+        bench.size_weight_total += bench.sizes[i].weight;
+    }
+    if (bench.sessions < 1 || bench.sessions > BENCH_MAX_SESSIONS || bench.port <= 0 ||
+        (bench.ops_per_session <= 0 && bench.duration <= 0) || bench.weight_total == 0 ||
+        bench.size_weight_total == 0 || bench.compression < 0 || bench.compression > 9) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ftp_set_quiet(1);
+    FILE *out = stdout;
+    if (bench.output && !(out = fopen(bench.output, "w"))) {
+        fprintf(stderr, "Cannot open %s: %s\n", bench.output, strerror(errno));
+        return 1;
+    }
+    if (prepare_files() < 0) {
+        remove_files();
+        return 1;
+    }
+
+    bench_worker_t *workers = calloc((size_t)bench.sessions, sizeof(*workers));
+    if (!workers) {
+        remove_files();
+        return 1;
+    }
+    long long started = now_us();
+    int running = 0;
+    for (int i = 0; i < bench.sessions; i++) {
+        workers[i].id = i;
+        workers[i].seed = (unsigned)(started ^ (i * 2654435761u));
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "Started only %d of %d sessions\n", i, bench.sessions);
+            bench.sessions = i;
+            break;
+        }
+        running++;
+    }
+    if (bench.ops_per_session == 0) {
+        while (now_us() - started < bench.duration * 1000000LL) {
+            usleep(50 * 1000);
+        }
+        __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+    }
+    long long finished = started;
+    for (int i = 0; i < running; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].finished_us > finished) finished = workers[i].finished_us;
+    }
+
+    write_report(out, workers, (finished - started) / 1e6);
+    if (out != stdout) fclose(out);
+    for (int i = 0; i < running; i++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            free(workers[i].ops[op].latency_us);
+        }
+        free(workers[i].owned);
+    }
+    free(workers);
+    remove_files();
+    return 0;
+}
@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include "ftp_client.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/select.h>
@@ -14,7 +16,12 @@ static void client_log_error(const char *fmt, ...) {
     va_end(args);
 }
 
+static int client_quiet;  // set by ftp_set_quiet()
+
 static void client_log_info(const char *fmt, ...) {
+    if (__atomic_load_n(&client_quiet, __ATOMIC_RELAXED)) {
+        return;
+    }
     va_list args;
     va_start(args, fmt);
     fprintf(stdout, "[CLIENT] ");
@@ -23,42 +30,6 @@ static void client_log_info(const char *fmt, ...) {
     va_end(args);
 }
 
-static ssize_t recv_line(int sockfd, char *buffer, size_t size) {
-    if (size == 0) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    size_t count = 0;
-    while (count < size - 1) {
-        char c;
-        ssize_t n = recv(sockfd, &c, 1, 0);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                continue;
-            }
-            return -1;
-        }
-        if (n == 0) {
-            return 0;
-        }
-        buffer[count++] = c;
-        if (c == '\n') {
-            break;
-        }
-    }
-    buffer[count] = '\0';
-    return (ssize_t)count;
-}
-
-static void trim_crlf(char *line) {
-    size_t len = strlen(line);
-    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-        line[len - 1] = '\0';
-        len--;
-    }
-}
-
 static int check_connection_lost(ftp_client_t *client) {
     if (!client || !client->connected || client->control_fd < 0) {
         return 1;
@@ -74,7 +45,10 @@ static int check_connection_lost(ftp_client_t *client) {
     return 0;
 }
 
-static int read_response(ftp_client_t *client, int *code, char *message, size_t message_size) {
+// Like read_response(), but also collects the lines between the first and
+// last line of a multi-line reply into body (one per line, '\n' separated).
+static int read_response_body(ftp_client_t *client, int *code, char *message, size_t message_size,
+                              char *body, size_t body_size) {
     if (client->connected && check_connection_lost(client)) {
         client_log_error("Connection lost");
         client->connected = 0;
@@ -84,9 +58,12 @@ static int read_response(ftp_client_t *client, int *code, char *message, size_t
     char line[FTP_MAX_LINE];
     int primary_code = 0;
     int expecting_multi = 0;
+    if (body && body_size > 0) {
+        body[0] = '\0';
+    }
 
     while (1) {
-        ssize_t n = recv_line(client->control_fd, line, sizeof(line));
+        int n = line_reader_read_line(&client->reader, client->control_fd, line, sizeof(line));
         if (n < 0) {
             if (errno == ECONNRESET || errno == EPIPE || errno == ETIMEDOUT) {
                 client_log_error("Connection lost: %s", strerror(errno));
@@ -102,16 +79,16 @@ static int read_response(ftp_client_t *client, int *code, char *message, size_t
             return -1;
         }
 
-        trim_crlf(line);
-        if (strlen(line) < 3 ||
-            !isdigit((unsigned char)line[0]) ||
-            !isdigit((unsigned char)line[1]) ||
-            !isdigit((unsigned char)line[2])) {
+        int has_code = strlen(line) >= 3 &&
+                       isdigit((unsigned char)line[0]) &&
+                       isdigit((unsigned char)line[1]) &&
+                       isdigit((unsigned char)line[2]);
+        if (!has_code && primary_code == 0) {
             client_log_error("Malformed response line: %s", line);
             return -1;
         }
 
-        int current_code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+        int current_code = has_code ? (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0') : 0;
 
         if (primary_code == 0) {
             primary_code = current_code;
@@ -132,7 +109,11 @@ static int read_response(ftp_client_t *client, int *code, char *message, size_t
             continue;
         }
 
-        if (current_code != primary_code) {
+        if (current_code != primary_code || (strlen(line) > 3 && line[3] == '-')) {
+            if (body && body_size > 0) {
+                size_t used = strlen(body);
+                snprintf(body + used, body_size - used, "%s\n", line);
+            }
             continue;
         }
 
@@ -150,6 +131,10 @@ static int read_response(ftp_client_t *client, int *code, char *message, size_t
     }
 }
 
+static int read_response(ftp_client_t *client, int *code, char *message, size_t message_size) {
+    return read_response_body(client, code, message, message_size, NULL, 0);
+}
+
 static int send_command(ftp_client_t *client, const char *fmt, ...) {
     char buffer[FTP_MAX_LINE];
     va_list args;
@@ -205,6 +190,7 @@ int ftp_connect(ftp_client_t *client, const char *ip, int port) {
     }
 
     memset(client, 0, sizeof(*client));
+    line_reader_init(&client->reader);
     client->control_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (client->control_fd < 0) {
         client_log_error("Failed to create socket: %s", strerror(errno));
@@ -228,6 +214,7 @@ int ftp_connect(ftp_client_t *client, const char *ip, int port) {
         client->control_fd = -1;
         return -1;
     }
+    ftp_tune_control_socket(client->control_fd);
 
     struct timeval timeout;
     fd_set read_fds;
@@ -262,6 +249,11 @@ int ftp_connect(ftp_client_t *client, const char *ip, int port) {
     return 0;
 }
 
+static void remember_credentials(ftp_client_t *client, const char *username, const char *password) {
+    snprintf(client->username, sizeof(client->username), "%s", username ? username : "");
+    snprintf(client->password, sizeof(client->password), "%s", password ? password : "");
+}
+
 int ftp_login(ftp_client_t *client, const char *username, const char *password) {
     if (ensure_connected(client) < 0) {
         return -1;
@@ -282,6 +274,7 @@ int ftp_login(ftp_client_t *client, const char *username, const char *password)
     }
 
     if (code == FTP_LOGIN_SUCCESS) {
+        remember_credentials(client, username, password);
         return 0;
     }
 
@@ -298,6 +291,7 @@ int ftp_login(ftp_client_t *client, const char *username, const char *password)
         return -1;
     }
 
+    remember_credentials(client, username, password);
     return 0;
 }
 
@@ -337,12 +331,103 @@ static int enter_passive_mode(ftp_client_t *client, char *ip_buffer, size_t ip_s
     return 0;
 }
 
-int ftp_list(ftp_client_t *client, char *buffer, size_t size) {
-    if (ensure_connected(client) < 0) {
+int ftp_set_compression(ftp_client_t *client, int level) {
+    if (!client || level < 0 || level > 9) {
+        client_log_error("Invalid compression level %d", level);
         return -1;
     }
-    if (!buffer || size == 0) {
-        client_log_error("Invalid buffer provided to ftp_list");
+    client->compression_level = level;
+    return 0;
+}
+
+void ftp_set_progress(ftp_client_t *client, ftp_progress_fn on_progress, void *ctx) {
+    if (!client) {
+        return;
+    }
+    client->on_progress = on_progress;
+    client->progress_ctx = ctx;
+}
+
+void ftp_set_quiet(int quiet) {
+    __atomic_store_n(&client_quiet, quiet, __ATOMIC_RELAXED);
+}
+
+// Turns the per-chunk byte counts from ftp_common into running totals for
+// the client's progress hook.
+typedef struct {
+    ftp_client_t *client;
+    long long done;
+    long long total;
+    int cancelled;
+} transfer_progress_t;
+
+static int forward_progress(long long bytes, void *ctx) {
+    transfer_progress_t *state = ctx;
+    state->done += bytes;
+    if (state->client->on_progress(state->done, state->total, state->client->progress_ctx) < 0) {
+        state->cancelled = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the hook to hand to ftp_common, or NULL when nobody is listening.
+static const ftp_progress_t *transfer_progress_begin(ftp_client_t *client, transfer_progress_t *state,
+                                                     ftp_progress_t *hook, long long done, long long total) {
+    if (!client->on_progress) {
+        return NULL;
+    }
+    state->client = client;
+    state->done = done;
+    state->total = total;
+    state->cancelled = 0;
+    hook->on_chunk = forward_progress;
+    hook->ctx = state;
+    client->on_progress(done, total, client->progress_ctx);
+    return hook;
+}
+
+// Brings the server's transfer mode in line with compression_level. A server
+// without MODE Z support just keeps the transfer uncompressed.
+static int sync_transfer_mode(ftp_client_t *client) {
+    int want = client->compression_level > 0;
+    if (want == client->mode_z) {
+        return 0;
+    }
+    int code = 0;
+    if (send_command(client, "MODE %s", want ? "Z" : "S") < 0 ||
+        read_response(client, &code, NULL, 0) < 0) {
+        return -1;
+    }
+    if (code != FTP_COMMAND_OK) {
+        if (want) {
+            client_log_info("Server refused MODE Z (code %d), transferring uncompressed", code);
+            client->compression_level = 0;
+        }
+        return 0;
+    }
+    client->mode_z = want;
+    if (want) {
+        if (send_command(client, "OPTS MODE Z LEVEL %d", client->compression_level) < 0 ||
+            read_response(client, &code, NULL, 0) < 0) {
+            return -1;
+        }
+        if (code != FTP_COMMAND_OK) {
+            client_log_info("Server ignored MODE Z level %d (code %d)", client->compression_level, code);
+        }
+    }
+    return 0;
+}
+
+typedef int (*listing_chunk_fn)(const char *data, size_t len, void *ctx);
+
+// Runs a directory listing command over a fresh data connection and feeds
+// the (inflated, under MODE Z) bytes to on_chunk as they arrive. A negative
+// return from on_chunk stops reading. *code receives the preliminary reply
+// so callers can tell an unsupported command from a failed transfer.
+static int run_listing(ftp_client_t *client, const char *command, listing_chunk_fn on_chunk, void *ctx, int *code) {
+    *code = 0;
+    if (sync_transfer_mode(client) < 0) {
         return -1;
     }
 
@@ -359,61 +444,349 @@ int ftp_list(ftp_client_t *client, char *buffer, size_t size) {
         return -1;
     }
 
-    if (send_command(client, "LIST") < 0) {
+    if (send_command(client, "%s", command) < 0) {
         close(data_fd);
         return -1;
     }
 
-    int code = 0;
-    if (read_response(client, &code, NULL, 0) < 0) {
+    if (read_response(client, code, NULL, 0) < 0) {
         close(data_fd);
         return -1;
     }
-    if (code != FTP_DATA_CONN_OPEN) {
-        client_log_error("LIST command rejected with code %d", code);
+    if (*code != FTP_DATA_CONN_OPEN) {
+        client_log_error("%s command rejected with code %d", command, *code);
         close(data_fd);
         return -1;
     }
 
-    size_t total = 0;
+    ftp_zstream_t z;
+    int compressed = client->mode_z;
+    if (compressed && ftp_zstream_init_inflate(&z) < 0) {
+        close(data_fd);
+        return -1;
+    }
+
+    int stopped = 0;
     ssize_t n;
     char temp[FTP_BUFFER_SIZE];
-    while ((n = recv(data_fd, temp, sizeof(temp), 0)) > 0) {
-        size_t copy = (total + n < size - 1) ? (size_t)n : (size - 1 - total);
-        if (copy > 0) {
-            memcpy(buffer + total, temp, copy);
-            total += copy;
+    char plain[FTP_ZBUF_SIZE];
+    while (!stopped && (n = recv(data_fd, temp, sizeof(temp), 0)) > 0) {
+        if (!compressed) {
+            stopped = on_chunk(temp, (size_t)n, ctx) < 0;
+            continue;
         }
-        if ((size_t)n > copy) {
-            client_log_error("LIST response truncated (buffer too small)");
+        size_t used = 0;
+        while (!z.ended && !stopped) {
+            size_t consumed = 0;
+            ssize_t produced = ftp_zstream_process(&z, temp + used, (size_t)n - used, &consumed,
+                                                   plain, sizeof(plain), 0);
+            if (produced < 0) {
+                errno = EPROTO;
+                break;
+            }
+            stopped = on_chunk(plain, (size_t)produced, ctx) < 0;
+            used += consumed;
+            if ((size_t)produced < sizeof(plain) && used == (size_t)n) break;
+        }
+        if (!stopped && !z.ended && used < (size_t)n) {
+            n = -1;
+            break;
         }
     }
     close(data_fd);
+    if (compressed) {
+        if (!stopped && n == 0 && !z.ended) {
+            errno = EPROTO;
+            n = -1;
+        }
+        ftp_zstream_end(&z);
+    }
 
-    if (n < 0) {
-        client_log_error("Error receiving LIST data: %s", strerror(errno));
+    if (!stopped && n < 0) {
+        client_log_error("Error receiving %s data: %s", command, strerror(errno));
         return -1;
     }
 
-    buffer[total] = '\0';
+    int final_code = 0;
+    if (read_response(client, &final_code, NULL, 0) < 0) {
+        return -1;
+    }
+    if (stopped) {
+        return -1;
+    }
+    if (final_code != FTP_SUCCESS) {
+        client_log_error("%s completion failed with code %d", command, final_code);
+        return -1;
+    }
+    return 0;
+}
 
-    if (read_response(client, &code, NULL, 0) < 0) {
+typedef struct {
+    char *buffer;
+    size_t size;
+    size_t total;
+} list_copy_t;
+
+static int copy_list_chunk(const char *data, size_t len, void *ctx) {
+    list_copy_t *copy = ctx;
+    size_t room = copy->size - 1 - copy->total;
+    size_t take = len < room ? len : room;
+    memcpy(copy->buffer + copy->total, data, take);
+    copy->total += take;
+    if (len > take) {
+        client_log_error("LIST response truncated (buffer too small)");
+    }
+    return 0;
+}
+
+int ftp_list(ftp_client_t *client, char *buffer, size_t size) {
+    if (ensure_connected(client) < 0) {
         return -1;
     }
-    if (code != FTP_SUCCESS) {
-        client_log_error("LIST completion failed with code %d", code);
+    if (!buffer || size == 0) {
+        client_log_error("Invalid buffer provided to ftp_list");
+        return -1;
+    }
+
+    list_copy_t copy = { buffer, size, 0 };
+    int code = 0;
+    int rc = run_listing(client, "LIST", copy_list_chunk, &copy, &code);
+    buffer[copy.total] = '\0';
+    return rc;
+}
+
+int ftp_parse_mlsx_line(const char *line, ftp_entry_t *entry) {
+    if (!line || !entry) return -1;
+    while (*line == ' ') line++;
+    const char *name = strchr(line, ' ');
+    if (!name || name[1] == '\0') return -1;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->size = -1;
+    snprintf(entry->name, sizeof(entry->name), "%s", name + 1);
+
+    int have_type = 0;
+    const char *fact = line;
+    while (fact < name) {
+        const char *end = memchr(fact, ';', (size_t)(name - fact));
+        if (!end) end = name;
+        const char *eq = memchr(fact, '=', (size_t)(end - fact));
+        if (eq) {
+            size_t key_len = (size_t)(eq - fact);
+            const char *value = eq + 1;
+            size_t value_len = (size_t)(end - value);
+            if (key_len == 4 && strncasecmp(fact, "type", 4) == 0) {
+                have_type = 1;
+                entry->is_dir = (value_len == 3 && strncasecmp(value, "dir", 3) == 0) ||
+                                (value_len == 4 && strncasecmp(value, "cdir", 4) == 0) ||
+                                (value_len == 4 && strncasecmp(value, "pdir", 4) == 0);
+            } else if (key_len == 4 && strncasecmp(fact, "size", 4) == 0) {
+                entry->size = strtoll(value, NULL, 10);
+            } else if (key_len == 6 && strncasecmp(fact, "modify", 6) == 0 && value_len >= 14) {
+                struct tm tm;
+                memset(&tm, 0, sizeof(tm));
+                if (sscanf(value, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                           &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+                    tm.tm_year -= 1900;
+                    tm.tm_mon -= 1;
+                    entry->mtime = timegm(&tm);
+                }
+            }
+        }
+        fact = end + 1;
+    }
+    return have_type ? 0 : -1;
+}
+
+// Fallback for servers without MLSD: "drwxr-xr-x 1 user user SIZE name".
+static int parse_list_row(const char *line, ftp_entry_t *entry) {
+    char perms[16];
+    long long size = 0;
+    int name_at = 0;
+    if (sscanf(line, "%15s %*s %*s %*s %lld %n", perms, &size, &name_at) < 2 || line[name_at] == '\0') {
         return -1;
     }
+    memset(entry, 0, sizeof(*entry));
+    entry->is_dir = perms[0] == 'd';
+    entry->size = size;
+    snprintf(entry->name, sizeof(entry->name), "%s", line + name_at);
+    return 0;
+}
 
+// Splits a listing into lines, holding at most one partial line between
+// chunks so memory use does not depend on the directory size.
+typedef struct {
+    ftp_line_fn on_line;
+    void *ctx;
+    char line[FTP_MAX_LINE * 2];
+    size_t len;
+} line_splitter_t;
+
+static int flush_line(line_splitter_t *splitter) {
+    splitter->line[splitter->len] = '\0';
+    splitter->len = 0;
+    size_t len = strlen(splitter->line);
+    while (len > 0 && (splitter->line[len - 1] == '\r' || splitter->line[len - 1] == '\n')) {
+        splitter->line[--len] = '\0';
+    }
+    if (len == 0) return 0;
+    return splitter->on_line(splitter->line, splitter->ctx);
+}
+
+static int split_lines_chunk(const char *data, size_t len, void *ctx) {
+    line_splitter_t *splitter = ctx;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            if (flush_line(splitter) < 0) return -1;
+        } else if (splitter->len < sizeof(splitter->line) - 1) {
+            splitter->line[splitter->len++] = data[i];
+        }
+    }
     return 0;
 }
 
-int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_file) {
+static int stream_listing(ftp_client_t *client, const char *command, ftp_line_fn on_line, void *ctx, int *code) {
+    line_splitter_t *splitter = calloc(1, sizeof(*splitter));
+    if (!splitter) {
+        return -1;
+    }
+    splitter->on_line = on_line;
+    splitter->ctx = ctx;
+    int rc = run_listing(client, command, split_lines_chunk, splitter, code);
+    if (rc == 0 && splitter->len > 0) {
+        rc = flush_line(splitter) < 0 ? -1 : 0;
+    }
+    free(splitter);
+    return rc;
+}
+
+int ftp_list_stream(ftp_client_t *client, ftp_line_fn on_line, void *ctx) {
     if (ensure_connected(client) < 0) {
         return -1;
     }
-    if (!remote_file || !local_file) {
-        client_log_error("Invalid parameters to ftp_retr");
+    if (!on_line) {
+        client_log_error("Invalid callback provided to ftp_list_stream");
+        return -1;
+    }
+    int code = 0;
+    return stream_listing(client, "LIST", on_line, ctx, &code);
+}
+
+typedef struct {
+    int mlsd;
+    ftp_entry_fn on_entry;
+    void *ctx;
+} entry_parser_t;
+
+static int parse_entry_line(const char *line, void *ctx) {
+    entry_parser_t *parser = ctx;
+    ftp_entry_t entry;
+    int rc = parser->mlsd ? ftp_parse_mlsx_line(line, &entry) : parse_list_row(line, &entry);
+    if (rc < 0 || strcmp(entry.name, ".") == 0) return 0;
+    return parser->on_entry(&entry, parser->ctx);
+}
+
+int ftp_list_entries_stream(ftp_client_t *client, ftp_entry_fn on_entry, void *ctx) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!on_entry) {
+        client_log_error("Invalid callback provided to ftp_list_entries_stream");
+        return -1;
+    }
+    entry_parser_t parser = { 1, on_entry, ctx };
+    int code = 0;
+    if (!client->no_mlsd) {
+        int rc = stream_listing(client, "MLSD", parse_entry_line, &parser, &code);
+        if (rc == 0 || !((code == 500 || code == 502) && client->connected)) {
+            return rc;
+        }
+        client_log_info("Server does not support MLSD, falling back to LIST");
+        client->no_mlsd = 1;
+    }
+    parser.mlsd = 0;
+    return stream_listing(client, "LIST", parse_entry_line, &parser, &code);
+}
+
+typedef struct {
+    ftp_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} entry_array_t;
+
+static int append_entry(const ftp_entry_t *entry, void *ctx) {
+    entry_array_t *array = ctx;
+    if (array->count == array->capacity) {
+        size_t capacity = array->capacity ? array->capacity * 2 : 64;
+        ftp_entry_t *grown = realloc(array->entries, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        array->entries = grown;
+        array->capacity = capacity;
+    }
+    array->entries[array->count++] = *entry;
+    return 0;
+}
+
+int ftp_list_entries(ftp_client_t *client, ftp_entry_t **entries, size_t *count) {
+    if (!entries || !count) {
+        client_log_error("Invalid parameters to ftp_list_entries");
+        return -1;
+    }
+    *entries = NULL;
+    *count = 0;
+
+    entry_array_t array = { NULL, 0, 0 };
+    if (ftp_list_entries_stream(client, append_entry, &array) < 0) {
+        free(array.entries);
+        return -1;
+    }
+    *entries = array.entries;
+    *count = array.count;
+    return 0;
+}
+
+int ftp_mlst(ftp_client_t *client, const char *path, ftp_entry_t *entry) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!path || !entry) {
+        client_log_error("Invalid parameters to ftp_mlst");
+        return -1;
+    }
+    if (send_command(client, "MLST %s", path) < 0) {
+        return -1;
+    }
+    int code = 0;
+    char body[FTP_MAX_LINE * 2];
+    if (read_response_body(client, &code, NULL, 0, body, sizeof(body)) < 0) {
+        return -1;
+    }
+    if (code != FTP_FILE_ACTION_OK) {
+        client_log_error("MLST failed with code %d", code);
+        return -1;
+    }
+    char *newline = strchr(body, '\n');
+    if (newline) *newline = '\0';
+    if (ftp_parse_mlsx_line(body, entry) < 0) {
+        client_log_error("Malformed MLST reply: %s", body);
+        return -1;
+    }
+    return 0;
+}
+
+// Downloads remote_file into local_file starting at byte offset. With a
+// non-zero offset the server is sent REST first and the local file is
+// continued in place instead of being truncated.
+static int retr_from_offset(ftp_client_t *client, const char *remote_file, const char *local_file, long long offset) {
+    // The size is only worth a round trip when someone shows progress.
+    long long total = -1;
+    if (client->on_progress && ftp_size(client, remote_file, &total) < 0) {
+        if (!client->connected) {
+            return -1;
+        }
+        total = -1;
+    }
+    if (sync_transfer_mode(client) < 0) {
         return -1;
     }
 
@@ -429,12 +802,28 @@ int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_fi
         return -1;
     }
 
+    int code = 0;
+    if (offset > 0) {
+        if (send_command(client, "REST %lld", offset) < 0) {
+            close(data_fd);
+            return -1;
+        }
+        if (read_response(client, &code, NULL, 0) < 0) {
+            close(data_fd);
+            return -1;
+        }
+        if (code != FTP_PENDING_MORE_INFO) {
+            client_log_error("REST %lld rejected with code %d", offset, code);
+            close(data_fd);
+            return -1;
+        }
+    }
+
     if (send_command(client, "RETR %s", remote_file) < 0) {
         close(data_fd);
         return -1;
     }
 
-    int code = 0;
     if (read_response(client, &code, NULL, 0) < 0) {
         close(data_fd);
         return -1;
@@ -445,16 +834,23 @@ int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_fi
         return -1;
     }
 
-    FILE *file = fopen(local_file, "wb");
-    if (!file) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC);
+    int fd = open(local_file, flags, 0666);
+    if (fd < 0 || (offset > 0 && lseek(fd, (off_t)offset, SEEK_SET) < 0)) {
         client_log_error("Failed to open local file '%s' for writing: %s", local_file, strerror(errno));
+        if (fd >= 0) close(fd);
         close(data_fd);
         return -1;
     }
 
-    int transfer_status = receive_file_over_socket(data_fd, file);
+    long long bytes_received = 0;
+    transfer_progress_t progress_state;
+    ftp_progress_t hook;
+    const ftp_progress_t *progress = transfer_progress_begin(client, &progress_state, &hook, offset, total);
+    int transfer_status = client->mode_z ? receive_socket_to_fd_z(data_fd, fd, &bytes_received, progress)
+                                         : receive_socket_to_fd(data_fd, fd, &bytes_received, progress);
 
-    fclose(file);
+    close(fd);
     close(data_fd);
 
     if (read_response(client, &code, NULL, 0) < 0) {
@@ -462,7 +858,12 @@ int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_fi
     }
 
     if (transfer_status < 0) {
-        client_log_error("Server reported code %d after RETR failure", code);
+        if (progress && progress_state.cancelled) {
+            client_log_info("Download of '%s' cancelled after %lld bytes", remote_file, progress_state.done);
+            errno = ECANCELED;
+        } else {
+            client_log_error("Server reported code %d after RETR failure", code);
+        }
         return -1;
     }
 
@@ -471,7 +872,234 @@ int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_fi
         return -1;
     }
 
-    client_log_info("Downloaded '%s' to '%s'", remote_file, local_file);
+    if (offset > 0) {
+        client_log_info("Resumed '%s' into '%s' at offset %lld (%lld bytes)", remote_file, local_file, offset, bytes_received);
+    } else {
+        client_log_info("Downloaded '%s' to '%s'", remote_file, local_file);
+    }
+    return 0;
+}
+
+int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_file) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!remote_file || !local_file) {
+        client_log_error("Invalid parameters to ftp_retr");
+        return -1;
+    }
+    return retr_from_offset(client, remote_file, local_file, 0);
+}
+
+int ftp_retr_resume(ftp_client_t *client, const char *remote_file, const char *local_file) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!remote_file || !local_file) {
+        client_log_error("Invalid parameters to ftp_retr_resume");
+        return -1;
+    }
+
+    struct stat st;
+    long long offset = 0;
+    if (stat(local_file, &st) == 0) {
+        if (!S_ISREG(st.st_mode)) {
+            client_log_error("Cannot resume into '%s': not a regular file", local_file);
+            return -1;
+        }
+        offset = (long long)st.st_size;
+    } else if (errno != ENOENT) {
+        client_log_error("Cannot stat local file '%s': %s", local_file, strerror(errno));
+        return -1;
+    }
+    return retr_from_offset(client, remote_file, local_file, offset);
+}
+
+int ftp_size(ftp_client_t *client, const char *remote_file, long long *size) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!remote_file || !size) {
+        client_log_error("Invalid parameters to ftp_size");
+        return -1;
+    }
+    if (send_command(client, "SIZE %s", remote_file) < 0) {
+        return -1;
+    }
+    int code = 0;
+    char response[FTP_MAX_LINE];
+    if (read_response(client, &code, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    if (code != FTP_FILE_STATUS || sscanf(response, "%lld", size) != 1) {
+        client_log_error("SIZE failed with code %d", code);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const ftp_client_t *origin;
+    const char *remote_dir;
+    const char *remote_file;
+    int fd;
+    long long offset;
+    long long length;
+    int last;                     // runs to the end of the file
+    int status;
+} retr_segment_t;
+
+// Reads exactly segment->length bytes from the data socket into the file at
+// the segment's offset. Segments other than the last stop the RETR at the
+// range end with ABOR.
+static int receive_segment(int data_fd, const retr_segment_t *segment) {
+    size_t chunk = ftp_tune_data_socket(data_fd, 0);
+    char *buffer = malloc(chunk);
+    if (!buffer) return -1;
+    int rc = 0;
+    long long done = 0;
+    while (rc == 0 && done < segment->length) {
+        size_t want = chunk;
+        if ((long long)want > segment->length - done) {
+            want = (size_t)(segment->length - done);
+        }
+        ssize_t n = recv(data_fd, buffer, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = pwrite(segment->fd, buffer + written, (size_t)(n - written), (off_t)(segment->offset + done + written));
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                rc = -1;
+                break;
+            }
+            written += w;
+        }
+        done += n;
+    }
+    free(buffer);
+    return rc;
+}
+
+static void *retr_segment_thread(void *arg) {
+    retr_segment_t *segment = (retr_segment_t *)arg;
+    ftp_client_t session;
+    segment->status = -1;
+
+    if (ftp_connect(&session, segment->origin->server_ip, segment->origin->server_port) < 0) {
+        return NULL;
+    }
+    if (ftp_login(&session, segment->origin->username, segment->origin->password) < 0 ||
+        (segment->remote_dir[0] != '\0' && ftp_cwd(&session, segment->remote_dir) < 0)) {
+        ftp_disconnect(&session);
+        return NULL;
+    }
+
+    char data_ip[16];
+    int data_port = 0;
+    int data_fd = -1;
+    int code = 0;
+    if (enter_passive_mode(&session, data_ip, sizeof(data_ip), &data_port) == 0 &&
+        (data_fd = create_data_connection(data_ip, data_port)) >= 0 &&
+        send_command(&session, "REST %lld", segment->offset) == 0 &&
+        read_response(&session, &code, NULL, 0) == 0 && code == FTP_PENDING_MORE_INFO &&
+        send_command(&session, "RETR %s", segment->remote_file) == 0 &&
+        read_response(&session, &code, NULL, 0) == 0 && code == FTP_DATA_CONN_OPEN) {
+        segment->status = receive_segment(data_fd, segment);
+        // Keep the data connection open until the server has seen ABOR, so
+        // it does not take the range end for a failed send. The RETR ends
+        // with 426, or 226 if it had just finished; ABOR's 226 follows.
+        if (segment->status == 0 && !segment->last && send_command(&session, "ABOR") == 0) {
+            read_response(&session, &code, NULL, 0);
+        }
+        close(data_fd);
+        data_fd = -1;
+        read_response(&session, &code, NULL, 0);
+    } else {
+        client_log_error("Segment at offset %lld could not start RETR (code %d)", segment->offset, code);
+    }
+    if (data_fd >= 0) {
+        close(data_fd);
+    }
+    ftp_disconnect(&session);
+    return NULL;
+}
+
+int ftp_retr_parallel(ftp_client_t *client, const char *remote_file, const char *local_file, int nstreams) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (!remote_file || !local_file) {
+        client_log_error("Invalid parameters to ftp_retr_parallel");
+        return -1;
+    }
+    if (nstreams > FTP_MAX_STREAMS) {
+        nstreams = FTP_MAX_STREAMS;
+    }
+
+    long long size = 0;
+    if (nstreams <= 1 || ftp_size(client, remote_file, &size) < 0 ||
+        size < (long long)nstreams * FTP_PARALLEL_MIN_SEGMENT) {
+        return ftp_retr(client, remote_file, local_file);
+    }
+
+    // Helper sessions start in the login directory; move them to ours.
+    char remote_dir[FTP_MAX_PATH] = "";
+    char pwd[FTP_MAX_PATH];
+    if (ftp_pwd(client, pwd, sizeof(pwd)) == 0) {
+        size_t len = strlen(pwd);
+        if (len >= 2 && pwd[0] == '"' && pwd[len - 1] == '"') {
+            snprintf(remote_dir, sizeof(remote_dir), "%.*s", (int)(len - 2), pwd + 1);
+        }
+    }
+
+    int fd = open(local_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        client_log_error("Failed to open local file '%s' for writing: %s", local_file, strerror(errno));
+        return -1;
+    }
+    if (posix_fallocate(fd, 0, (off_t)size) != 0 && ftruncate(fd, (off_t)size) < 0) {
+        client_log_error("Failed to preallocate '%s': %s", local_file, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    retr_segment_t segments[FTP_MAX_STREAMS];
+    pthread_t threads[FTP_MAX_STREAMS];
+    int started[FTP_MAX_STREAMS];
+    long long chunk = size / nstreams;
+    for (int i = 0; i < nstreams; i++) {
+        segments[i].origin = client;
+        segments[i].remote_dir = remote_dir;
+        segments[i].remote_file = remote_file;
+        segments[i].fd = fd;
+        segments[i].offset = chunk * i;
+        segments[i].length = (i == nstreams - 1) ? size - chunk * i : chunk;
+        segments[i].last = (i == nstreams - 1);
+        segments[i].status = -1;
+        started[i] = pthread_create(&threads[i], NULL, retr_segment_thread, &segments[i]) == 0;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < nstreams; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (!started[i] || segments[i].status < 0) {
+            client_log_error("Segment %d of '%s' failed", i, remote_file);
+            failed = 1;
+        }
+    }
+    close(fd);
+
+    if (failed) {
+        return -1;
+    }
+    client_log_info("Downloaded '%s' to '%s' over %d streams (%lld bytes)", remote_file, local_file, nstreams, size);
     return 0;
 }
 
@@ -483,6 +1111,9 @@ int ftp_stor(ftp_client_t *client, const char *local_file, const char *remote_fi
         client_log_error("Invalid parameters to ftp_stor");
         return -1;
     }
+    if (sync_transfer_mode(client) < 0) {
+        return -1;
+    }
 
     char data_ip[16];
     int data_port = 0;
@@ -519,10 +1150,25 @@ int ftp_stor(ftp_client_t *client, const char *local_file, const char *remote_fi
         return -1;
     }
 
-    int transfer_status = send_file_over_socket(data_fd, file);
+    struct stat st;
+    long long total = fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) ? (long long)st.st_size : -1;
+    long long bytes_sent = 0;
+    transfer_progress_t progress_state;
+    ftp_progress_t hook;
+    const ftp_progress_t *progress = transfer_progress_begin(client, &progress_state, &hook, 0, total);
+    int transfer_status = client->mode_z
+        ? send_fd_over_socket_z(data_fd, fileno(file), NULL, client->compression_level, &bytes_sent, progress)
+        : send_fd_over_socket(data_fd, fileno(file), NULL, &bytes_sent, progress);
 
     fclose(file);
-    shutdown(data_fd, SHUT_WR);
+    if (transfer_status < 0) {
+        // Reset the connection: a clean FIN would make the server keep the
+        // partial upload as if it had been complete.
+        struct linger abort_linger = { 1, 0 };
+        setsockopt(data_fd, SOL_SOCKET, SO_LINGER, &abort_linger, sizeof(abort_linger));
+    } else {
+        shutdown(data_fd, SHUT_WR);
+    }
     close(data_fd);
 
     if (read_response(client, &code, NULL, 0) < 0) {
@@ -530,7 +1176,12 @@ int ftp_stor(ftp_client_t *client, const char *local_file, const char *remote_fi
     }
 
     if (transfer_status < 0) {
-        client_log_error("Server reported code %d after STOR failure", code);
+        if (progress && progress_state.cancelled) {
+            client_log_info("Upload of '%s' cancelled after %lld bytes", local_file, progress_state.done);
+            errno = ECANCELED;
+        } else {
+            client_log_error("Server reported code %d after STOR failure", code);
+        }
         return -1;
     }
 
@@ -539,7 +1190,7 @@ int ftp_stor(ftp_client_t *client, const char *local_file, const char *remote_fi
         return -1;
     }
 
-    client_log_info("Uploaded '%s' to '%s'", local_file, remote_file);
+    client_log_info("Uploaded '%s' to '%s' (%lld bytes)", local_file, remote_file, bytes_sent);
     return 0;
 }
 
@@ -565,6 +1216,7 @@ int ftp_cwd(ftp_client_t *client, const char *path) {
         return -1;
     }
 
+    client->dir_changed = 1;
     return 0;
 }
 
@@ -634,7 +1286,7 @@ int ftp_rename(ftp_client_t *client, const char *from_path, const char *to_path)
     if (send_command(client, "RNFR %s", from_path) < 0) {
         return -1;
     }
-    if (read_response(client, &code, NULL, 0) < 0 || code != 350) {
+    if (read_response(client, &code, NULL, 0) < 0 || code != FTP_PENDING_MORE_INFO) {
         client_log_error("RNFR failed with code %d", code);
         return -1;
     }
@@ -652,6 +1304,24 @@ int ftp_rename(ftp_client_t *client, const char *from_path, const char *to_path)
     return 0;
 }
 
+int ftp_noop(ftp_client_t *client) {
+    if (ensure_connected(client) < 0) {
+        return -1;
+    }
+    if (send_command(client, "NOOP") < 0) {
+        return -1;
+    }
+    int code = 0;
+    if (read_response(client, &code, NULL, 0) < 0) {
+        return -1;
+    }
+    if (code != FTP_COMMAND_OK) {
+        client_log_error("NOOP failed with code %d", code);
+        return -1;
+    }
+    return 0;
+}
+
 int ftp_disconnect(ftp_client_t *client) {
     if (!client || !client->connected) {
         return 0;
@@ -670,3 +1340,175 @@ int ftp_disconnect(ftp_client_t *client) {
     return 0;
 }
 
+
+// A pooled session; the client comes first so ftp_pool_release() can map the
+// pointer handed out by ftp_pool_acquire() back to its entry.
+typedef struct pool_entry {
+    ftp_client_t client;
+    char home_dir[FTP_MAX_PATH];  // directory right after login, restored on release
+    long long idle_since_ms;
+    struct pool_entry *next;
+} pool_entry_t;
+
+struct ftp_pool {
+    pthread_mutex_t lock;
+    size_t max_idle_per_key;
+    pool_entry_t *idle;
+};
+
+static long long pool_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int pool_entry_matches(const pool_entry_t *entry, const char *ip, int port,
+                              const char *username, const char *password) {
+    return entry->client.server_port == port &&
+           strcmp(entry->client.server_ip, ip) == 0 &&
+           strcmp(entry->client.username, username) == 0 &&
+           strcmp(entry->client.password, password) == 0;
+}
+
+static void pool_entry_discard(pool_entry_t *entry) {
+    ftp_disconnect(&entry->client);
+    // ftp_disconnect() skips sessions already marked as lost.
+    if (entry->client.control_fd >= 0) {
+        close(entry->client.control_fd);
+    }
+    free(entry);
+}
+
+ftp_pool_t *ftp_pool_create(size_t max_idle_per_key) {
+    ftp_pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        client_log_error("Failed to allocate connection pool");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_idle_per_key = max_idle_per_key;
+    return pool;
+}
+
+// Takes a matching idle session off the list, or returns NULL.
+static pool_entry_t *pool_take_idle(ftp_pool_t *pool, const char *ip, int port,
+                                    const char *username, const char *password) {
+    pthread_mutex_lock(&pool->lock);
+    pool_entry_t **link = &pool->idle;
+    while (*link && !pool_entry_matches(*link, ip, port, username, password)) {
+        link = &(*link)->next;
+    }
+    pool_entry_t *entry = *link;
+    if (entry) {
+        *link = entry->next;
+        entry->next = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return entry;
+}
+
+static pool_entry_t *pool_open_session(const char *ip, int port, const char *username, const char *password) {
+    pool_entry_t *entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        client_log_error("Failed to allocate pooled session");
+        return NULL;
+    }
+    if (ftp_connect(&entry->client, ip, port) < 0) {
+        free(entry);
+        return NULL;
+    }
+    char path[FTP_MAX_PATH];
+    if (ftp_login(&entry->client, username, password) < 0 ||
+        ftp_pwd(&entry->client, path, sizeof(path)) < 0) {
+        pool_entry_discard(entry);
+        return NULL;
+    }
+    // PWD answers with the path in quotes.
+    char *start = path[0] == '"' ? path + 1 : path;
+    char *end = strrchr(start, '"');
+    if (end) {
+        *end = '\0';
+    }
+    snprintf(entry->home_dir, sizeof(entry->home_dir), "%s", start);
+    return entry;
+}
+
+ftp_client_t *ftp_pool_acquire(ftp_pool_t *pool, const char *ip, int port,
+                               const char *username, const char *password) {
+    if (!pool || !ip) {
+        client_log_error("Invalid parameters to ftp_pool_acquire");
+        return NULL;
+    }
+    if (!username) username = "";
+    if (!password) password = "";
+
+    pool_entry_t *entry;
+    while ((entry = pool_take_idle(pool, ip, port, username, password)) != NULL) {
+        // Sessions that sat idle for a while may have been dropped by the
+        // server; probe them before handing them out.
+        if (entry->client.connected &&
+            (pool_now_ms() - entry->idle_since_ms < FTP_POOL_NOOP_AFTER_MS || ftp_noop(&entry->client) == 0)) {
+            return &entry->client;
+        }
+        pool_entry_discard(entry);
+    }
+
+    entry = pool_open_session(ip, port, username, password);
+    return entry ? &entry->client : NULL;
+}
+
+void ftp_pool_release(ftp_pool_t *pool, ftp_client_t *client) {
+    if (!pool || !client) {
+        return;
+    }
+    pool_entry_t *entry = (pool_entry_t *)client;
+    // The hook points into the releasing caller's state.
+    ftp_set_progress(client, NULL, NULL);
+    if (client->connected && client->compression_level != 0) {
+        ftp_set_compression(client, 0);
+    }
+    if (client->connected && client->dir_changed) {
+        if (ftp_cwd(client, entry->home_dir) < 0) {
+            pool_entry_discard(entry);
+            return;
+        }
+        client->dir_changed = 0;
+    }
+    if (!client->connected) {
+        pool_entry_discard(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    size_t idle = 0;
+    for (pool_entry_t *other = pool->idle; other; other = other->next) {
+        if (pool_entry_matches(other, client->server_ip, client->server_port, client->username, client->password)) {
+            idle++;
+        }
+    }
+    if (idle < pool->max_idle_per_key) {
+        entry->idle_since_ms = pool_now_ms();
+        entry->next = pool->idle;
+        pool->idle = entry;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (entry) {
+        pool_entry_discard(entry);
+    }
+}
+
+void ftp_pool_destroy(ftp_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pool_entry_t *entry = pool->idle;
+    while (entry) {
+        pool_entry_t *next = entry->next;
+        pool_entry_discard(entry);
+        entry = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -2,23 +2,93 @@
 #define FTP_CLIENT_H
 
 #include "ftp_common.h" // Cần file header từ bước trước
+#include <time.h>
+
+#define FTP_MAX_STREAMS 16
+#define FTP_PARALLEL_MIN_SEGMENT (256 * 1024)
+#define FTP_MAX_NAME 256
+#define FTP_POOL_NOOP_AFTER_MS 1000  // idle time after which a pooled session is probed
+
+// One parsed directory entry from MLSD/MLST (or a LIST row as a fallback).
+typedef struct {
+    char name[FTP_MAX_NAME];
+    int is_dir;
+    long long size;   // -1 when the server did not report it
+    time_t mtime;     // 0 when the server did not report it
+} ftp_entry_t;
+
+// Progress of ftp_retr/ftp_retr_resume/ftp_stor: done counts file bytes so
+// far and total is -1 when the size is unknown. Called on the transferring
+// thread after every chunk; a negative return cancels the transfer.
+typedef int (*ftp_progress_fn)(long long done, long long total, void *ctx);
 
 typedef struct {
     int control_fd;
     char server_ip[16];
     int server_port;
     int connected;
+    ftp_line_reader_t reader;
+    // Kept after a successful login so helper sessions can authenticate too.
+    char username[64];
+    char password[64];
+    int compression_level;  // 0 keeps MODE S, 1-9 asks for MODE Z
+    int mode_z;             // MODE Z currently active on the server side
+    int no_mlsd;            // server rejected MLSD, use LIST rows instead
+    int dir_changed;        // CWD succeeded since login (pooled sessions go back home)
+    ftp_progress_fn on_progress;
+    void *progress_ctx;
 } ftp_client_t;
 
 int ftp_connect(ftp_client_t *client, const char *ip, int port);
 int ftp_login(ftp_client_t *client, const char *username, const char *password);
+// Callbacks receive each listing line (without CRLF) or parsed entry as it
+// arrives; returning a negative value aborts the listing.
+typedef int (*ftp_line_fn)(const char *line, void *ctx);
+typedef int (*ftp_entry_fn)(const ftp_entry_t *entry, void *ctx);
+
+// Copies the LIST output into buffer, truncating it when the buffer is full.
 int ftp_list(ftp_client_t *client, char *buffer, size_t size);
+// Streams LIST output line by line; memory use does not grow with the listing.
+int ftp_list_stream(ftp_client_t *client, ftp_line_fn on_line, void *ctx);
+// Streams the current directory as parsed entries, without "." itself.
+int ftp_list_entries_stream(ftp_client_t *client, ftp_entry_fn on_entry, void *ctx);
+// Collects the entries into an array allocated with malloc(); free() it.
+int ftp_list_entries(ftp_client_t *client, ftp_entry_t **entries, size_t *count);
+int ftp_mlst(ftp_client_t *client, const char *path, ftp_entry_t *entry);
+// Parses one "fact=value;... name" line; returns -1 if it is malformed.
+int ftp_parse_mlsx_line(const char *line, ftp_entry_t *entry);
 int ftp_retr(ftp_client_t *client, const char *remote_file, const char *local_file);
+// Continues a partial download: local_file's current size is sent as REST.
+int ftp_retr_resume(ftp_client_t *client, const char *remote_file, const char *local_file);
+// Splits remote_file into nstreams byte ranges fetched over extra sessions.
+int ftp_retr_parallel(ftp_client_t *client, const char *remote_file, const char *local_file, int nstreams);
+// Installs (or with NULL removes) the progress hook for later transfers.
+void ftp_set_progress(ftp_client_t *client, ftp_progress_fn on_progress, void *ctx);
+// Silences the informational "[CLIENT]" lines process-wide; errors still
+// go to stderr.
+void ftp_set_quiet(int quiet);
+// Requests MODE Z (zlib) for later LIST/RETR/STOR; level 0 turns it off.
+int ftp_set_compression(ftp_client_t *client, int level);
+int ftp_size(ftp_client_t *client, const char *remote_file, long long *size);
 int ftp_stor(ftp_client_t *client, const char *local_file, const char *remote_file);
 int ftp_cwd(ftp_client_t *client, const char *path);
 int ftp_pwd(ftp_client_t *client, char *path, size_t size);
 int ftp_dele(ftp_client_t *client, const char *remote_file);
 int ftp_rename(ftp_client_t *client, const char *from_path, const char *to_path);
+int ftp_noop(ftp_client_t *client);
 int ftp_disconnect(ftp_client_t *client);
 
+// Thread-safe pool of logged-in sessions keyed by host, port and user.
+// Released sessions are kept for reuse; ones that lost their connection are
+// dropped, and sessions idle for a while are probed with NOOP before reuse.
+// Release drops the progress hook and MODE Z and returns to the login
+// directory, so the next caller starts from a clean session.
+typedef struct ftp_pool ftp_pool_t;
+
+ftp_pool_t *ftp_pool_create(size_t max_idle_per_key);
+ftp_client_t *ftp_pool_acquire(ftp_pool_t *pool, const char *ip, int port,
+                               const char *username, const char *password);
+void ftp_pool_release(ftp_pool_t *pool, ftp_client_t *client);
+void ftp_pool_destroy(ftp_pool_t *pool);
+
 #endif // FTP_CLIENT_H
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <gtk/gtk.h>
+#include <errno.h>
 #include <limits.h>
 #include "ftp_client.h"
 
@@ -25,13 +26,12 @@ static GtkWidget *delete_button;
 static GtkWidget *move_target_entry;
 static GtkWidget *move_button;
 static GtkWidget *status_label;
+static GtkWidget *transfer_progress_bar;
+static GtkWidget *cancel_button;
 
 static ftp_client_t client;
 static gboolean connected = FALSE;
 
-// Forward declarations
-static void on_refresh_clicked(GtkWidget *widget, gpointer data);
-
 static void clear_file_list(void) {
     if (!file_list_box) return;
     GList *children = gtk_container_get_children(GTK_CONTAINER(file_list_box));
@@ -41,30 +41,764 @@ static void clear_file_list(void) {
     g_list_free(children);
 }
 
-static char *extract_filename(const char *line) {
-    if (!line) return NULL;
-    const char *last_space = strrchr(line, ' ');
-    const char *candidate = last_space ? last_space + 1 : line;
-    if (*candidate == '\0') return NULL;
-    return g_strdup(candidate);
+static void update_status(const char *message) {
+    gtk_label_set_text(GTK_LABEL(status_label), message);
 }
 
-static void add_remote_row(const char *line) {
-    if (!line || !file_list_box) return;
+static void add_remote_row(const ftp_entry_t *entry) {
+    if (!entry || !file_list_box) return;
+    char modified[32] = "";
+    if (entry->mtime > 0) {
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", localtime(&entry->mtime));
+    }
+    char text[FTP_MAX_NAME + 64];
+    if (entry->is_dir) {
+        snprintf(text, sizeof(text), "[DIR] %-16s %12s  %s/", modified, "", entry->name);
+    } else {
+        snprintf(text, sizeof(text), "      %-16s %12lld  %s", modified, entry->size, entry->name);
+    }
     GtkWidget *row = gtk_list_box_row_new();
-    GtkWidget *label = gtk_label_new(line);
+    GtkWidget *label = gtk_label_new(text);
     gtk_label_set_xalign(GTK_LABEL(label), 0.0f);
     gtk_container_add(GTK_CONTAINER(row), label);
-    char *name = extract_filename(line);
-    if (name) {
-        g_object_set_data_full(G_OBJECT(row), "remote_name", name, g_free);
-    }
-    gboolean is_directory = (line[0] == 'd');
-    g_object_set_data(G_OBJECT(row), "is_directory", GINT_TO_POINTER(is_directory ? 1 : 0));
+    g_object_set_data_full(G_OBJECT(row), "remote_name", g_strdup(entry->name), g_free);
+    g_object_set_data(G_OBJECT(row), "is_directory", GINT_TO_POINTER(entry->is_dir ? 1 : 0));
+    long long *size = g_new(long long, 1);
+    *size = entry->size;
+    g_object_set_data_full(G_OBJECT(row), "remote_size", size, g_free);
     gtk_container_add(GTK_CONTAINER(file_list_box), row);
     gtk_widget_show_all(row);
 }
 
+// Directories first, then by name; the list box keeps rows in this order
+// as they stream in.
+static gint compare_remote_rows(GtkListBoxRow *a, GtkListBoxRow *b, gpointer data) {
+    (void)data;
+    int left_dir = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(a), "is_directory"));
+    int right_dir = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(b), "is_directory"));
+    if (left_dir != right_dir) return right_dir - left_dir;
+    const char *left = g_object_get_data(G_OBJECT(a), "remote_name");
+    const char *right = g_object_get_data(G_OBJECT(b), "remote_name");
+    return g_utf8_collate(left ? left : "", right ? right : "");
+}
+
+// Background jobs. Commands that can take long run on a worker thread that
+// owns the control connection until it finishes; the GTK thread only sees
+// the results through g_idle_add() callbacks. One job runs at a time.
+#define JOB_PROGRESS_INTERVAL_US 100000  // at most ~10 progress updates per second
+#define JOB_LIST_BATCH 256
+
+typedef enum {
+    JOB_UPLOAD,
+    JOB_DOWNLOAD,
+    JOB_LIST
+} job_kind_t;
+
+typedef struct {
+    job_kind_t kind;
+    char *local_file;
+    char *remote_file;
+    GThread *thread;
+    gint cancel;                // set from the GTK thread, polled by the worker
+    gint64 started_us;
+
+    // Progress shared with the GTK thread.
+    GMutex lock;
+    long long done;
+    long long total;
+    gint64 last_post_us;
+    gboolean update_pending;    // an idle callback is already queued
+
+    // Worker-only state.
+    ftp_entry_t *batch;
+    size_t batch_len;
+    size_t entries;
+    int result;
+    int saved_errno;
+} transfer_job_t;
+
+typedef struct {
+    ftp_entry_t *entries;
+    size_t count;
+    size_t total;
+} list_batch_t;
+
+static transfer_job_t *active_job;
+
+static void on_refresh_clicked(GtkWidget *widget, gpointer data);
+static void handle_connection_error(void);
+
+static void set_job_state(gboolean busy) {
+    GtkWidget *controls[] = { disconnect_button, refresh_button, upload_button, download_button,
+                              change_dir_button, delete_button, move_button };
+    for (size_t i = 0; i < sizeof(controls) / sizeof(controls[0]); i++) {
+        gtk_widget_set_sensitive(controls[i], !busy && connected);
+    }
+    gtk_widget_set_sensitive(cancel_button, busy);
+}
+
+static void format_bytes(char *out, size_t size, double bytes) {
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    int unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        unit++;
+    }
+    snprintf(out, size, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+}
+
+static gboolean on_job_progress(gpointer data) {
+    transfer_job_t *job = data;
+    g_mutex_lock(&job->lock);
+    long long done = job->done;
+    long long total = job->total;
+    job->update_pending = FALSE;
+    g_mutex_unlock(&job->lock);
+
+    double elapsed = (g_get_monotonic_time() - job->started_us) / 1e6;
+    double rate = elapsed > 0 ? done / elapsed : 0;
+    char done_text[32], rate_text[32], status_msg[160];
+    format_bytes(done_text, sizeof(done_text), (double)done);
+    format_bytes(rate_text, sizeof(rate_text), rate);
+    const char *verb = job->kind == JOB_UPLOAD ? "Uploading" : "Downloading";
+    if (total > 0) {
+        char total_text[32];
+        format_bytes(total_text, sizeof(total_text), (double)total);
+        double fraction = (double)done / (double)total;
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(transfer_progress_bar), fraction > 1.0 ? 1.0 : fraction);
+        if (rate > 0 && done < total) {
+            long eta = (long)((total - done) / rate);
+            snprintf(status_msg, sizeof(status_msg), "%s %s of %s • %s/s • %ld:%02ld left",
+                     verb, done_text, total_text, rate_text, eta / 60, eta % 60);
+        } else {
+            snprintf(status_msg, sizeof(status_msg), "%s %s of %s • %s/s", verb, done_text, total_text, rate_text);
+        }
+    } else {
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(transfer_progress_bar));
+        snprintf(status_msg, sizeof(status_msg), "%s %s • %s/s", verb, done_text, rate_text);
+    }
+    update_status(status_msg);
+    return G_SOURCE_REMOVE;
+}
+
+// Worker side of the progress hook. Chunks arrive far more often than the
+// UI can use them, so updates are coalesced to one queued idle callback at
+// a time and at most one per JOB_PROGRESS_INTERVAL_US.
+static int on_transfer_progress(long long done, long long total, void *ctx) {
+    transfer_job_t *job = ctx;
+    if (g_atomic_int_get(&job->cancel)) {
+        return -1;
+    }
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&job->lock);
+    job->done = done;
+    job->total = total;
+    gboolean post = !job->update_pending && (now - job->last_post_us >= JOB_PROGRESS_INTERVAL_US || done == total);
+    if (post) {
+        job->update_pending = TRUE;
+        job->last_post_us = now;
+    }
+    g_mutex_unlock(&job->lock);
+    if (post) {
+        g_idle_add(on_job_progress, job);
+    }
+    return 0;
+}
+
+static gboolean on_list_batch(gpointer data) {
+    list_batch_t *batch = data;
+    for (size_t i = 0; i < batch->count; i++) {
+        add_remote_row(&batch->entries[i]);
+    }
+    char status_msg[64];
+    snprintf(status_msg, sizeof(status_msg), "Loading file list... %zu entries", batch->total);
+    update_status(status_msg);
+    g_free(batch->entries);
+    g_free(batch);
+    return G_SOURCE_REMOVE;
+}
+
+static void post_list_batch(transfer_job_t *job) {
+    if (job->batch_len == 0) return;
+    list_batch_t *batch = g_new(list_batch_t, 1);
+    batch->entries = job->batch;
+    batch->count = job->batch_len;
+    batch->total = job->entries;
+    job->batch = NULL;
+    job->batch_len = 0;
+    g_idle_add(on_list_batch, batch);
+}
+
+// Rows are handed to the GTK thread in batches as the listing streams in.
+static int on_remote_entry(const ftp_entry_t *entry, void *ctx) {
+    transfer_job_t *job = ctx;
+    if (g_atomic_int_get(&job->cancel)) {
+        return -1;
+    }
+    if (!job->batch) {
+        job->batch = g_new(ftp_entry_t, JOB_LIST_BATCH);
+    }
+    job->batch[job->batch_len++] = *entry;
+    job->entries++;
+    if (job->batch_len == JOB_LIST_BATCH) {
+        post_list_batch(job);
+    }
+    return 0;
+}
+
+static void free_job(transfer_job_t *job) {
+    g_mutex_clear(&job->lock);
+    g_free(job->batch);
+    g_free(job->local_file);
+    g_free(job->remote_file);
+    g_free(job);
+}
+
+static gboolean on_job_finished(gpointer data) {
+    transfer_job_t *job = data;
+    g_thread_join(job->thread);
+    active_job = NULL;
+
+    gboolean cancelled = g_atomic_int_get(&job->cancel) != 0;
+    gboolean refresh = FALSE;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(transfer_progress_bar), job->result == 0 ? 1.0 : 0.0);
+    set_job_state(FALSE);
+
+    if (job->result == 0) {
+        if (job->kind == JOB_UPLOAD) {
+            update_status("File uploaded successfully");
+            refresh = TRUE;
+        } else if (job->kind == JOB_DOWNLOAD) {
+            update_status("File downloaded successfully");
+        } else {
+            update_status("File list refreshed");
+        }
+    } else if (!client.connected) {
+        handle_connection_error();
+    } else if (cancelled || job->saved_errno == ECANCELED) {
+        update_status(job->kind == JOB_LIST ? "File list cancelled" : "Transfer cancelled");
+    } else if (job->kind == JOB_UPLOAD) {
+        update_status("Upload failed");
+    } else if (job->kind == JOB_DOWNLOAD) {
+        update_status("Download failed");
+    } else {
+        update_status("Failed to refresh file list");
+    }
+    free_job(job);
+
+    if (refresh) {
+        on_refresh_clicked(NULL, NULL);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer job_thread(gpointer data) {
+    transfer_job_t *job = data;
+    switch (job->kind) {
+    case JOB_UPLOAD:
+        ftp_set_progress(&client, on_transfer_progress, job);
+        job->result = ftp_stor(&client, job->local_file, job->remote_file);
+        break;
+    case JOB_DOWNLOAD:
+        ftp_set_progress(&client, on_transfer_progress, job);
+        job->result = ftp_retr(&client, job->remote_file, job->local_file);
+        break;
+    case JOB_LIST:
+        job->result = ftp_list_entries_stream(&client, on_remote_entry, job);
+        post_list_batch(job);
+        break;
+    }
+    job->saved_errno = errno;
+    ftp_set_progress(&client, NULL, NULL);
+    g_idle_add(on_job_finished, job);
+    return NULL;
+}
+
+static gboolean start_job(job_kind_t kind, const char *local_file, const char *remote_file) {
+    if (active_job) {
+        update_status("Another operation is still running");
+        return FALSE;
+    }
+    transfer_job_t *job = g_new0(transfer_job_t, 1);
+    job->kind = kind;
+    job->local_file = g_strdup(local_file);
+    job->remote_file = g_strdup(remote_file);
+    job->total = -1;
+    job->started_us = g_get_monotonic_time();
+    g_mutex_init(&job->lock);
+
+    active_job = job;
+    set_job_state(TRUE);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(transfer_progress_bar), 0.0);
+    job->thread = g_thread_new("ftp-job", job_thread, job);
+    return TRUE;
+}
+
+static void on_cancel_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    if (!active_job) return;
+    g_atomic_int_set(&active_job->cancel, 1);
+    update_status("Cancelling...");
+}
+
+// Transfer queue. Items run on their own pooled sessions (see ftp_pool_t),
+// so a batch of files keeps several data connections busy while the main
+// connection stays free for browsing. Workers always take the smallest
+// ready item first and retry failed items a few times with a delay.
+#define QUEUE_MAX_SESSIONS 8
+#define QUEUE_DEFAULT_SESSIONS 3
+#define QUEUE_MAX_ATTEMPTS 3
+#define QUEUE_RETRY_DELAY_US (2 * G_USEC_PER_SEC)
+
+typedef enum {
+    ITEM_QUEUED,
+    ITEM_ACTIVE,
+    ITEM_DONE,
+    ITEM_FAILED,
+    ITEM_CANCELLED
+} item_state_t;
+
+typedef struct {
+    job_kind_t kind;            // JOB_UPLOAD or JOB_DOWNLOAD
+    char *local_file;
+    char *remote_file;
+    char *remote_dir;           // remote directory at the time it was queued
+    long long size;             // ordering key, -1 when unknown (sorts last)
+    guint64 seq;
+
+    // Guarded by transfer_queue.lock.
+    item_state_t state;
+    int attempts;
+    gint64 retry_at_us;
+    gint64 started_us;
+    long long done;
+    long long total;
+    gint64 last_post_us;
+    gboolean update_pending;
+    gint cancel;
+
+    // GTK thread only.
+    GtkWidget *row;
+    GtkWidget *label;
+    GtkWidget *bar;
+} queue_item_t;
+
+// Workers and sessions of one connection. Disconnecting only marks it
+// stopping: a worker stuck in connect() or a stalled transfer cannot be
+// interrupted, so the last worker to leave frees it instead of the GTK
+// thread waiting for them.
+typedef struct {
+    ftp_pool_t *pool;
+    int running;                // worker threads alive, guarded by transfer_queue.lock
+    gboolean stopping;
+    char ip[16];
+    int port;
+    char username[64];
+    char password[64];
+} queue_gen_t;
+
+static struct {
+    GMutex lock;
+    GCond changed;
+    GPtrArray *items;           // everything shown in the queue view
+    int max_sessions;
+    guint64 next_seq;
+    queue_gen_t *gen;           // current connection, NULL when disconnected
+} transfer_queue;
+
+static GtkWidget *queue_list_box;
+static GtkWidget *queue_sessions_spin;
+static char remote_cwd[FTP_MAX_PATH];
+
+// Queued items run in the directory the user was browsing; PWD replies
+// carry the path in quotes.
+static void set_remote_cwd(const char *pwd_reply) {
+    const char *start = pwd_reply[0] == '"' ? pwd_reply + 1 : pwd_reply;
+    snprintf(remote_cwd, sizeof(remote_cwd), "%s", start);
+    char *end = strrchr(remote_cwd, '"');
+    if (end) *end = '\0';
+}
+
+static gboolean item_finished(item_state_t state) {
+    return state == ITEM_DONE || state == ITEM_FAILED || state == ITEM_CANCELLED;
+}
+
+static gboolean on_queue_item_update(gpointer data);
+
+static void queue_post_update_locked(queue_item_t *item) {
+    if (!item->update_pending) {
+        item->update_pending = TRUE;
+        g_idle_add(on_queue_item_update, item);
+    }
+}
+
+// Smallest ready item, or NULL. *wait_until_us is set to the earliest retry
+// time when only delayed items are left, and to 0 when nothing is queued.
+static queue_item_t *queue_pick_locked(gint64 *wait_until_us) {
+    queue_item_t *best = NULL;
+    gint64 now = g_get_monotonic_time();
+    *wait_until_us = 0;
+    for (guint i = 0; i < transfer_queue.items->len; i++) {
+        queue_item_t *item = g_ptr_array_index(transfer_queue.items, i);
+        if (item->state != ITEM_QUEUED) continue;
+        if (item->retry_at_us > now) {
+            if (*wait_until_us == 0 || item->retry_at_us < *wait_until_us) {
+                *wait_until_us = item->retry_at_us;
+            }
+            continue;
+        }
+        if (!best) {
+            best = item;
+            continue;
+        }
+        unsigned long long size = (unsigned long long)item->size;  // -1 sorts last
+        unsigned long long best_size = (unsigned long long)best->size;
+        if (size < best_size || (size == best_size && item->seq < best->seq)) {
+            best = item;
+        }
+    }
+    return best;
+}
+
+static int on_queue_progress(long long done, long long total, void *ctx) {
+    queue_item_t *item = ctx;
+    if (g_atomic_int_get(&item->cancel)) {
+        return -1;
+    }
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&transfer_queue.lock);
+    item->done = done;
+    item->total = total;
+    if (now - item->last_post_us >= JOB_PROGRESS_INTERVAL_US) {
+        item->last_post_us = now;
+        queue_post_update_locked(item);
+    }
+    g_mutex_unlock(&transfer_queue.lock);
+    return 0;
+}
+
+static int queue_run_item(queue_gen_t *gen, queue_item_t *item) {
+    ftp_client_t *session = ftp_pool_acquire(gen->pool, gen->ip, gen->port, gen->username, gen->password);
+    if (!session) {
+        return -1;
+    }
+    int rc = -1;
+    if (item->remote_dir[0] == '\0' || ftp_cwd(session, item->remote_dir) == 0) {
+        ftp_set_progress(session, on_queue_progress, item);
+        rc = item->kind == JOB_UPLOAD ? ftp_stor(session, item->local_file, item->remote_file)
+                                      : ftp_retr(session, item->remote_file, item->local_file);
+    }
+    ftp_pool_release(gen->pool, session);
+    return rc;
+}
+
+static void queue_gen_free(queue_gen_t *gen) {
+    ftp_pool_destroy(gen->pool);
+    g_free(gen);
+}
+
+static gpointer queue_worker(gpointer data) {
+    queue_gen_t *gen = data;
+    g_mutex_lock(&transfer_queue.lock);
+    // Surplus workers (after the session count was lowered) leave between items.
+    while (!gen->stopping && gen->running <= transfer_queue.max_sessions) {
+        gint64 wait_until_us;
+        queue_item_t *item = queue_pick_locked(&wait_until_us);
+        if (!item) {
+            if (wait_until_us == 0) break;
+            g_cond_wait_until(&transfer_queue.changed, &transfer_queue.lock, wait_until_us);
+            continue;
+        }
+        item->state = ITEM_ACTIVE;
+        item->attempts++;
+        item->done = 0;
+        item->total = item->size;
+        item->started_us = g_get_monotonic_time();
+        queue_post_update_locked(item);
+        g_mutex_unlock(&transfer_queue.lock);
+
+        int rc = queue_run_item(gen, item);
+
+        g_mutex_lock(&transfer_queue.lock);
+        if (rc == 0) {
+            item->state = ITEM_DONE;
+        } else if (g_atomic_int_get(&item->cancel) || gen->stopping) {
+            item->state = ITEM_CANCELLED;
+        } else if (item->attempts < QUEUE_MAX_ATTEMPTS) {
+            item->state = ITEM_QUEUED;
+            item->retry_at_us = g_get_monotonic_time() + QUEUE_RETRY_DELAY_US * item->attempts;
+        } else {
+            item->state = ITEM_FAILED;
+        }
+        queue_post_update_locked(item);
+    }
+    gen->running--;
+    gboolean last = gen->stopping && gen->running == 0;
+    g_cond_broadcast(&transfer_queue.changed);
+    g_mutex_unlock(&transfer_queue.lock);
+    if (last) {
+        queue_gen_free(gen);
+    }
+    return NULL;
+}
+
+// Starts workers up to the session limit, but no more than there are
+// unfinished items to run.
+static void queue_kick_locked(void) {
+    int pending = 0;
+    for (guint i = 0; i < transfer_queue.items->len; i++) {
+        queue_item_t *item = g_ptr_array_index(transfer_queue.items, i);
+        if (!item_finished(item->state)) pending++;
+    }
+    queue_gen_t *gen = transfer_queue.gen;
+    while (gen && gen->running < transfer_queue.max_sessions && gen->running < pending) {
+        GThread *thread = g_thread_try_new("ftp-queue", queue_worker, gen, NULL);
+        if (!thread) break;
+        g_thread_unref(thread);
+        gen->running++;
+    }
+    g_cond_broadcast(&transfer_queue.changed);
+}
+
+static gboolean queue_is_idle_locked(void) {
+    for (guint i = 0; i < transfer_queue.items->len; i++) {
+        queue_item_t *item = g_ptr_array_index(transfer_queue.items, i);
+        if (!item_finished(item->state)) return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean on_queue_item_update(gpointer data) {
+    queue_item_t *item = data;
+    g_mutex_lock(&transfer_queue.lock);
+    item_state_t state = item->state;
+    int attempts = item->attempts;
+    long long done = item->done;
+    long long total = item->total;
+    gint64 started_us = item->started_us;
+    item->update_pending = FALSE;
+    gboolean refresh = state == ITEM_DONE && item->kind == JOB_UPLOAD && queue_is_idle_locked();
+    g_mutex_unlock(&transfer_queue.lock);
+
+    const char *name = item->kind == JOB_UPLOAD ? item->local_file : item->remote_file;
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    char detail[96] = "";
+    double fraction = 0.0;
+    switch (state) {
+    case ITEM_QUEUED:
+        if (attempts > 0) {
+            snprintf(detail, sizeof(detail), "retrying (attempt %d of %d)", attempts + 1, QUEUE_MAX_ATTEMPTS);
+        } else {
+            snprintf(detail, sizeof(detail), "queued");
+        }
+        break;
+    case ITEM_ACTIVE: {
+        double elapsed = (g_get_monotonic_time() - started_us) / 1e6;
+        char rate_text[32];
+        format_bytes(rate_text, sizeof(rate_text), elapsed > 0 ? done / elapsed : 0);
+        if (total > 0) {
+            fraction = (double)done / (double)total;
+            snprintf(detail, sizeof(detail), "%d%% • %s/s", (int)(fraction * 100), rate_text);
+        } else {
+            snprintf(detail, sizeof(detail), "%s/s", rate_text);
+        }
+        break;
+    }
+    case ITEM_DONE:
+        fraction = 1.0;
+        snprintf(detail, sizeof(detail), "done");
+        break;
+    case ITEM_FAILED:
+        snprintf(detail, sizeof(detail), "failed after %d attempts", attempts);
+        break;
+    case ITEM_CANCELLED:
+        snprintf(detail, sizeof(detail), "cancelled");
+        break;
+    }
+    char text[FTP_MAX_PATH + 128];
+    snprintf(text, sizeof(text), "%s %s — %s", item->kind == JOB_UPLOAD ? "↑" : "↓", base, detail);
+    gtk_label_set_text(GTK_LABEL(item->label), text);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(item->bar), fraction > 1.0 ? 1.0 : fraction);
+
+    if (refresh) {
+        on_refresh_clicked(NULL, NULL);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_add(job_kind_t kind, const char *local_file, const char *remote_file, long long size) {
+    if (!transfer_queue.gen) return;
+    queue_item_t *item = g_new0(queue_item_t, 1);
+    item->kind = kind;
+    item->local_file = g_strdup(local_file);
+    item->remote_file = g_strdup(remote_file);
+    item->remote_dir = g_strdup(remote_cwd);
+    item->size = size;
+
+    item->row = gtk_list_box_row_new();
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    item->label = gtk_label_new("");
+    gtk_label_set_xalign(GTK_LABEL(item->label), 0.0f);
+    item->bar = gtk_progress_bar_new();
+    gtk_widget_set_size_request(item->bar, 120, -1);
+    gtk_box_pack_start(GTK_BOX(box), item->label, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(box), item->bar, FALSE, FALSE, 0);
+    gtk_container_add(GTK_CONTAINER(item->row), box);
+    gtk_container_add(GTK_CONTAINER(queue_list_box), item->row);
+    gtk_widget_show_all(item->row);
+
+    g_mutex_lock(&transfer_queue.lock);
+    item->seq = transfer_queue.next_seq++;
+    item->state = ITEM_QUEUED;
+    g_ptr_array_add(transfer_queue.items, item);
+    queue_post_update_locked(item);
+    queue_kick_locked();
+    g_mutex_unlock(&transfer_queue.lock);
+}
+
+static void queue_cancel_all_locked(void) {
+    for (guint i = 0; i < transfer_queue.items->len; i++) {
+        queue_item_t *item = g_ptr_array_index(transfer_queue.items, i);
+        if (item->state == ITEM_QUEUED) {
+            item->state = ITEM_CANCELLED;
+            queue_post_update_locked(item);
+        } else if (item->state == ITEM_ACTIVE) {
+            g_atomic_int_set(&item->cancel, 1);
+        }
+    }
+}
+
+static void queue_start(const char *ip, int port, const char *username, const char *password) {
+    queue_gen_t *gen = g_new0(queue_gen_t, 1);
+    snprintf(gen->ip, sizeof(gen->ip), "%s", ip);
+    gen->port = port;
+    snprintf(gen->username, sizeof(gen->username), "%s", username);
+    snprintf(gen->password, sizeof(gen->password), "%s", password);
+    gen->pool = ftp_pool_create(QUEUE_MAX_SESSIONS);
+    g_mutex_lock(&transfer_queue.lock);
+    transfer_queue.gen = gen;
+    g_mutex_unlock(&transfer_queue.lock);
+}
+
+// Cancels everything without waiting: busy workers give up once their
+// progress hook sees the cancel flag, or when their blocking call returns.
+static void queue_stop(void) {
+    g_mutex_lock(&transfer_queue.lock);
+    queue_gen_t *gen = transfer_queue.gen;
+    transfer_queue.gen = NULL;
+    if (!gen) {
+        g_mutex_unlock(&transfer_queue.lock);
+        return;
+    }
+    gen->stopping = TRUE;
+    queue_cancel_all_locked();
+    g_cond_broadcast(&transfer_queue.changed);
+    gboolean idle = gen->running == 0;
+    g_mutex_unlock(&transfer_queue.lock);
+    if (idle) {
+        queue_gen_free(gen);
+    }
+}
+
+static void on_queue_cancel_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    g_mutex_lock(&transfer_queue.lock);
+    queue_cancel_all_locked();
+    g_mutex_unlock(&transfer_queue.lock);
+}
+
+static void on_queue_clear_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    g_mutex_lock(&transfer_queue.lock);
+    for (guint i = 0; i < transfer_queue.items->len; ) {
+        queue_item_t *item = g_ptr_array_index(transfer_queue.items, i);
+        // An item with a queued update is still referenced by the main loop.
+        if (!item_finished(item->state) || item->update_pending) {
+            i++;
+            continue;
+        }
+        g_ptr_array_remove_index(transfer_queue.items, i);
+        gtk_widget_destroy(item->row);
+        g_free(item->local_file);
+        g_free(item->remote_file);
+        g_free(item->remote_dir);
+        g_free(item);
+    }
+    g_mutex_unlock(&transfer_queue.lock);
+}
+
+static void on_queue_sessions_changed(GtkSpinButton *spin, gpointer data) {
+    (void)data;
+    g_mutex_lock(&transfer_queue.lock);
+    transfer_queue.max_sessions = gtk_spin_button_get_value_as_int(spin);
+    queue_kick_locked();
+    g_mutex_unlock(&transfer_queue.lock);
+}
+
+static void on_queue_uploads_clicked(GtkWidget *widget, gpointer data) {
+    (void)data;
+    if (!connected) return;
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(
+        "Queue Files for Upload",
+        GTK_WINDOW(gtk_widget_get_toplevel(widget)),
+        GTK_FILE_CHOOSER_ACTION_OPEN,
+        "_Cancel", GTK_RESPONSE_CANCEL,
+        "_Queue", GTK_RESPONSE_ACCEPT,
+        NULL);
+    gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        GSList *files = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+        for (GSList *iter = files; iter != NULL; iter = iter->next) {
+            const char *path = iter->data;
+            struct stat st;
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+            const char *base = strrchr(path, '/');
+            queue_add(JOB_UPLOAD, path, base ? base + 1 : path, (long long)st.st_size);
+        }
+        g_slist_free_full(files, g_free);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+static void queue_download_row(GtkListBoxRow *row) {
+    if (GPOINTER_TO_INT(g_object_get_data(G_OBJECT(row), "is_directory")) != 0) return;
+    const char *name = g_object_get_data(G_OBJECT(row), "remote_name");
+    const long long *size = g_object_get_data(G_OBJECT(row), "remote_size");
+    if (!name || strlen(name) == 0) return;
+    const char *base_dir = gtk_entry_get_text(GTK_ENTRY(working_dir_entry));
+    char cwd_buffer[PATH_MAX];
+    if (!base_dir || strlen(base_dir) == 0) {
+        if (!getcwd(cwd_buffer, sizeof(cwd_buffer))) return;
+        base_dir = cwd_buffer;
+    }
+    char local_path[PATH_MAX];
+    snprintf(local_path, sizeof(local_path), "%s/%s", base_dir, name);
+    queue_add(JOB_DOWNLOAD, local_path, name, size ? *size : -1);
+}
+
+static void on_queue_selected_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    if (!connected) return;
+    GtkListBoxRow *row = gtk_list_box_get_selected_row(GTK_LIST_BOX(file_list_box));
+    if (!row) {
+        update_status("Select a remote file to queue");
+        return;
+    }
+    queue_download_row(row);
+}
+
+static void on_queue_all_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    if (!connected) return;
+    GList *children = gtk_container_get_children(GTK_CONTAINER(file_list_box));
+    for (GList *iter = children; iter != NULL; iter = iter->next) {
+        queue_download_row(GTK_LIST_BOX_ROW(iter->data));
+    }
+    g_list_free(children);
+}
+
 static void set_connection_state(gboolean is_connected) {
     connected = is_connected;
     gtk_widget_set_sensitive(connect_button, !is_connected);
@@ -84,7 +818,9 @@ static void set_connection_state(gboolean is_connected) {
     gtk_widget_set_sensitive(move_button, is_connected);
     gtk_widget_set_sensitive(move_target_entry, is_connected);
     gtk_widget_set_sensitive(remote_dir_entry, is_connected);
+    gtk_widget_set_sensitive(cancel_button, FALSE);
     if (!is_connected) {
+        queue_stop();
         clear_file_list();
     }
 }
@@ -117,10 +853,6 @@ static void fill_local_from_workdir(const char *remote_file) {
     gtk_entry_set_text(GTK_ENTRY(local_file_entry), path_buffer);
 }
 
-static void update_status(const char *message) {
-    gtk_label_set_text(GTK_LABEL(status_label), message);
-}
-
 static void on_connect_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data; // Suppress unused parameter warnings
     if (connected) return;
@@ -153,9 +885,12 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data) {
     }
     
     set_connection_state(TRUE);
+    queue_start(ip, port, username, password);
 
     char path[FTP_BUFFER_SIZE];
+    remote_cwd[0] = '\0';
     if (ftp_pwd(&client, path, sizeof(path)) == 0) {
+        set_remote_cwd(path);
         char status_msg[FTP_BUFFER_SIZE];
         snprintf(status_msg, sizeof(status_msg), "Connected to %s:%d • %s", ip, port, path);
         update_status(status_msg);
@@ -168,7 +903,7 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data) {
 
 static void on_disconnect_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data; // Suppress unused parameter warnings
-    if (!connected) return;
+    if (!connected || active_job) return;
     
     ftp_disconnect(&client);
     set_connection_state(FALSE);
@@ -185,32 +920,11 @@ static void handle_connection_error(void) {
 
 static void on_refresh_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data;
-    if (!connected) return;
-    
-    char buffer[FTP_BUFFER_SIZE];
-    if (ftp_list(&client, buffer, sizeof(buffer)) == 0) {
-        clear_file_list();
-        char *cursor = buffer;
-        while (cursor && *cursor) {
-            char *line_end = strchr(cursor, '\n');
-            if (line_end) {
-                *line_end = '\0';
-            }
-            g_strstrip(cursor);
-            if (strlen(cursor) > 0) {
-                add_remote_row(cursor);
-            }
-            if (!line_end) break;
-            cursor = line_end + 1;
-        }
-        update_status("File list refreshed");
-    } else {
-        if (!client.connected) {
-            handle_connection_error();
-        } else {
-            update_status("Failed to refresh file list");
-        }
-    }
+    if (!connected || active_job) return;
+
+    clear_file_list();
+    update_status("Loading file list...");
+    start_job(JOB_LIST, NULL, NULL);
 }
 
 static void on_upload_clicked(GtkWidget *widget, gpointer data) {
@@ -225,16 +939,7 @@ static void on_upload_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
     
-    if (ftp_stor(&client, local_file, remote_file) == 0) {
-        update_status("File uploaded successfully");
-        on_refresh_clicked(NULL, NULL);
-    } else {
-        if (!client.connected) {
-            handle_connection_error();
-        } else {
-            update_status("Upload failed");
-        }
-    }
+    start_job(JOB_UPLOAD, local_file, remote_file);
 }
 
 static void on_download_clicked(GtkWidget *widget, gpointer data) {
@@ -252,15 +957,7 @@ static void on_download_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
     
-    if (ftp_retr(&client, remote_file, local_file) == 0) {
-        update_status("File downloaded successfully");
-    } else {
-        if (!client.connected) {
-            handle_connection_error();
-        } else {
-            update_status("Download failed");
-        }
-    }
+    start_job(JOB_DOWNLOAD, local_file, remote_file);
 }
 
 static void on_select_local_file_clicked(GtkWidget *widget, gpointer data) {
@@ -361,10 +1058,14 @@ static void on_remote_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointe
 
 static void on_change_dir_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data;
-    if (!connected) return;
+    if (!connected || active_job) return;
     const char *path = gtk_entry_get_text(GTK_ENTRY(remote_dir_entry));
     if (!path || strlen(path) == 0) return;
     if (ftp_cwd(&client, path) == 0) {
+        char cwd_reply[FTP_MAX_PATH];
+        if (ftp_pwd(&client, cwd_reply, sizeof(cwd_reply)) == 0) {
+            set_remote_cwd(cwd_reply);
+        }
         update_status("Changed remote directory");
         on_refresh_clicked(NULL, NULL);
     } else {
@@ -378,7 +1079,7 @@ static void on_change_dir_clicked(GtkWidget *widget, gpointer data) {
 
 static void on_delete_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data;
-    if (!connected) return;
+    if (!connected || active_job) return;
     const char *name = get_selected_remote();
     if (!name || strlen(name) == 0) return;
     if (ftp_dele(&client, name) == 0) {
@@ -395,7 +1096,7 @@ static void on_delete_clicked(GtkWidget *widget, gpointer data) {
 
 static void on_move_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data;
-    if (!connected) return;
+    if (!connected || active_job) return;
     const char *name = get_selected_remote();
     const char *target = gtk_entry_get_text(GTK_ENTRY(move_target_entry));
     if (!name || !target || strlen(target) == 0) return;
@@ -422,6 +1123,13 @@ static void on_move_clicked(GtkWidget *widget, gpointer data) {
 
 static void on_destroy(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data; // Suppress unused parameter warnings
+    if (active_job) {
+        // The pending on_job_finished() never runs once the main loop quits.
+        g_atomic_int_set(&active_job->cancel, 1);
+        g_thread_join(active_job->thread);
+        active_job = NULL;
+    }
+    queue_stop();
     if (connected) {
         ftp_disconnect(&client);
     }
@@ -432,10 +1140,14 @@ int main(int argc, char *argv[]) {
     gtk_init(&argc, &argv);
     
     memset(&client, 0, sizeof(client));
+    g_mutex_init(&transfer_queue.lock);
+    g_cond_init(&transfer_queue.changed);
+    transfer_queue.items = g_ptr_array_new();
+    transfer_queue.max_sessions = QUEUE_DEFAULT_SESSIONS;
     
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "FTP Client");
-    gtk_window_set_default_size(GTK_WINDOW(window), 700, 600);
+    gtk_window_set_default_size(GTK_WINDOW(window), 700, 760);
     g_signal_connect(window, "destroy", G_CALLBACK(on_destroy), NULL);
     
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
@@ -547,6 +1259,7 @@ int main(int argc, char *argv[]) {
                                    GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     file_list_box = gtk_list_box_new();
     gtk_list_box_set_selection_mode(GTK_LIST_BOX(file_list_box), GTK_SELECTION_SINGLE);
+    gtk_list_box_set_sort_func(GTK_LIST_BOX(file_list_box), compare_remote_rows, NULL, NULL);
     g_signal_connect(file_list_box, "row-activated", G_CALLBACK(on_remote_row_activated), NULL);
     gtk_container_add(GTK_CONTAINER(scrolled), file_list_box);
     gtk_box_pack_start(GTK_BOX(list_vbox), scrolled, TRUE, TRUE, 0);
@@ -630,8 +1343,58 @@ int main(int argc, char *argv[]) {
     gtk_box_pack_start(GTK_BOX(transfer_button_box), local_file_browse_button, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(transfer_button_box), save_path_button, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(transfer_vbox), transfer_button_box, FALSE, FALSE, 0);
+
+    GtkWidget *progress_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    transfer_progress_bar = gtk_progress_bar_new();
+    cancel_button = gtk_button_new_with_label("Cancel");
+    gtk_widget_set_sensitive(cancel_button, FALSE);
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(on_cancel_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(progress_box), transfer_progress_bar, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(progress_box), cancel_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(transfer_vbox), progress_box, FALSE, FALSE, 0);
     
     gtk_box_pack_start(GTK_BOX(vbox), transfer_frame, FALSE, FALSE, 0);
+
+    // Transfer queue
+    GtkWidget *queue_frame = gtk_frame_new("Transfer Queue");
+    GtkWidget *queue_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_container_add(GTK_CONTAINER(queue_frame), queue_vbox);
+    gtk_container_set_border_width(GTK_CONTAINER(queue_vbox), 5);
+
+    GtkWidget *queue_button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *queue_uploads_button = gtk_button_new_with_label("Queue Uploads...");
+    GtkWidget *queue_selected_button = gtk_button_new_with_label("Queue Selected");
+    GtkWidget *queue_all_button = gtk_button_new_with_label("Queue All Files");
+    GtkWidget *queue_cancel_button = gtk_button_new_with_label("Cancel All");
+    GtkWidget *queue_clear_button = gtk_button_new_with_label("Clear Finished");
+    GtkWidget *sessions_label = gtk_label_new("Sessions:");
+    queue_sessions_spin = gtk_spin_button_new_with_range(1, QUEUE_MAX_SESSIONS, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(queue_sessions_spin), QUEUE_DEFAULT_SESSIONS);
+    g_signal_connect(queue_uploads_button, "clicked", G_CALLBACK(on_queue_uploads_clicked), NULL);
+    g_signal_connect(queue_selected_button, "clicked", G_CALLBACK(on_queue_selected_clicked), NULL);
+    g_signal_connect(queue_all_button, "clicked", G_CALLBACK(on_queue_all_clicked), NULL);
+    g_signal_connect(queue_cancel_button, "clicked", G_CALLBACK(on_queue_cancel_clicked), NULL);
+    g_signal_connect(queue_clear_button, "clicked", G_CALLBACK(on_queue_clear_clicked), NULL);
+    g_signal_connect(queue_sessions_spin, "value-changed", G_CALLBACK(on_queue_sessions_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(queue_button_box), queue_uploads_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(queue_button_box), queue_selected_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(queue_button_box), queue_all_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(queue_button_box), queue_cancel_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(queue_button_box), queue_clear_button, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(queue_button_box), queue_sessions_spin, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(queue_button_box), sessions_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(queue_vbox), queue_button_box, FALSE, FALSE, 0);
+
+    GtkWidget *queue_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(queue_scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(queue_scrolled, -1, 120);
+    queue_list_box = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(queue_list_box), GTK_SELECTION_NONE);
+    gtk_container_add(GTK_CONTAINER(queue_scrolled), queue_list_box);
+    gtk_box_pack_start(GTK_BOX(queue_vbox), queue_scrolled, TRUE, TRUE, 0);
+
+    gtk_box_pack_start(GTK_BOX(vbox), queue_frame, TRUE, TRUE, 0);
     
     // Status
     status_label = gtk_label_new("Not connected");
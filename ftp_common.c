@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
 #include "ftp_common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 
 int send_ftp_response(int sockfd, int code, const char *message) {
     char response[FTP_MAX_LINE];
@@ -22,6 +29,115 @@ int read_ftp_command(int sockfd, char *buffer, size_t size) {
     return n;
 }
 
+void line_reader_init(ftp_line_reader_t *reader) {
+    reader->start = 0;
+    reader->len = 0;
+    reader->discarding = 0;
+}
+
+ssize_t line_reader_fill(ftp_line_reader_t *reader, int sockfd) {
+    size_t capacity = sizeof(reader->data);
+    if (reader->len == capacity) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    // Read into the contiguous free region after the buffered bytes.
+    size_t tail = (reader->start + reader->len) % capacity;
+    size_t room = (tail >= reader->start) ? capacity - tail : reader->start - tail;
+    if (reader->len == 0) {
+        reader->start = 0;
+        tail = 0;
+        room = capacity;
+    }
+    ssize_t n = recv(sockfd, reader->data + tail, room, 0);
+    if (n > 0) {
+        reader->len += (size_t)n;
+    }
+    return n;
+}
+
+// Shared by next and peek; the reader only advances when consume is set.
+static int line_reader_take(ftp_line_reader_t *reader, char *line, size_t size, int consume) {
+    size_t capacity = sizeof(reader->data);
+    size_t start = reader->start;
+    size_t len = reader->len;
+    int discarding = reader->discarding;
+    for (;;) {
+        size_t eol = 0;
+        int found = 0;
+        for (; eol < len; eol++) {
+            if (reader->data[(start + eol) % capacity] == '\n') {
+                found = 1;
+                break;
+            }
+        }
+        if (!found && len < capacity) {
+            return 0;
+        }
+
+        // A full buffer without a newline is emitted truncated; the rest of
+        // that line is skipped once its newline shows up.
+        size_t line_len = found ? eol : len;
+        size_t consumed = found ? eol + 1 : len;
+        int was_discarding = discarding;
+        discarding = !found;
+
+        if (!was_discarding && size > 0) {
+            size_t copy = line_len < size - 1 ? line_len : size - 1;
+            for (size_t i = 0; i < copy; i++) {
+                line[i] = reader->data[(start + i) % capacity];
+            }
+            while (copy > 0 && line[copy - 1] == '\r') {
+                copy--;
+            }
+            line[copy] = '\0';
+        }
+        start = (start + consumed) % capacity;
+        len -= consumed;
+        if (consume) {
+            reader->start = start;
+            reader->len = len;
+            reader->discarding = discarding;
+        }
+        if (!was_discarding) {
+            return 1;
+        }
+    }
+}
+
+int line_reader_next(ftp_line_reader_t *reader, char *line, size_t size) {
+    return line_reader_take(reader, line, size, 1);
+}
+
+int line_reader_peek(ftp_line_reader_t *reader, char *line, size_t size) {
+    return line_reader_take(reader, line, size, 0);
+}
+
+static int wait_readable(int sockfd) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int rc;
+    do {
+        rc = poll(&pfd, 1, -1);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0 ? 0 : -1;
+}
+
+int line_reader_read_line(ftp_line_reader_t *reader, int sockfd, char *line, size_t size) {
+    while (!line_reader_next(reader, line, size)) {
+        ssize_t n = line_reader_fill(reader, sockfd);
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_readable(sockfd) == 0) continue;
+            return -1;
+        }
+    }
+    return 1;
+}
+
 int parse_pasv_response(const char *response, char *ip, int *port) {
     // Handles both "227 Entering Passive Mode (...)" and "Entering Passive Mode (...)"
     if (!response || !ip || !port) {
@@ -64,15 +180,233 @@ int create_data_connection(const char *ip, int port) {
     return sockfd;
 }
 
+typedef struct {
+    const char *name;
+    int buffer;          // SO_SNDBUF/SO_RCVBUF; 0 keeps kernel autotuning
+    int notsent_lowat;   // 0 keeps the system default
+    int cork;
+    size_t chunk;
+} tune_settings_t;
+
+static const tune_settings_t tune_profiles[] = {
+    [FTP_TUNE_AUTO]   = { "auto",   0,               0,           1, 256 * 1024 },
+    [FTP_TUNE_LAN]    = { "lan",    0,               0,           1, 256 * 1024 },
+    [FTP_TUNE_WAN]    = { "wan",    8 * 1024 * 1024, 1024 * 1024, 1, 1024 * 1024 },
+    [FTP_TUNE_LOWMEM] = { "lowmem", 64 * 1024,       16 * 1024,   1, 16 * 1024 },
+};
+static int tune_profile = FTP_TUNE_AUTO;
+
+// Kernel limits, read once. -1 when unknown.
+static struct {
+    long wmem_max, rmem_max;     // cap on SO_SNDBUF/SO_RCVBUF
+    long autotune_max;           // smaller of the tcp_wmem/tcp_rmem maxima
+} tune_limits;
+static pthread_once_t tune_limits_once = PTHREAD_ONCE_INIT;
+
+static long read_sysctl(const char *path, int field) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long value = -1;
+    for (int i = 0; i <= field; i++) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static void tune_limits_load(void) {
+    tune_limits.wmem_max = read_sysctl("/proc/sys/net/core/wmem_max", 0);
+    tune_limits.rmem_max = read_sysctl("/proc/sys/net/core/rmem_max", 0);
+    long wmem = read_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2);
+    long rmem = read_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2);
+    tune_limits.autotune_max = wmem < 0 ? rmem : (rmem < 0 || wmem < rmem ? wmem : rmem);
+}
+
+int ftp_tune_set_profile(const char *name) {
+    for (size_t i = 0; i < sizeof(tune_profiles) / sizeof(tune_profiles[0]); i++) {
+        if (strcasecmp(name, tune_profiles[i].name) == 0) {
+            __atomic_store_n(&tune_profile, (int)i, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *ftp_tune_profile_name(void) {
+    return tune_profiles[__atomic_load_n(&tune_profile, __ATOMIC_RELAXED)].name;
+}
+
+void ftp_tune_control_socket(int sockfd) {
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Sizes buffers from the handshake RTT: a path whose bandwidth-delay
+// product outgrows what autotuning may reach gets fixed buffers of twice
+// the BDP. Anything shorter stays on the lan settings.
+static void tune_auto(int sockfd, tune_settings_t *t) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0) return;
+    long long want = 2 * (FTP_TUNE_AUTO_RATE * info.tcpi_rtt / 1000000);
+    long long ceiling = tune_limits.autotune_max > 0 ? tune_limits.autotune_max : 4 * 1024 * 1024;
+    if (want <= ceiling) return;
+    const tune_settings_t *wan = &tune_profiles[FTP_TUNE_WAN];
+    t->buffer = want < FTP_TUNE_MAX_BUFFER ? (int)want : FTP_TUNE_MAX_BUFFER;
+    t->notsent_lowat = wan->notsent_lowat;
+    t->chunk = wan->chunk;
+}
+
+size_t ftp_tune_data_socket(int sockfd, int sending) {
+    pthread_once(&tune_limits_once, tune_limits_load);
+    int profile = __atomic_load_n(&tune_profile, __ATOMIC_RELAXED);
+    tune_settings_t t = tune_profiles[profile];
+    if (profile == FTP_TUNE_AUTO) tune_auto(sockfd, &t);
+
+    // A data connection only moves bytes one way, so only that side is sized.
+    // The kernel clamps sizes to net.core.[wr]mem_max, and a clamped fixed
+    // buffer would be worse than autotuning, so those are left alone.
+    long limit = sending ? tune_limits.wmem_max : tune_limits.rmem_max;
+    if (t.buffer > 0 && (limit < 0 || t.buffer <= limit)) {
+        setsockopt(sockfd, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &t.buffer, sizeof(t.buffer));
+    }
+    if (sending) {
+#ifdef TCP_NOTSENT_LOWAT
+        if (t.notsent_lowat > 0) {
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t.notsent_lowat, sizeof(t.notsent_lowat));
+        }
+#endif
+        if (t.cork) {
+            int one = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+        }
+    }
+    return t.chunk;
+}
+
+static int wait_writable(int sockfd) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int rc;
+    do {
+        rc = poll(&pfd, 1, -1);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0 ? 0 : -1;
+}
+
+static int send_all(int sockfd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(sockfd) == 0) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+ssize_t send_file_chunk(int sockfd, int fd, off_t *offset, size_t count) {
+    ssize_t n;
+    do {
+        n = sendfile(sockfd, fd, offset, count);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static int report_progress(const ftp_progress_t *progress, long long bytes) {
+    if (progress && progress->on_chunk && progress->on_chunk(bytes, progress->ctx) < 0) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_fd_buffered(int sockfd, int fd, off_t *offset, long long *bytes_sent,
+                            const ftp_progress_t *progress, size_t chunk) {
+    char *buffer = malloc(chunk);
+    if (!buffer) return -1;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = offset ? pread(fd, buffer, chunk, *offset) : read(fd, buffer, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) break;
+        if (send_all(sockfd, buffer, (size_t)n) < 0) {
+            rc = -1;
+            break;
+        }
+        if (offset) *offset += n;
+        if (bytes_sent) *bytes_sent += n;
+        if (report_progress(progress, n) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return rc;
+}
+
+int send_fd_over_socket(int sockfd, int fd, off_t *offset, long long *bytes_sent,
+                        const ftp_progress_t *progress) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    size_t chunk = ftp_tune_data_socket(sockfd, 1);
+    if (!S_ISREG(st.st_mode)) {
+        // Pipes and devices cannot be sendfile()'d from; stream them instead.
+        return send_fd_buffered(sockfd, fd, NULL, bytes_sent, progress, chunk);
+    }
+
+    off_t local_offset = 0;
+    off_t *pos = offset ? offset : &local_offset;
+    int first = 1;
+    for (;;) {
+        ssize_t n = send_file_chunk(sockfd, fd, pos, chunk);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_writable(sockfd) < 0) return -1;
+                continue;
+            }
+            if (first && (errno == EINVAL || errno == ENOSYS)) {
+                // Filesystem without sendfile() support.
+                return send_fd_buffered(sockfd, fd, pos, bytes_sent, progress, chunk);
+            }
+            return -1;
+        }
+        if (n == 0) return 0;
+        first = 0;
+        if (bytes_sent) *bytes_sent += n;
+        if (report_progress(progress, n) < 0) return -1;
+    }
+}
+
 // *** ĐÃ THAY ĐỔI ***
 // Nhận FILE* thay vì const char*
 // Không còn fopen/fclose bên trong
 int send_file_over_socket(int sockfd, FILE *file) {
+    off_t offset = ftello(file);
+    if (offset >= 0) {
+        // sendfile() works on the descriptor, so resync the stream afterwards.
+        int rc = send_fd_over_socket(sockfd, fileno(file), &offset, NULL, NULL);
+        fseeko(file, offset, SEEK_SET);
+        return rc;
+    }
+
     char buffer[FTP_BUFFER_SIZE];
     size_t n;
     
     while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        if (send(sockfd, buffer, n, 0) != (ssize_t)n) {
+        if (send_all(sockfd, buffer, n) < 0) {
             // Lỗi send, file sẽ được đóng ở hàm gọi
             return -1;
         }
@@ -82,10 +416,133 @@ int send_file_over_socket(int sockfd, FILE *file) {
     return 0;
 }
 
+int splice_pipe_open(int pipefd[2]) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        pipefd[0] = pipefd[1] = -1;
+        return -1;
+    }
+    // Larger pipes mean fewer splice() round trips; the default is fine too.
+    fcntl(pipefd[1], F_SETPIPE_SZ, FTP_SPLICE_CHUNK);
+    return 0;
+}
+
+void splice_pipe_close(int pipefd[2]) {
+    if (pipefd[0] >= 0) close(pipefd[0]);
+    if (pipefd[1] >= 0) close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+int splice_target_ok(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && !(flags & O_APPEND);
+}
+
+ssize_t receive_file_chunk(int sockfd, const int pipefd[2], int fd, size_t count) {
+    ssize_t in;
+    do {
+        in = splice(sockfd, NULL, pipefd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (in < 0 && errno == EINTR);
+    if (in <= 0) return in;
+
+    size_t left = (size_t)in;
+    while (left > 0) {
+        ssize_t out = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR) continue;
+        if (out <= 0) {
+            // Short write on the file side: the socket data is already consumed.
+            if (out == 0) errno = EIO;
+            return -2;
+        }
+        left -= (size_t)out;
+    }
+    return in;
+}
+
+static int receive_fd_buffered(int sockfd, int fd, long long *bytes_received,
+                               const ftp_progress_t *progress, size_t chunk) {
+    char *buffer = malloc(chunk);
+    if (!buffer) return -1;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = recv(sockfd, buffer, chunk, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) break;
+        const char *p = buffer;
+        size_t left = (size_t)n;
+        while (left > 0) {
+            ssize_t w = write(fd, p, left);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            p += w;
+            left -= (size_t)w;
+        }
+        if (left > 0) {
+            rc = -1;
+            break;
+        }
+        if (bytes_received) *bytes_received += n;
+        if (report_progress(progress, n) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return rc;
+}
+
+int receive_socket_to_fd(int sockfd, int fd, long long *bytes_received, const ftp_progress_t *progress) {
+    size_t chunk = ftp_tune_data_socket(sockfd, 0);
+    if (!splice_target_ok(fd)) {
+        return receive_fd_buffered(sockfd, fd, bytes_received, progress, chunk);
+    }
+    int pipefd[2];
+    if (splice_pipe_open(pipefd) < 0) {
+        return receive_fd_buffered(sockfd, fd, bytes_received, progress, chunk);
+    }
+
+    int rc = 0;
+    int first = 1;
+    for (;;) {
+        ssize_t n = receive_file_chunk(sockfd, pipefd, fd, chunk);
+        if (n > 0) {
+            first = 0;
+            if (bytes_received) *bytes_received += n;
+            if (report_progress(progress, n) < 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        if (n == 0) break;
+        if (n == -1 && first && (errno == EINVAL || errno == ENOSYS)) {
+            // Nothing consumed yet, so the copy loop can take over cleanly.
+            rc = receive_fd_buffered(sockfd, fd, bytes_received, progress, chunk);
+            break;
+        }
+        rc = -1;
+        break;
+    }
+    splice_pipe_close(pipefd);
+    return rc;
+}
+
 // *** ĐÃ THAY ĐỔI ***
 // Nhận FILE* thay vì const char*
 // Không còn fopen/fclose bên trong
 int receive_file_over_socket(int sockfd, FILE *file) {
+    if (fflush(file) == 0 && splice_target_ok(fileno(file))) {
+        int rc = receive_socket_to_fd(sockfd, fileno(file), NULL, NULL);
+        // The data went through the descriptor; move the stream along with it.
+        fseeko(file, lseek(fileno(file), 0, SEEK_CUR), SEEK_SET);
+        return rc;
+    }
+
     char buffer[FTP_BUFFER_SIZE];
     ssize_t n;
     
@@ -101,6 +558,139 @@ int receive_file_over_socket(int sockfd, FILE *file) {
     return (n == 0) ? 0 : -1;
 }
 
+int ftp_zstream_init_deflate(ftp_zstream_t *z, int level) {
+    memset(z, 0, sizeof(*z));
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    return deflateInit(&z->zs, level) == Z_OK ? 0 : -1;
+}
+
+int ftp_zstream_init_inflate(ftp_zstream_t *z) {
+    memset(z, 0, sizeof(*z));
+    z->inflating = 1;
+    return inflateInit(&z->zs) == Z_OK ? 0 : -1;
+}
+
+void ftp_zstream_end(ftp_zstream_t *z) {
+    if (z->inflating) {
+        inflateEnd(&z->zs);
+    } else {
+        deflateEnd(&z->zs);
+    }
+}
+
+ssize_t ftp_zstream_process(ftp_zstream_t *z, const void *in, size_t in_len, size_t *consumed,
+                            void *out, size_t out_size, int final) {
+    z->zs.next_in = (Bytef *)in;
+    z->zs.avail_in = (uInt)in_len;
+    z->zs.next_out = (Bytef *)out;
+    z->zs.avail_out = (uInt)out_size;
+    int rc = z->inflating ? inflate(&z->zs, Z_NO_FLUSH)
+                          : deflate(&z->zs, final ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+        z->ended = 1;
+    } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+        return -1;
+    }
+    *consumed = in_len - z->zs.avail_in;
+    return (ssize_t)(out_size - z->zs.avail_out);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int send_fd_over_socket_z(int sockfd, int fd, off_t *offset, int level, long long *bytes_sent,
+                          const ftp_progress_t *progress) {
+    ftp_zstream_t z;
+    if (ftp_zstream_init_deflate(&z, level) < 0) return -1;
+
+    char in[FTP_BUFFER_SIZE];
+    char out[FTP_ZBUF_SIZE];
+    int rc = 0;
+    int eof = 0;
+    while (!z.ended) {
+        ssize_t n = 0;
+        if (!eof) {
+            n = offset ? pread(fd, in, sizeof(in), *offset) : read(fd, in, sizeof(in));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                rc = -1;
+                break;
+            }
+            eof = (n == 0);
+            if (offset) *offset += n;
+            if (bytes_sent) *bytes_sent += n;
+        }
+        size_t used = 0;
+        do {
+            size_t consumed = 0;
+            ssize_t produced = ftp_zstream_process(&z, in + used, (size_t)n - used, &consumed, out, sizeof(out), eof);
+            if (produced < 0 || send_all(sockfd, out, (size_t)produced) < 0) {
+                rc = -1;
+                break;
+            }
+            used += consumed;
+            if ((size_t)produced < sizeof(out) && used == (size_t)n) break;
+        } while (!z.ended);
+        if (rc < 0 || report_progress(progress, n) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    ftp_zstream_end(&z);
+    return rc;
+}
+
+int receive_socket_to_fd_z(int sockfd, int fd, long long *bytes_received, const ftp_progress_t *progress) {
+    ftp_zstream_t z;
+    if (ftp_zstream_init_inflate(&z) < 0) return -1;
+
+    char in[FTP_BUFFER_SIZE];
+    char out[FTP_ZBUF_SIZE];
+    int rc = 0;
+    for (;;) {
+        ssize_t n = recv(sockfd, in, sizeof(in), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            // A connection closed before the end marker is a truncated stream.
+            rc = z.ended ? 0 : -1;
+            break;
+        }
+        size_t used = 0;
+        while (!z.ended) {
+            size_t consumed = 0;
+            ssize_t produced = ftp_zstream_process(&z, in + used, (size_t)n - used, &consumed, out, sizeof(out), 0);
+            if (produced < 0 || write_all(fd, out, (size_t)produced) < 0) {
+                rc = -1;
+                break;
+            }
+            if (bytes_received) *bytes_received += produced;
+            if (report_progress(progress, produced) < 0) {
+                rc = -1;
+                break;
+            }
+            used += consumed;
+            if ((size_t)produced < sizeof(out) && used == (size_t)n) break;
+        }
+        if (rc < 0) break;
+    }
+    ftp_zstream_end(&z);
+    return rc;
+}
+
 void get_local_ip(char *ip_buffer, size_t size) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
@@ -11,37 +11,142 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
 #define FTP_MAX_LINE 256
 #define FTP_MAX_PATH 512
 #define FTP_BUFFER_SIZE 4096
+#define FTP_SPLICE_CHUNK (1024 * 1024)    // splice pipe capacity
+#define FTP_LINE_BUFFER_SIZE 4096
+#define FTP_ZBUF_SIZE (FTP_BUFFER_SIZE * 4)
 
 // Mã phản hồi FTP (Thêm các mã còn thiếu)
 #define FTP_READY 220
 #define FTP_GOODBYE 221
 #define FTP_DATA_CONN_OPEN 150
+#define FTP_COMMAND_OK 200
+#define FTP_SYSTEM_STATUS 211
+#define FTP_FILE_STATUS 213
 #define FTP_SUCCESS 226
 #define FTP_PASV_MODE 227
 #define FTP_LOGIN_SUCCESS 230
 #define FTP_FILE_ACTION_OK 250
 #define FTP_PATHNAME_CREATED 257
 #define FTP_NEED_PASSWORD 331
+#define FTP_PENDING_MORE_INFO 350
+#define FTP_TRANSFER_ABORTED 426
 #define FTP_LOGIN_FAILED 530
 #define FTP_FILE_NOT_FOUND 550
 #define FTP_ACTION_FAILED 550 // Mã lỗi chung
 #define FTP_FILE_ACTION_FAILED 553 // Một mã lỗi khác (nhưng ta sẽ dùng 550)
 
 
+// Per-connection control-channel reader. Bytes are pulled in bulk into a
+// ring buffer and handed out one CRLF/LF-terminated line at a time, so
+// several pipelined commands or reply lines cost a single recv().
+typedef struct {
+    char data[FTP_LINE_BUFFER_SIZE];
+    size_t start;
+    size_t len;
+    int discarding;  // dropping the tail of an over-long line
+} ftp_line_reader_t;
+
 int send_ftp_response(int sockfd, int code, const char *message);
 int read_ftp_command(int sockfd, char *buffer, size_t size);
+
+void line_reader_init(ftp_line_reader_t *reader);
+// One recv() into the free space: bytes read, 0 on EOF, -1 on error (errno set).
+ssize_t line_reader_fill(ftp_line_reader_t *reader, int sockfd);
+// Extracts the next complete line without its terminator. Returns 1 if a line
+// was copied, 0 if none is buffered yet. Long lines are truncated to size - 1.
+int line_reader_next(ftp_line_reader_t *reader, char *line, size_t size);
+// Like line_reader_next, but leaves the line buffered.
+int line_reader_peek(ftp_line_reader_t *reader, char *line, size_t size);
+// Blocking helper: 1 when a line was read, 0 on EOF, -1 on error.
+int line_reader_read_line(ftp_line_reader_t *reader, int sockfd, char *line, size_t size);
 int parse_pasv_response(const char *response, char *ip, int *port);
 int create_data_connection(const char *ip, int port);
 
+// Socket tuning profiles. A profile decides the options put on control and
+// data sockets and the chunk size the transfer loops move per step.
+//   lan    - kernel buffer autotuning, 256K chunks
+//   wan    - large fixed buffers and TCP_NOTSENT_LOWAT, 1M chunks
+//   lowmem - 64K buffers and 16K chunks, for many sessions on a small host
+//   auto   - lan, unless the RTT measured on the data socket (TCP_INFO)
+//            gives a bandwidth-delay product autotuning would not cover
+typedef enum {
+    FTP_TUNE_AUTO,
+    FTP_TUNE_LAN,
+    FTP_TUNE_WAN,
+    FTP_TUNE_LOWMEM
+} ftp_tune_profile_t;
+
+#define FTP_TUNE_AUTO_RATE (125LL * 1000 * 1000)     // assumed path rate for auto, bytes/s (1 Gbit/s)
+#define FTP_TUNE_MAX_BUFFER (32 * 1024 * 1024)
+
+// Process-wide; takes effect for sockets tuned afterwards. -1 for an unknown name.
+int ftp_tune_set_profile(const char *name);
+const char *ftp_tune_profile_name(void);
+// TCP_NODELAY: replies and commands are small and must not wait for an ACK.
+void ftp_tune_control_socket(int sockfd);
+// Applies the profile to a connected data socket and returns the chunk size
+// to use on it. sending corks the socket so file data leaves in full
+// segments; closing the socket flushes the tail.
+size_t ftp_tune_data_socket(int sockfd, int sending);
+
 // *** KHAI BÁO ĐÃ SỬA ***
 // Các hàm này giờ nhận FILE* (đã sửa lỗi cảnh báo)
 int send_file_over_socket(int sockfd, FILE *file);
 int receive_file_over_socket(int sockfd, FILE *file);
 
+// Optional hook for the blocking transfer helpers below, called after each
+// chunk with the number of bytes it moved. A negative return stops the
+// transfer, which then fails with errno set to ECANCELED.
+typedef struct {
+    int (*on_chunk)(long long bytes, void *ctx);
+    void *ctx;
+} ftp_progress_t;
+
+// Zero-copy file -> socket path built on sendfile(). *offset (may be NULL) is
+// where reading starts and is advanced past the data sent; *bytes_sent (may be
+// NULL) is incremented. Non-regular files fall back to a read/send loop.
+// progress may be NULL.
+int send_fd_over_socket(int sockfd, int fd, off_t *offset, long long *bytes_sent,
+                        const ftp_progress_t *progress);
+// Single non-blocking sendfile() step: bytes sent, 0 at EOF, -1 with errno set.
+ssize_t send_file_chunk(int sockfd, int fd, off_t *offset, size_t count);
+
+// Zero-copy socket -> file path: socket -> pipe -> file with splice(). Used
+// for regular, non-append files; anything else goes through recv/write.
+int receive_socket_to_fd(int sockfd, int fd, long long *bytes_received, const ftp_progress_t *progress);
+// Single splice() step through pipefd: bytes stored, 0 at EOF, -1 for a socket
+// error (errno set, EAGAIN when it would block), -2 for a short file write.
+ssize_t receive_file_chunk(int sockfd, const int pipefd[2], int fd, size_t count);
+int splice_pipe_open(int pipefd[2]);
+void splice_pipe_close(int pipefd[2]);
+int splice_target_ok(int fd);
+
+// MODE Z (deflate) stage. One stream covers a whole data connection.
+typedef struct {
+    z_stream zs;
+    int inflating;
+    int ended;  // Z_STREAM_END reached
+} ftp_zstream_t;
+
+int ftp_zstream_init_deflate(ftp_zstream_t *z, int level);
+int ftp_zstream_init_inflate(ftp_zstream_t *z);
+void ftp_zstream_end(ftp_zstream_t *z);
+// Runs the codec over in[0..in_len) into out. final marks the end of the
+// deflate input. *consumed gets the input used; returns bytes produced, or
+// -1 on a corrupt stream. Call again while output fills out completely.
+ssize_t ftp_zstream_process(ftp_zstream_t *z, const void *in, size_t in_len, size_t *consumed,
+                            void *out, size_t out_size, int final);
+// Blocking MODE Z counterparts of send_fd_over_socket/receive_socket_to_fd.
+// Byte counts are uncompressed file bytes.
+int send_fd_over_socket_z(int sockfd, int fd, off_t *offset, int level, long long *bytes_sent,
+                          const ftp_progress_t *progress);
+int receive_socket_to_fd_z(int sockfd, int fd, long long *bytes_received, const ftp_progress_t *progress);
+
 void get_local_ip(char *ip_buffer, size_t size);
 
 #endif // FTP_COMMON_H
\ No newline at end of file
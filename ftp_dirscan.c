@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include "ftp_dirscan.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Smallest getdents64 record: 19 header bytes plus a one-byte name, aligned.
+#define FTP_SCAN_MIN_RECLEN 24
+#define FTP_SCAN_MAX_BATCH (FTP_SCAN_BUFFER / FTP_SCAN_MIN_RECLEN + 1)
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct ftp_dirscan {
+    int fd;
+    int flags;
+    char buf[FTP_SCAN_BUFFER];
+    ftp_scan_entry_t entries[FTP_SCAN_MAX_BATCH];
+};
+
+// Counts outstanding slices of one batch; the scanning thread waits on it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+} scan_latch_t;
+
+typedef struct scan_task {
+    int dir_fd;
+    ftp_scan_entry_t *begin;
+    ftp_scan_entry_t *end;
+    scan_latch_t *latch;
+    struct scan_task *next;
+} scan_task_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    scan_task_t *head;
+    scan_task_t *tail;
+    int workers;
+} scan_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+static pthread_once_t scan_pool_once = PTHREAD_ONCE_INIT;
+
+static void stat_entries(int dir_fd, ftp_scan_entry_t *begin, ftp_scan_entry_t *end) {
+    for (ftp_scan_entry_t *entry = begin; entry < end; entry++) {
+        struct statx stx;
+        if (statx(dir_fd, entry->name, AT_NO_AUTOMOUNT, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+            entry->stat_ok = 1;
+            entry->mode = stx.stx_mode;
+            entry->size = (long long)stx.stx_size;
+            entry->mtime = (time_t)stx.stx_mtime.tv_sec;
+            continue;
+        }
+        struct stat st;
+        if (errno == ENOSYS && fstatat(dir_fd, entry->name, &st, 0) == 0) {
+            entry->stat_ok = 1;
+            entry->mode = st.st_mode;
+            entry->size = (long long)st.st_size;
+            entry->mtime = st.st_mtime;
+        }
+    }
+}
+
+static void *scan_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&scan_pool.lock);
+        while (!scan_pool.head) {
+            pthread_cond_wait(&scan_pool.ready, &scan_pool.lock);
+        }
+        scan_task_t *task = scan_pool.head;
+        scan_pool.head = task->next;
+        if (!scan_pool.head) scan_pool.tail = NULL;
+        pthread_mutex_unlock(&scan_pool.lock);
+
+        stat_entries(task->dir_fd, task->begin, task->end);
+
+        scan_latch_t *latch = task->latch;
+        pthread_mutex_lock(&latch->lock);
+        if (--latch->pending == 0) {
+            pthread_cond_signal(&latch->done);
+        }
+        pthread_mutex_unlock(&latch->lock);
+    }
+    return NULL;
+}
+
+static void scan_pool_start(void) {
+    for (int i = 0; i < FTP_SCAN_WORKERS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, scan_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        scan_pool.workers++;
+    }
+}
+
+// Stats a batch, handing all but the first slice to the pool. The calling
+// thread does its own share instead of idling until the workers finish.
+static void stat_batch(int dir_fd, ftp_scan_entry_t *entries, int count) {
+    pthread_once(&scan_pool_once, scan_pool_start);
+    int slices = count / FTP_SCAN_MIN_SLICE;
+    if (slices > scan_pool.workers + 1) slices = scan_pool.workers + 1;
+    if (slices <= 1) {
+        stat_entries(dir_fd, entries, entries + count);
+        return;
+    }
+
+    scan_task_t tasks[FTP_SCAN_WORKERS];
+    scan_latch_t latch;
+    pthread_mutex_init(&latch.lock, NULL);
+    pthread_cond_init(&latch.done, NULL);
+    latch.pending = slices - 1;
+
+    int per_slice = (count + slices - 1) / slices;
+    pthread_mutex_lock(&scan_pool.lock);
+    for (int i = 1; i < slices; i++) {
+        scan_task_t *task = &tasks[i - 1];
+        task->dir_fd = dir_fd;
+        task->begin = entries + i * per_slice;
+        task->end = entries + ((i + 1) * per_slice < count ? (i + 1) * per_slice : count);
+        task->latch = &latch;
+        task->next = NULL;
+        if (scan_pool.tail) scan_pool.tail->next = task; else scan_pool.head = task;
+        scan_pool.tail = task;
+    }
+    pthread_cond_broadcast(&scan_pool.ready);
+    pthread_mutex_unlock(&scan_pool.lock);
+
+    stat_entries(dir_fd, entries, entries + per_slice);
+
+    pthread_mutex_lock(&latch.lock);
+    while (latch.pending > 0) {
+        pthread_cond_wait(&latch.done, &latch.lock);
+    }
+    pthread_mutex_unlock(&latch.lock);
+    pthread_mutex_destroy(&latch.lock);
+    pthread_cond_destroy(&latch.done);
+}
+
+ftp_dirscan_t *ftp_dirscan_open(int dir_fd, int flags) {
+    ftp_dirscan_t *scan = malloc(sizeof(*scan));
+    if (!scan) return NULL;
+    scan->fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan->fd < 0) {
+        free(scan);
+        return NULL;
+    }
+    scan->flags = flags;
+    return scan;
+}
+
+int ftp_dirscan_next(ftp_dirscan_t *scan, const ftp_scan_entry_t **entries) {
+    long n;
+    do {
+        n = syscall(SYS_getdents64, scan->fd, scan->buf, sizeof(scan->buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n < 0 ? -1 : 0;
+
+    int count = 0;
+    for (long pos = 0; pos < n && count < FTP_SCAN_MAX_BATCH; ) {
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(scan->buf + pos);
+        ftp_scan_entry_t *entry = &scan->entries[count++];
+        entry->name = d->d_name;
+        entry->d_type = d->d_type;
+        entry->stat_ok = 0;
+        entry->mode = DTTOIF(d->d_type);
+        entry->size = 0;
+        entry->mtime = 0;
+        pos += d->d_reclen;
+    }
+    if (scan->flags & FTP_SCAN_STAT) {
+        stat_batch(scan->fd, scan->entries, count);
+    }
+    *entries = scan->entries;
+    return count;
+}
+
+void ftp_dirscan_close(ftp_dirscan_t *scan) {
+    if (!scan) return;
+    close(scan->fd);
+    free(scan);
+}
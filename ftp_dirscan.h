@@ -0,0 +1,32 @@
+#ifndef FTP_DIRSCAN_H
+#define FTP_DIRSCAN_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// Incremental directory scanner: one getdents64() call per batch, with the
+// per-entry statx() calls of a batch spread over a small worker pool.
+#define FTP_SCAN_BUFFER (64 * 1024)
+#define FTP_SCAN_WORKERS 4
+#define FTP_SCAN_MIN_SLICE 64      // smaller batches are stat'ed inline
+
+#define FTP_SCAN_STAT 1            // fill mode/size/mtime; otherwise d_type only
+
+typedef struct {
+    const char *name;              // valid until the next ftp_dirscan_next()
+    unsigned char d_type;
+    int stat_ok;                   // 0 if the entry vanished or could not be stat'ed
+    mode_t mode;                   // file type bits from d_type when not stat'ed
+    long long size;
+    time_t mtime;
+} ftp_scan_entry_t;
+
+typedef struct ftp_dirscan ftp_dirscan_t;
+
+// Scans the directory dir_fd refers to; dir_fd itself is not consumed.
+ftp_dirscan_t *ftp_dirscan_open(int dir_fd, int flags);
+// Returns the number of entries in the next batch, 0 at the end, -1 on error.
+int ftp_dirscan_next(ftp_dirscan_t *scan, const ftp_scan_entry_t **entries);
+void ftp_dirscan_close(ftp_dirscan_t *scan);
+
+#endif // FTP_DIRSCAN_H
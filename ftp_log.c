@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "ftp_log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    long long stamp_ns;            // CLOCK_MONOTONIC; orders records across threads
+    size_t len;
+    char text[FTP_LOG_RECORD - sizeof(long long) - sizeof(size_t)];
+} log_record_t;
+
+// head is only written by the owning thread and tail only by the logger,
+// so neither side takes a lock. They sit on separate cache lines.
+typedef struct log_ring {
+    unsigned long head;
+    char pad_head[64 - sizeof(unsigned long)];
+    unsigned long tail;
+    char pad_tail[64 - sizeof(unsigned long)];
+    unsigned long long dropped;    // records lost to a full ring
+    unsigned long taken;           // head seen by the current drain
+    int abandoned;                 // owner thread exited; freed once drained
+    struct log_ring *next;
+    log_record_t records[FTP_LOG_RING];
+} log_ring_t;
+
+// Only ever held for in-memory work; new threads take it to register
+// their ring, so no I/O may happen under it.
+static struct {
+    pthread_mutex_t lock;          // ring list and draining
+    pthread_cond_t kick;
+    log_ring_t *rings;
+    int ring_count;
+    unsigned long long lost;       // from freed rings and failed ring allocations
+    unsigned long long reported;   // drop count already announced
+    log_record_t **batch;
+    size_t batch_cap;
+    unsigned long long tickets;    // batches handed to the writer so far
+} logger = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, NULL, 0, 0 };
+
+// Writes drained batches to stderr and the sink outside logger.lock.
+// Batches carry a ticket so they still come out in drain order.
+static struct {
+    pthread_mutex_t lock;          // sink and turn
+    pthread_cond_t turn_done;
+    unsigned long long turn;       // ticket of the next batch to write
+    ftp_log_sink_fn sink;
+    void *sink_ctx;
+} writer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, NULL };
+
+typedef struct {
+    char *text;
+    size_t len;
+    unsigned long long ticket;
+} log_batch_t;
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread log_ring_t *thread_ring;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_records(const void *a, const void *b) {
+    long long x = (*(log_record_t *const *)a)->stamp_ns;
+    long long y = (*(log_record_t *const *)b)->stamp_ns;
+    return (x > y) - (x < y);
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Caller holds logger.lock. Copies everything queued when this starts into
+// a batch for emit(); records stay queued if there is no memory for it.
+static log_batch_t drain(void) {
+    log_batch_t out = { NULL, 0, 0 };
+    size_t needed = (size_t)logger.ring_count * FTP_LOG_RING;
+    if (needed > logger.batch_cap) {
+        log_record_t **batch = realloc(logger.batch, needed * sizeof(*batch));
+        if (!batch) return out;
+        logger.batch = batch;
+        logger.batch_cap = needed;
+    }
+
+    size_t count = 0, size = FTP_LOG_RECORD;   // room for the drop warning
+    unsigned long long dropped = logger.lost;
+    for (log_ring_t *ring = logger.rings; ring; ring = ring->next) {
+        ring->taken = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (unsigned long i = ring->tail; i != ring->taken; i++) {
+            logger.batch[count] = &ring->records[i & (FTP_LOG_RING - 1)];
+            size += logger.batch[count++]->len;
+        }
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    out.ticket = logger.tickets;
+    if (count > 0 || dropped > logger.reported) {
+        out.text = malloc(size);
+        if (!out.text) return out;
+        qsort(logger.batch, count, sizeof(*logger.batch), compare_records);
+        for (size_t i = 0; i < count; i++) {
+            memcpy(out.text + out.len, logger.batch[i]->text, logger.batch[i]->len);
+            out.len += logger.batch[i]->len;
+        }
+        if (dropped > logger.reported) {
+            int n = snprintf(out.text + out.len, FTP_LOG_RECORD, "[LOG WARN] %llu record(s) dropped, log rings were full\n",
+                             dropped - logger.reported);
+            if (n > 0) out.len += (size_t)n < FTP_LOG_RECORD ? (size_t)n : FTP_LOG_RECORD - 1;
+            logger.reported = dropped;
+        }
+        logger.tickets++;
+    }
+
+    // Hand the slots back only after the text has been copied out.
+    log_ring_t **link = &logger.rings;
+    while (*link) {
+        log_ring_t *ring = *link;
+        __atomic_store_n(&ring->tail, ring->taken, __ATOMIC_RELEASE);
+        // An exited thread writes nothing more, so its ring is empty now.
+        if (__atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE) &&
+            ring->taken == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            logger.lost += ring->dropped;
+            logger.ring_count--;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    return out;
+}
+
+// Called without logger.lock. Waits for earlier batches, then writes this
+// one; an empty batch just waits, so a flush returns after older output.
+static void emit(log_batch_t *batch) {
+    pthread_mutex_lock(&writer.lock);
+    while (writer.turn < batch->ticket) {
+        pthread_cond_wait(&writer.turn_done, &writer.lock);
+    }
+    if (batch->text) {
+        write_all(STDERR_FILENO, batch->text, batch->len);
+        if (writer.sink) writer.sink(batch->text, batch->len, writer.sink_ctx);
+        writer.turn++;
+        pthread_cond_broadcast(&writer.turn_done);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    free(batch->text);
+}
+
+static void *logger_run(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&logger.lock);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FTP_LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&logger.kick, &logger.lock, &deadline);
+        log_batch_t batch = drain();
+        pthread_mutex_unlock(&logger.lock);
+        emit(&batch);
+    }
+    return NULL;
+}
+
+static void ring_release(void *arg) {
+    log_ring_t *ring = arg;
+    __atomic_store_n(&ring->abandoned, 1, __ATOMIC_RELEASE);
+}
+
+static void logger_start(void) {
+    pthread_key_create(&ring_key, ring_release);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logger_run, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    atexit(ftp_log_flush);
+}
+
+static log_ring_t *ring_for_thread(void) {
+    if (thread_ring) return thread_ring;
+    pthread_once(&logger_once, logger_start);
+    log_ring_t *ring = calloc(1, sizeof(*ring));
+    pthread_mutex_lock(&logger.lock);
+    if (ring) {
+        ring->next = logger.rings;
+        logger.rings = ring;
+        logger.ring_count++;
+    } else {
+        logger.lost++;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    if (ring) {
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+    }
+    return ring;
+}
+
+void ftp_log_vwrite(const char *source, const char *level, const char *fmt, va_list args) {
+    log_ring_t *ring = ring_for_thread();
+    if (!ring) return;
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= FTP_LOG_RING) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_record_t *record = &ring->records[head & (FTP_LOG_RING - 1)];
+    record->stamp_ns = now_ns();
+    size_t room = sizeof(record->text) - 1;   // keeps space for the newline
+    int n = snprintf(record->text, room, "[%s %s] ", source, level);
+    size_t len = n < 0 ? 0 : ((size_t)n < room ? (size_t)n : room - 1);
+    n = vsnprintf(record->text + len, room - len, fmt, args);
+    if (n > 0) len += (size_t)n < room - len ? (size_t)n : room - len - 1;
+    record->text[len++] = '\n';
+    record->len = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void ftp_log_set_sink(ftp_log_sink_fn sink, void *ctx) {
+    pthread_mutex_lock(&writer.lock);
+    writer.sink = sink;
+    writer.sink_ctx = ctx;
+    pthread_mutex_unlock(&writer.lock);
+}
+
+void ftp_log_flush(void) {
+    pthread_mutex_lock(&logger.lock);
+    log_batch_t batch = drain();
+    pthread_mutex_unlock(&logger.lock);
+    emit(&batch);
+}
+
+unsigned long long ftp_log_dropped(void) {
+    pthread_mutex_lock(&logger.lock);
+    unsigned long long dropped = logger.lost;
+    for (log_ring_t *ring = logger.rings; ring; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return dropped;
+}
@@ -0,0 +1,26 @@
+#ifndef FTP_LOG_H
+#define FTP_LOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Asynchronous logger. Every thread formats its records into its own
+// single-producer ring; one background thread drains all rings, puts the
+// records back in time order and writes them out in batches. Writers never
+// wait: when their ring is full the record is dropped and counted.
+#define FTP_LOG_RECORD 256         // bytes per record; longer lines are cut
+#define FTP_LOG_RING 256           // records per thread, a power of two
+#define FTP_LOG_FLUSH_MS 20
+
+// Receives each written batch of "\n"-terminated lines on the logger thread.
+typedef void (*ftp_log_sink_fn)(const char *batch, size_t len, void *ctx);
+
+// Queues "[source level] message".
+void ftp_log_vwrite(const char *source, const char *level, const char *fmt, va_list args);
+// Batches go to sink as well as stderr; NULL removes the sink.
+void ftp_log_set_sink(ftp_log_sink_fn sink, void *ctx);
+// Writes out everything queued so far before returning.
+void ftp_log_flush(void);
+unsigned long long ftp_log_dropped(void);
+
+#endif // FTP_LOG_H
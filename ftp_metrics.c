@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "ftp_metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const verb_names[] = {
+    "USER", "PASS", "PWD", "CWD", "PASV", "LIST", "MLSD", "NLST", "MLST", "DELE", "RNFR",
+    "RNTO", "REST", "MODE", "OPTS", "SIZE", "RETR", "STOR", "ABOR", "NOOP", "QUIT", "SITE", "OTHER"
+};
+
+#define VERB_COUNT ((int)(sizeof(verb_names) / sizeof(verb_names[0])))
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum_us;
+    unsigned long long max_us;
+    unsigned long long buckets[FTP_METRICS_BUCKETS];
+} histogram_t;
+
+// Written only by its owner thread; other threads just read it.
+typedef struct metrics_shard {
+    unsigned long long sessions_opened;
+    unsigned long long sessions_closed;
+    unsigned long long pasv_timeouts;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long file_cache_hits;
+    unsigned long long file_cache_misses;
+    unsigned long long file_cache_evictions;
+    histogram_t data_connect;
+    histogram_t commands[VERB_COUNT];
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+static struct {
+    pthread_mutex_t lock;          // shard list and retired
+    metrics_shard_t *shards;
+    metrics_shard_t retired;       // totals of shards whose thread has exited
+} metrics = { PTHREAD_MUTEX_INITIALIZER, NULL, { 0 } };
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread metrics_shard_t *thread_shard;
+
+static void add(unsigned long long *counter, unsigned long long by) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+static unsigned long long get(const unsigned long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void histogram_merge(histogram_t *into, const histogram_t *from) {
+    into->count += get(&from->count);
+    into->sum_us += get(&from->sum_us);
+    unsigned long long max = get(&from->max_us);
+    if (max > into->max_us) into->max_us = max;
+    for (int i = 0; i < FTP_METRICS_BUCKETS; i++) {
+        into->buckets[i] += get(&from->buckets[i]);
+    }
+}
+
+// Caller holds metrics.lock.
+static void shard_merge(metrics_shard_t *into, const metrics_shard_t *from) {
+    into->sessions_opened += get(&from->sessions_opened);
+    into->sessions_closed += get(&from->sessions_closed);
+    into->pasv_timeouts += get(&from->pasv_timeouts);
+    into->bytes_in += get(&from->bytes_in);
+    into->bytes_out += get(&from->bytes_out);
+    into->file_cache_hits += get(&from->file_cache_hits);
+    into->file_cache_misses += get(&from->file_cache_misses);
+    into->file_cache_evictions += get(&from->file_cache_evictions);
+    histogram_merge(&into->data_connect, &from->data_connect);
+    for (int i = 0; i < VERB_COUNT; i++) {
+        histogram_merge(&into->commands[i], &from->commands[i]);
+    }
+}
+
+static void shard_release(void *arg) {
+    metrics_shard_t *shard = arg;
+    pthread_mutex_lock(&metrics.lock);
+    metrics_shard_t **link = &metrics.shards;
+    while (*link && *link != shard) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = shard->next;
+    shard_merge(&metrics.retired, shard);
+    pthread_mutex_unlock(&metrics.lock);
+    free(shard);
+}
+
+static void metrics_start(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+// A thread whose shard cannot be allocated simply goes uncounted.
+static metrics_shard_t *shard_for_thread(void) {
+    if (thread_shard) return thread_shard;
+    pthread_once(&metrics_once, metrics_start);
+    metrics_shard_t *shard = calloc(1, sizeof(*shard));
+    if (!shard) return NULL;
+    pthread_mutex_lock(&metrics.lock);
+    shard->next = metrics.shards;
+    metrics.shards = shard;
+    pthread_mutex_unlock(&metrics.lock);
+    pthread_setspecific(shard_key, shard);
+    thread_shard = shard;
+    return shard;
+}
+
+static metrics_shard_t *metrics_collect(void) {
+    metrics_shard_t *total = calloc(1, sizeof(*total));
+    if (!total) return NULL;
+    pthread_mutex_lock(&metrics.lock);
+    shard_merge(total, &metrics.retired);
+    for (metrics_shard_t *shard = metrics.shards; shard; shard = shard->next) {
+        shard_merge(total, shard);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+    return total;
+}
+
+static int bucket_index(long long usec) {
+    if (usec < 0) usec = 0;
+    if (usec > FTP_METRICS_MAX_US) usec = FTP_METRICS_MAX_US;
+    unsigned long long value = (unsigned long long)usec;
+    if (value < FTP_METRICS_SUB_BUCKETS) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - FTP_METRICS_SUB_BITS;
+    return (shift + 1) * FTP_METRICS_SUB_BUCKETS + (int)((value >> shift) & (FTP_METRICS_SUB_BUCKETS - 1));
+}
+
+// Smallest value above bucket index.
+static long long bucket_limit(int index) {
+    if (index < FTP_METRICS_SUB_BUCKETS) return index + 1;
+    int shift = index / FTP_METRICS_SUB_BUCKETS - 1;
+    long long sub = index % FTP_METRICS_SUB_BUCKETS;
+    return (FTP_METRICS_SUB_BUCKETS + sub + 1) << shift;
+}
+
+static void histogram_record(histogram_t *histogram, long long usec) {
+    if (usec < 0) usec = 0;
+    add(&histogram->count, 1);
+    add(&histogram->sum_us, (unsigned long long)usec);
+    if ((unsigned long long)usec > histogram->max_us) {
+        __atomic_store_n(&histogram->max_us, (unsigned long long)usec, __ATOMIC_RELAXED);
+    }
+    add(&histogram->buckets[bucket_index(usec)], 1);
+}
+
+// Upper edge of the bucket holding the q-quantile, never above the maximum.
+static long long histogram_quantile(const histogram_t *histogram, double q) {
+    if (histogram->count == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * histogram->count);
+    if (rank < q * histogram->count || rank == 0) rank++;
+    unsigned long long seen = 0;
+    for (int i = 0; i < FTP_METRICS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            long long value = bucket_limit(i) - 1;
+            return value < (long long)histogram->max_us ? value : (long long)histogram->max_us;
+        }
+    }
+    return (long long)histogram->max_us;
+}
+
+int ftp_metrics_verb(const char *command) {
+    for (int i = 0; i < VERB_COUNT - 1; i++) {
+        if (strcasecmp(command, verb_names[i]) == 0) return i;
+    }
+    return VERB_COUNT - 1;
+}
+
+long long ftp_metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ftp_metrics_session_opened(void) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) add(&shard->sessions_opened, 1);
+}
+
+void ftp_metrics_session_closed(void) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) add(&shard->sessions_closed, 1);
+}
+
+void ftp_metrics_command(int verb, long long usec) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (!shard || verb < 0 || verb >= VERB_COUNT) return;
+    histogram_record(&shard->commands[verb], usec);
+}
+
+void ftp_metrics_data_connect(long long usec) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) histogram_record(&shard->data_connect, usec);
+}
+
+void ftp_metrics_pasv_timeout(void) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) add(&shard->pasv_timeouts, 1);
+}
+
+void ftp_metrics_bytes(int inbound, long long bytes) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (!shard || bytes <= 0) return;
+    add(inbound ? &shard->bytes_in : &shard->bytes_out, (unsigned long long)bytes);
+}
+
+void ftp_metrics_file_cache(int hit) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) add(hit ? &shard->file_cache_hits : &shard->file_cache_misses, 1);
+}
+
+void ftp_metrics_file_cache_evicted(void) {
+    metrics_shard_t *shard = shard_for_thread();
+    if (shard) add(&shard->file_cache_evictions, 1);
+}
+
+static unsigned long long sessions_active(const metrics_shard_t *total) {
+    // Opens and closes come from different threads; a snapshot taken
+    // between them may see the close first.
+    return total->sessions_opened > total->sessions_closed ? total->sessions_opened - total->sessions_closed : 0;
+}
+
+static void report_line(char *out, size_t size, size_t *len, const char *fmt, ...) {
+    char line[160];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= sizeof(line) || *len + (size_t)n >= size) return;
+    memcpy(out + *len, line, (size_t)n + 1);
+    *len += (size_t)n;
+}
+
+size_t ftp_metrics_report(char *out, size_t size) {
+    size_t len = 0;
+    if (size > 0) out[0] = '\0';
+    metrics_shard_t *total = metrics_collect();
+    if (!total) return 0;
+
+    report_line(out, size, &len, " Sessions: %llu active, %llu total\r\n",
+                sessions_active(total), total->sessions_opened);
+    report_line(out, size, &len, " Data: %llu bytes in, %llu bytes out\r\n", total->bytes_in, total->bytes_out);
+    const histogram_t *connect = &total->data_connect;
+    report_line(out, size, &len, " Data connections: %llu, p50 %.3f ms, p99 %.3f ms, max %.3f ms, %llu PASV timeout(s)\r\n",
+                connect->count, histogram_quantile(connect, 0.5) / 1000.0, histogram_quantile(connect, 0.99) / 1000.0,
+                connect->max_us / 1000.0, total->pasv_timeouts);
+    report_line(out, size, &len, " File cache: %llu hits, %llu misses, %llu evictions\r\n",
+                total->file_cache_hits, total->file_cache_misses, total->file_cache_evictions);
+    report_line(out, size, &len, " %-6s %10s %10s %10s %10s %10s %10s  (ms)\r\n",
+                "Verb", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < VERB_COUNT; i++) {
+        const histogram_t *histogram = &total->commands[i];
+        if (histogram->count == 0) continue;
+        report_line(out, size, &len, " %-6s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\r\n",
+                    verb_names[i], histogram->count,
+                    histogram_quantile(histogram, 0.5) / 1000.0, histogram_quantile(histogram, 0.9) / 1000.0,
+                    histogram_quantile(histogram, 0.99) / 1000.0, histogram_quantile(histogram, 0.999) / 1000.0,
+                    histogram->max_us / 1000.0);
+    }
+    free(total);
+    return len;
+}
+
+// Bucket bounds are powers of two microseconds, which are also edges of
+// the log-linear buckets. Each cumulative count covers samples strictly
+// below its bound, so a sample of exactly 2^bound us shows up one bucket
+// later than Prometheus' inclusive le would put it.
+#define PROM_FIRST_BOUND 6                 // 64 us
+#define PROM_LAST_BOUND 24                 // about 16.8 s
+
+static void write_histogram(FILE *file, const char *name, const char *labels, const histogram_t *histogram) {
+    const char *sep = labels[0] ? "," : "";
+    unsigned long long below = 0;
+    int next = 0;
+    for (int bound = PROM_FIRST_BOUND; bound <= PROM_LAST_BOUND; bound++) {
+        int edge = bucket_index(1LL << bound);
+        while (next < edge) {
+            below += histogram->buckets[next++];
+        }
+        fprintf(file, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, (double)(1LL << bound) / 1e6, below);
+    }
+    fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, histogram->count);
+    if (labels[0]) {
+        fprintf(file, "%s_sum{%s} %.6f\n", name, labels, histogram->sum_us / 1e6);
+        fprintf(file, "%s_count{%s} %llu\n", name, labels, histogram->count);
+    } else {
+        fprintf(file, "%s_sum %.6f\n", name, histogram->sum_us / 1e6);
+        fprintf(file, "%s_count %llu\n", name, histogram->count);
+    }
+}
+
+static void write_prometheus(FILE *file, const metrics_shard_t *total) {
+    fprintf(file, "# HELP ftpd_sessions_active Control connections currently open.\n"
+                  "# TYPE ftpd_sessions_active gauge\n"
+                  "ftpd_sessions_active %llu\n", sessions_active(total));
+    fprintf(file, "# HELP ftpd_sessions_total Control connections accepted.\n"
+                  "# TYPE ftpd_sessions_total counter\n"
+                  "ftpd_sessions_total %llu\n", total->sessions_opened);
+    fprintf(file, "# HELP ftpd_transfer_bytes_total Data connection payload bytes.\n"
+                  "# TYPE ftpd_transfer_bytes_total counter\n"
+                  "ftpd_transfer_bytes_total{direction=\"in\"} %llu\n"
+                  "ftpd_transfer_bytes_total{direction=\"out\"} %llu\n", total->bytes_in, total->bytes_out);
+    fprintf(file, "# HELP ftpd_pasv_timeouts_total Transfers whose data connection never arrived.\n"
+                  "# TYPE ftpd_pasv_timeouts_total counter\n"
+                  "ftpd_pasv_timeouts_total %llu\n", total->pasv_timeouts);
+    fprintf(file, "# HELP ftpd_file_cache_lookups_total RETR file cache lookups.\n"
+                  "# TYPE ftpd_file_cache_lookups_total counter\n"
+                  "ftpd_file_cache_lookups_total{result=\"hit\"} %llu\n"
+                  "ftpd_file_cache_lookups_total{result=\"miss\"} %llu\n",
+            total->file_cache_hits, total->file_cache_misses);
+    fprintf(file, "# HELP ftpd_file_cache_evictions_total Idle file cache entries dropped for the budget or age.\n"
+                  "# TYPE ftpd_file_cache_evictions_total counter\n"
+                  "ftpd_file_cache_evictions_total %llu\n", total->file_cache_evictions);
+
+    fprintf(file, "# HELP ftpd_commands_total Commands handled, by verb.\n"
+                  "# TYPE ftpd_commands_total counter\n");
+    for (int i = 0; i < VERB_COUNT; i++) {
+        fprintf(file, "ftpd_commands_total{verb=\"%s\"} %llu\n", verb_names[i], total->commands[i].count);
+    }
+    fprintf(file, "# HELP ftpd_command_duration_seconds Time from reading a command to its final reply.\n"
+                  "# TYPE ftpd_command_duration_seconds histogram\n");
+    for (int i = 0; i < VERB_COUNT; i++) {
+        if (total->commands[i].count == 0) continue;
+        char labels[32];
+        snprintf(labels, sizeof(labels), "verb=\"%s\"", verb_names[i]);
+        write_histogram(file, "ftpd_command_duration_seconds", labels, &total->commands[i]);
+    }
+    fprintf(file, "# HELP ftpd_data_connect_seconds Time from a transfer command to its data connection.\n"
+                  "# TYPE ftpd_data_connect_seconds histogram\n");
+    write_histogram(file, "ftpd_data_connect_seconds", "", &total->data_connect);
+}
+
+int ftp_metrics_write_prometheus(const char *path) {
+    metrics_shard_t *total = metrics_collect();
+    size_t path_len = strlen(path);
+    char *temp = malloc(path_len + 5);
+    if (!total || !temp) {
+        free(total);
+        free(temp);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(temp, path, path_len);
+    memcpy(temp + path_len, ".tmp", 5);
+
+    int rc = -1;
+    FILE *file = fopen(temp, "w");
+    if (file) {
+        write_prometheus(file, total);
+        int failed = ferror(file);
+        if (fclose(file) == 0 && !failed && rename(temp, path) == 0) {
+            rc = 0;
+        } else {
+            int saved = errno;
+            unlink(temp);
+            errno = saved ? saved : EIO;
+        }
+    }
+    free(temp);
+    free(total);
+    return rc;
+}
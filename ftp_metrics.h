@@ -0,0 +1,40 @@
+#ifndef FTP_METRICS_H
+#define FTP_METRICS_H
+
+#include <stddef.h>
+
+// Server metrics. Every thread counts into its own shard, written only by
+// that thread, so recording is a few plain stores with no shared cache
+// lines; readers add the shards up. Durations are kept in microseconds in
+// log-linear (HDR-style) histograms: FTP_METRICS_SUB_BUCKETS buckets per
+// power of two, i.e. about 12% resolution from 1 us to FTP_METRICS_MAX_US.
+#define FTP_METRICS_SUB_BITS 3
+#define FTP_METRICS_SUB_BUCKETS (1 << FTP_METRICS_SUB_BITS)
+#define FTP_METRICS_MAX_BITS 36            // longer durations land in the last bucket
+#define FTP_METRICS_MAX_US ((1LL << FTP_METRICS_MAX_BITS) - 1)
+#define FTP_METRICS_BUCKETS (FTP_METRICS_SUB_BUCKETS * (FTP_METRICS_MAX_BITS - FTP_METRICS_SUB_BITS + 1))
+
+// Index of a command verb; unknown commands share the last one ("OTHER").
+int ftp_metrics_verb(const char *command);
+long long ftp_metrics_now_us(void);
+
+void ftp_metrics_session_opened(void);
+void ftp_metrics_session_closed(void);
+void ftp_metrics_command(int verb, long long usec);
+// Time from the transfer command to a usable data connection.
+void ftp_metrics_data_connect(long long usec);
+void ftp_metrics_pasv_timeout(void);
+void ftp_metrics_bytes(int inbound, long long bytes);
+// RETR file cache: lookups, and idle entries dropped for budget or age.
+void ftp_metrics_file_cache(int hit);
+void ftp_metrics_file_cache_evicted(void);
+
+// Human-readable summary for SITE STATS: lines starting with a space and
+// ending in "\r\n", ready to sit inside a multi-line reply. Returns the
+// length written; lines that do not fit are left out.
+size_t ftp_metrics_report(char *out, size_t size);
+// Writes the Prometheus text format to path through a temporary file and
+// rename(), so scrapers never see a partial file. -1 with errno on failure.
+int ftp_metrics_write_prometheus(const char *path);
+
+#endif // FTP_METRICS_H
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include "ftp_common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Microbenchmarks for the ftp_common.c primitives. Control-path helpers run
+// over a socketpair, file transfers over loopback TCP with their files on
+// tmpfs. Each case repeats until MICROBENCH_MIN_NS has passed.
+//
+// Usage: ftp_microbench [name filter]
+#define MICROBENCH_MIN_NS 200000000LL
+#define MICROBENCH_MIN_ROUNDS 3
+#define MICROBENCH_PIPELINE 16    // commands per line_reader batch
+
+static const size_t chunk_sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+static const long long file_sizes[] = { 4096, 65536, 1048576, 16777216, 67108864 };
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *filter;
+static char work_dir[64];
+static int listen_fd = -1;
+static struct sockaddr_in listen_addr;
+static char *pattern;             // 1 MB of payload for the sending side
+#define PATTERN_SIZE (1024 * 1024)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int selected(const char *name) {
+    return !filter || strstr(name, filter) != NULL;
+}
+
+static void format_size(char *out, size_t size, long long bytes) {
+    if (bytes <= 0) snprintf(out, size, "-");
+    else if (bytes % (1024 * 1024) == 0) snprintf(out, size, "%lldM", bytes / (1024 * 1024));
+    else if (bytes % 1024 == 0) snprintf(out, size, "%lldK", bytes / 1024);
+    else snprintf(out, size, "%lld", bytes);
+}
+
+// bytes_per_op of 0 leaves the throughput column empty.
+static void report(const char *name, long long chunk, long long file_size, long long ops, long long elapsed_ns,
+                   long long bytes_per_op) {
+    char chunk_text[16], file_text[16], rate[16];
+    format_size(chunk_text, sizeof(chunk_text), chunk);
+    format_size(file_text, sizeof(file_text), file_size);
+    if (bytes_per_op > 0) {
+        snprintf(rate, sizeof(rate), "%.2f", (double)bytes_per_op * ops / elapsed_ns);
+    } else {
+        snprintf(rate, sizeof(rate), "-");
+    }
+    printf("%-36s %8s %8s %14.1f %8s\n", name, chunk_text, file_text, (double)elapsed_ns / ops, rate);
+    fflush(stdout);
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+// Loopback TCP connection: *sender is the connecting end.
+static void tcp_pair(int *sender, int *receiver) {
+    *sender = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*sender < 0 || connect(*sender, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) fail("connect");
+    *receiver = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (*receiver < 0) fail("accept");
+}
+
+// Peer threads take their own timestamps, so thread start-up and join
+// stay out of the measurement.
+typedef struct {
+    int fd;
+    long long bytes;
+    long long stamp_ns;           // drain: when EOF arrived; feed: first send
+} peer_t;
+
+static void *drain_socket(void *arg) {
+    peer_t *drain = arg;
+    char buffer[256 * 1024];
+    while (recv(drain->fd, buffer, sizeof(buffer), 0) > 0) {
+    }
+    drain->stamp_ns = now_ns();
+    return NULL;
+}
+
+static void *feed_socket(void *arg) {
+    peer_t *feed = arg;
+    feed->stamp_ns = now_ns();
+    long long left = feed->bytes;
+    while (left > 0) {
+        size_t chunk = left < PATTERN_SIZE ? (size_t)left : PATTERN_SIZE;
+        ssize_t n = send(feed->fd, pattern, chunk, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        left -= n;
+    }
+    shutdown(feed->fd, SHUT_WR);
+    return NULL;
+}
+
+static int make_file(const char *name, long long size) {
+    char path[FTP_MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", work_dir, name);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) fail(path);
+    for (long long done = 0; done < size; ) {
+        size_t chunk = size - done < PATTERN_SIZE ? (size_t)(size - done) : PATTERN_SIZE;
+        ssize_t n = write(fd, pattern, chunk);
+        if (n <= 0) fail("write");
+        done += n;
+    }
+    unlink(path);   // the descriptor keeps it alive
+    return fd;
+}
+
+static void bench_response_roundtrip(void) {
+    const char *name = "send_ftp_response+read_ftp_command";
+    if (!selected(name)) return;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) fail("socketpair");
+    char line[FTP_MAX_LINE];
+    long long ops = 0, started = now_ns(), elapsed;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            send_ftp_response(pair[0], FTP_SUCCESS, "Transfer complete");
+            read_ftp_command(pair[1], line, sizeof(line));
+        }
+        ops += 1000;
+        elapsed = now_ns() - started;
+    } while (elapsed < MICROBENCH_MIN_NS);
+    report(name, 0, 0, ops, elapsed, 0);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// The event loops read commands through the line reader instead.
+static void bench_line_reader(void) {
+    const char *name = "line_reader_fill+next (pipelined)";
+    if (!selected(name)) return;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) fail("socketpair");
+    char batch[MICROBENCH_PIPELINE * 32];
+    size_t batch_len = 0;
+    for (int i = 0; i < MICROBENCH_PIPELINE; i++) {
+        batch_len += (size_t)snprintf(batch + batch_len, sizeof(batch) - batch_len, "RETR file%02d.bin\r\n", i);
+    }
+    ftp_line_reader_t reader;
+    line_reader_init(&reader);
+    char line[FTP_MAX_LINE];
+    long long ops = 0, started = now_ns(), elapsed;
+    do {
+        for (int i = 0; i < 100; i++) {
+            if (send(pair[0], batch, batch_len, 0) != (ssize_t)batch_len) fail("send");
+            int got = 0;
+            while (got < MICROBENCH_PIPELINE) {
+                if (!line_reader_next(&reader, line, sizeof(line))) {
+                    if (line_reader_fill(&reader, pair[1]) <= 0) fail("line_reader_fill");
+                    continue;
+                }
+                got++;
+            }
+        }
+        ops += 100 * MICROBENCH_PIPELINE;
+        elapsed = now_ns() - started;
+    } while (elapsed < MICROBENCH_MIN_NS);
+    report(name, 0, 0, ops, elapsed, 0);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+static void bench_parse_pasv(void) {
+    const char *name = "parse_pasv_response";
+    if (!selected(name)) return;
+    char ip[16];
+    int port = 0;
+    long long ops = 0, started = now_ns(), elapsed;
+    do {
+        for (int i = 0; i < 10000; i++) {
+            if (parse_pasv_response("227 Entering Passive Mode (127,0,0,1,195,80)", ip, &port) < 0) fail("parse");
+        }
+        ops += 10000;
+        elapsed = now_ns() - started;
+    } while (elapsed < MICROBENCH_MIN_NS);
+    report(name, 0, 0, ops, elapsed, 0);
+}
+
+// One transfer per round, each on a fresh connection set up before the
+// clock starts; a send round ends when the peer has read all the data.
+static void bench_send_file(long long size) {
+    const char *name = "send_file_over_socket";
+    if (!selected(name)) return;
+    int fd = make_file("send.bin", size);
+    FILE *file = fdopen(fd, "rb");
+    if (!file) fail("fdopen");
+    long long rounds = 0, elapsed = 0, chunk = 0;
+    while (rounds < MICROBENCH_MIN_ROUNDS || elapsed < MICROBENCH_MIN_NS) {
+        int sender, receiver;
+        tcp_pair(&sender, &receiver);
+        // The helper tunes the socket itself; this only learns the chunk it picks.
+        chunk = (long long)ftp_tune_data_socket(sender, 1);
+        rewind(file);
+        peer_t drain = { receiver, 0, 0 };
+        pthread_t thread;
+        pthread_create(&thread, NULL, drain_socket, &drain);
+        long long started = now_ns();
+        if (send_file_over_socket(sender, file) < 0) fail("send_file_over_socket");
+        close(sender);
+        pthread_join(thread, NULL);
+        elapsed += drain.stamp_ns - started;
+        close(receiver);
+        rounds++;
+    }
+    report(name, chunk, size, rounds, elapsed, size);
+    fclose(file);
+}
+
+static void bench_receive_file(long long size) {
+    const char *name = "receive_file_over_socket";
+    if (!selected(name)) return;
+    int fd = make_file("recv.bin", 0);
+    FILE *file = fdopen(fd, "w+b");
+    if (!file) fail("fdopen");
+    long long rounds = 0, elapsed = 0, chunk = 0;
+    while (rounds < MICROBENCH_MIN_ROUNDS || elapsed < MICROBENCH_MIN_NS) {
+        int sender, receiver;
+        tcp_pair(&sender, &receiver);
+        chunk = (long long)ftp_tune_data_socket(receiver, 0);
+        rewind(file);
+        if (ftruncate(fd, 0) < 0) fail("ftruncate");
+        peer_t feed = { sender, size, 0 };
+        pthread_t thread;
+        pthread_create(&thread, NULL, feed_socket, &feed);
+        if (receive_file_over_socket(receiver, file) < 0) fail("receive_file_over_socket");
+        long long finished = now_ns();
+        pthread_join(thread, NULL);
+        elapsed += finished - feed.stamp_ns;
+        close(sender);
+        close(receiver);
+        rounds++;
+    }
+    report(name, chunk, size, rounds, elapsed, size);
+    fclose(file);
+}
+
+// The event loops move data with these single steps and a chunk size of
+// their choosing, so these are the ones swept over chunk sizes.
+static void bench_send_chunks(size_t chunk, long long size) {
+    const char *name = "send_file_chunk";
+    if (!selected(name)) return;
+    int fd = make_file("chunk_send.bin", size);
+    long long rounds = 0, elapsed = 0;
+    while (rounds < MICROBENCH_MIN_ROUNDS || elapsed < MICROBENCH_MIN_NS) {
+        int sender, receiver;
+        tcp_pair(&sender, &receiver);
+        peer_t drain = { receiver, 0, 0 };
+        pthread_t thread;
+        pthread_create(&thread, NULL, drain_socket, &drain);
+        off_t offset = 0;
+        long long started = now_ns();
+        ssize_t n;
+        while ((n = send_file_chunk(sender, fd, &offset, chunk)) > 0) {
+        }
+        if (n < 0) fail("send_file_chunk");
+        close(sender);
+        pthread_join(thread, NULL);
+        elapsed += drain.stamp_ns - started;
+        close(receiver);
+        rounds++;
+    }
+    report(name, (long long)chunk, size, rounds, elapsed, size);
+    close(fd);
+}
+
+static void bench_receive_chunks(size_t chunk, long long size) {
+    const char *name = "receive_file_chunk";
+    if (!selected(name)) return;
+    int fd = make_file("chunk_recv.bin", 0);
+    int pipefd[2];
+    if (splice_pipe_open(pipefd) < 0) fail("pipe");
+    long long rounds = 0, elapsed = 0;
+    while (rounds < MICROBENCH_MIN_ROUNDS || elapsed < MICROBENCH_MIN_NS) {
+        int sender, receiver;
+        tcp_pair(&sender, &receiver);
+        if (lseek(fd, 0, SEEK_SET) < 0 || ftruncate(fd, 0) < 0) fail("ftruncate");
+        peer_t feed = { sender, size, 0 };
+        pthread_t thread;
+        pthread_create(&thread, NULL, feed_socket, &feed);
+        ssize_t n;
+        while ((n = receive_file_chunk(receiver, pipefd, fd, chunk)) > 0) {
+        }
+        if (n < 0) fail("receive_file_chunk");
+        long long finished = now_ns();
+        pthread_join(thread, NULL);
+        elapsed += finished - feed.stamp_ns;
+        close(sender);
+        close(receiver);
+        rounds++;
+    }
+    report(name, (long long)chunk, size, rounds, elapsed, size);
+    splice_pipe_close(pipefd);
+    close(fd);
+}
+
+static void setup(void) {
+    pattern = malloc(PATTERN_SIZE);
+    if (!pattern) fail("malloc");
+    unsigned seed = 1;
+    for (size_t i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = (char)rand_r(&seed);
+    }
+
+    struct stat st;
+    const char *base = (stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode) && access("/dev/shm", W_OK) == 0)
+                       ? "/dev/shm" : "/tmp";
+    snprintf(work_dir, sizeof(work_dir), "%s/ftp_microbench.XXXXXX", base);
+    if (!mkdtemp(work_dir)) fail("mkdtemp");
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(listen_addr);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0 ||
+        listen(listen_fd, 16) < 0 || getsockname(listen_fd, (struct sockaddr *)&listen_addr, &len) < 0) {
+        fail("listen");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) filter = argv[1];
+    setup();
+    printf("# files in %s, FTP_BUFFER_SIZE %d\n", work_dir, FTP_BUFFER_SIZE);
+    printf("%-36s %8s %8s %14s %8s\n", "benchmark", "chunk", "file", "ns/op", "GB/s");
+
+    bench_response_roundtrip();
+    bench_line_reader();
+    bench_parse_pasv();
+    for (size_t f = 0; f < COUNT(file_sizes); f++) {
+        bench_send_file(file_sizes[f]);
+    }
+    for (size_t f = 0; f < COUNT(file_sizes); f++) {
+        bench_receive_file(file_sizes[f]);
+    }
+    for (size_t f = 2; f < COUNT(file_sizes); f++) {
+        for (size_t c = 0; c < COUNT(chunk_sizes); c++) {
+            bench_send_chunks(chunk_sizes[c], file_sizes[f]);
+        }
+    }
+    for (size_t f = 2; f < COUNT(file_sizes); f++) {
+        for (size_t c = 0; c < COUNT(chunk_sizes); c++) {
+            bench_receive_chunks(chunk_sizes[c], file_sizes[f]);
+        }
+    }
+
+    close(listen_fd);
+    rmdir(work_dir);
+    free(pattern);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include "ftp_ratelimit.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long burst_for(long long rate) {
+    long long burst = rate * FTP_RATE_BURST_MS / 1000;
+    return burst < FTP_RATE_MIN_BURST ? FTP_RATE_MIN_BURST : burst;
+}
+
+// Caller holds the lock and has checked that the bucket is limited.
+static void refill(ftp_bucket_t *bucket, long long now) {
+    long long elapsed = now - bucket->stamp_us;
+    if (elapsed <= 0) return;
+    if (elapsed >= (bucket->burst - bucket->tokens) * 1000000 / bucket->rate) {
+        bucket->tokens = bucket->burst;
+        bucket->stamp_us = now;
+        return;
+    }
+    long long earned = elapsed * bucket->rate / 1000000;
+    if (earned == 0) return;              // keep the remainder for the next call
+    bucket->tokens += earned;
+    bucket->stamp_us += earned * 1000000 / bucket->rate;
+}
+
+void ftp_bucket_init(ftp_bucket_t *bucket, long long rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    bucket->rate = 0;
+    bucket->tokens = 0;
+    bucket->burst = 0;
+    bucket->stamp_us = 0;
+    ftp_bucket_set_rate(bucket, rate);
+}
+
+void ftp_bucket_destroy(ftp_bucket_t *bucket) {
+    pthread_mutex_destroy(&bucket->lock);
+}
+
+void ftp_bucket_set_rate(ftp_bucket_t *bucket, long long rate) {
+    if (rate < 0) rate = 0;
+    pthread_mutex_lock(&bucket->lock);
+    long long now = now_us();
+    if (bucket->rate > 0) {
+        refill(bucket, now);
+    } else {
+        bucket->tokens = burst_for(rate);    // start full when a limit is switched on
+    }
+    bucket->burst = burst_for(rate);
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    bucket->stamp_us = now;
+    __atomic_store_n(&bucket->rate, rate, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+long long ftp_bucket_rate(ftp_bucket_t *bucket) {
+    return __atomic_load_n(&bucket->rate, __ATOMIC_ACQUIRE);
+}
+
+long long ftp_bucket_available(ftp_bucket_t *bucket) {
+    if (ftp_bucket_rate(bucket) == 0) return LLONG_MAX;
+    pthread_mutex_lock(&bucket->lock);
+    long long tokens = LLONG_MAX;
+    if (bucket->rate > 0) {
+        refill(bucket, now_us());
+        tokens = bucket->tokens;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return tokens;
+}
+
+long long ftp_bucket_delay_us(ftp_bucket_t *bucket, long long bytes) {
+    if (ftp_bucket_rate(bucket) == 0) return 0;
+    pthread_mutex_lock(&bucket->lock);
+    long long delay = 0;
+    if (bucket->rate > 0) {
+        long long now = now_us();
+        refill(bucket, now);
+        if (bytes > bucket->burst) bytes = bucket->burst;
+        if (bucket->tokens < bytes) {
+            // Time already spent towards the next token counts as well.
+            delay = (bytes - bucket->tokens) * 1000000 / bucket->rate - (now - bucket->stamp_us);
+            if (delay < 1) delay = 1;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return delay;
+}
+
+void ftp_bucket_take(ftp_bucket_t *bucket, long long bytes) {
+    if (bytes == 0 || ftp_bucket_rate(bucket) == 0) return;
+    pthread_mutex_lock(&bucket->lock);
+    if (bucket->rate > 0) {
+        bucket->tokens -= bytes;
+        if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+int ftp_parse_rate(const char *text, long long *rate) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    long long scale = 1;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': scale = 1024; end++; break;
+        case 'M': scale = 1024 * 1024; end++; break;
+        case 'G': scale = 1024LL * 1024 * 1024; end++; break;
+        default: break;
+    }
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0' || value > LLONG_MAX / scale) return -1;
+    *rate = value * scale;
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef FTP_RATELIMIT_H
+#define FTP_RATELIMIT_H
+
+#include <pthread.h>
+
+// Token bucket counted in bytes. A rate of 0 means unlimited. Buckets can be
+// shared between threads (per-user and server-wide limits).
+#define FTP_RATE_BURST_MS 250              // bucket depth, as time at the configured rate
+#define FTP_RATE_MIN_BURST (16 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    long long rate;                        // bytes per second, 0 = unlimited
+    long long tokens;                      // may dip below 0 when sharers overdraw it
+    long long burst;
+    long long stamp_us;
+} ftp_bucket_t;
+
+#define FTP_BUCKET_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 }
+
+void ftp_bucket_init(ftp_bucket_t *bucket, long long rate);
+void ftp_bucket_destroy(ftp_bucket_t *bucket);
+// Changing the rate keeps the tokens already earned, capped at the new burst.
+void ftp_bucket_set_rate(ftp_bucket_t *bucket, long long rate);
+long long ftp_bucket_rate(ftp_bucket_t *bucket);
+// Tokens available now (possibly <= 0), or LLONG_MAX when unlimited.
+long long ftp_bucket_available(ftp_bucket_t *bucket);
+// Microseconds until the bucket holds bytes tokens; 0 if it already does.
+long long ftp_bucket_delay_us(ftp_bucket_t *bucket, long long bytes);
+// Spends bytes tokens; a negative count gives unused tokens back.
+void ftp_bucket_take(ftp_bucket_t *bucket, long long bytes);
+
+// Parses "0", "512", "64K", "10M" (bytes per second) into *rate.
+int ftp_parse_rate(const char *text, long long *rate);
+
+#endif // FTP_RATELIMIT_H
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "ftp_uring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct ftp_uring {
+    int fd;
+    unsigned entries;
+    unsigned pending;          // queued SQEs not yet passed to io_uring_enter()
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;              // same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *buffers;
+    size_t buf_size;
+    unsigned buf_count;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int ftp_uring_supported(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uring_setup(2, &params);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+static int uring_map(ftp_uring_t *ring, const struct io_uring_params *params) {
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        return -1;
+    }
+    if (single) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params->sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+ftp_uring_t *ftp_uring_create(unsigned buf_count, size_t buf_size, unsigned file_slots) {
+    ftp_uring_t *ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->fd = -1;
+
+    // Every operation owns one buffer, so buf_count bounds what is in flight.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    ring->fd = uring_setup(buf_count, &params);
+    if (ring->fd < 0 || uring_map(ring, &params) < 0) goto fail;
+    ring->entries = params.sq_entries;
+
+    ring->buf_size = buf_size;
+    ring->buf_count = buf_count;
+    ring->buffers = mmap(NULL, buf_size * buf_count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        goto fail;
+    }
+    struct iovec *iov = calloc(buf_count, sizeof(*iov));
+    if (!iov) goto fail;
+    for (unsigned i = 0; i < buf_count; i++) {
+        iov[i].iov_base = ring->buffers + i * buf_size;
+        iov[i].iov_len = buf_size;
+    }
+    int rc = uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, buf_count);
+    free(iov);
+    if (rc < 0) goto fail;
+
+    int *fds = malloc(file_slots * sizeof(*fds));
+    if (!fds) goto fail;
+    for (unsigned i = 0; i < file_slots; i++) fds[i] = -1;
+    rc = uring_register(ring->fd, IORING_REGISTER_FILES, fds, file_slots);
+    free(fds);
+    if (rc < 0) goto fail;
+    return ring;
+
+fail:
+    ftp_uring_destroy(ring);
+    return NULL;
+}
+
+void ftp_uring_destroy(ftp_uring_t *ring) {
+    if (!ring) return;
+    int saved = errno;
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0) close(ring->fd);
+    if (ring->buffers) munmap(ring->buffers, ring->buf_size * ring->buf_count);
+    free(ring);
+    errno = saved;
+}
+
+int ftp_uring_fd(const ftp_uring_t *ring) {
+    return ring->fd;
+}
+
+char *ftp_uring_buffer(ftp_uring_t *ring, unsigned index) {
+    return ring->buffers + (size_t)index * ring->buf_size;
+}
+
+size_t ftp_uring_buffer_size(const ftp_uring_t *ring) {
+    return ring->buf_size;
+}
+
+int ftp_uring_set_files(ftp_uring_t *ring, unsigned first, const int *fds, unsigned count) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = first;
+    update.fds = (uint64_t)(uintptr_t)fds;
+    return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, count) < 0 ? -1 : 0;
+}
+
+static int uring_queue(ftp_uring_t *ring, int opcode, unsigned file_slot, unsigned buf_index, size_t buf_offset,
+                       size_t len, off_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries) {
+        errno = EBUSY;
+        return -1;
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = (int)file_slot;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)(ftp_uring_buffer(ring, buf_index) + buf_offset);
+    sqe->len = (uint32_t)len;
+    sqe->buf_index = (uint16_t)buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return 0;
+}
+
+int ftp_uring_read(ftp_uring_t *ring, unsigned file_slot, unsigned buf_index, size_t buf_offset,
+                   size_t len, off_t offset, uint64_t user_data) {
+    return uring_queue(ring, IORING_OP_READ_FIXED, file_slot, buf_index, buf_offset, len, offset, user_data);
+}
+
+int ftp_uring_write(ftp_uring_t *ring, unsigned file_slot, unsigned buf_index, size_t buf_offset,
+                    size_t len, off_t offset, uint64_t user_data) {
+    return uring_queue(ring, IORING_OP_WRITE_FIXED, file_slot, buf_index, buf_offset, len, offset, user_data);
+}
+
+int ftp_uring_submit(ftp_uring_t *ring) {
+    while (ring->pending > 0) {
+        int n = uring_enter(ring->fd, ring->pending, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->pending -= (unsigned)n;
+        if (n == 0) break;
+    }
+    return 0;
+}
+
+int ftp_uring_reap(ftp_uring_t *ring, ftp_uring_complete_fn on_complete, void *ctx) {
+    int count = 0;
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        // Copy the entry out first: the callback may queue new work.
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        on_complete(cqe.user_data, cqe.res, ctx);
+        count++;
+    }
+    return count;
+}
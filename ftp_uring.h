@@ -0,0 +1,37 @@
+#ifndef FTP_URING_H
+#define FTP_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Minimal io_uring wrapper on the raw system calls (no liburing needed).
+// A ring owns one block of registered buffers and a sparse table of fixed
+// files; operations name both by index instead of passing pointers and fds.
+typedef struct ftp_uring ftp_uring_t;
+
+typedef void (*ftp_uring_complete_fn)(uint64_t user_data, int res, void *ctx);
+
+// Returns 1 when the running kernel can set up a ring, 0 otherwise.
+int ftp_uring_supported(void);
+ftp_uring_t *ftp_uring_create(unsigned buf_count, size_t buf_size, unsigned file_slots);
+void ftp_uring_destroy(ftp_uring_t *ring);
+// Readable (POLLIN) while completions are waiting to be reaped.
+int ftp_uring_fd(const ftp_uring_t *ring);
+char *ftp_uring_buffer(ftp_uring_t *ring, unsigned index);
+size_t ftp_uring_buffer_size(const ftp_uring_t *ring);
+// Points count fixed-file slots starting at first to fds (-1 clears a slot).
+int ftp_uring_set_files(ftp_uring_t *ring, unsigned first, const int *fds, unsigned count);
+
+// Queue a READ_FIXED/WRITE_FIXED of len bytes at buffer + buf_offset. The
+// file offset is ignored for sockets. Returns -1 when the queue is full.
+int ftp_uring_read(ftp_uring_t *ring, unsigned file_slot, unsigned buf_index, size_t buf_offset,
+                   size_t len, off_t offset, uint64_t user_data);
+int ftp_uring_write(ftp_uring_t *ring, unsigned file_slot, unsigned buf_index, size_t buf_offset,
+                    size_t len, off_t offset, uint64_t user_data);
+// Hands queued operations to the kernel without waiting.
+int ftp_uring_submit(ftp_uring_t *ring);
+// Calls on_complete for every finished operation; returns how many there were.
+int ftp_uring_reap(ftp_uring_t *ring, ftp_uring_complete_fn on_complete, void *ctx);
+
+#endif // FTP_URING_H
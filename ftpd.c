@@ -1,12 +1,146 @@
+#define _GNU_SOURCE
 #include "ftp_common.h"
+#include "ftp_accounts.h"
+#include "ftp_dirscan.h"
+#include "ftp_log.h"
+#include "ftp_metrics.h"
+#include "ftp_ratelimit.h"
+#include "ftp_uring.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <strings.h>
-#include <sys/select.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 
+#define FTPD_MAX_LOOPS 64
+#define FTPD_MAX_EVENTS 64
+#define FTPD_LOOP_TICK_MS 250
+#define FTPD_PASV_TIMEOUT_MS 5000
+#define FTPD_TRANSFER_BURST 16
+#define FTPD_DEFAULT_ZLEVEL 6
+#define FTPD_LIST_CACHE_BYTES (8 * 1024 * 1024)
+#define FTPD_LIST_CACHE_ENTRIES 256
+#define FTPD_LIST_CACHE_TTL_MS 2000  // only without inotify, mtime alone misses size changes
+#define FTPD_URING_SLOTS 16          // io_uring transfers running at once per loop
+#define FTPD_URING_DEPTH 4           // buffers per transfer; must stay a power of two <= 8
+#define FTPD_URING_BUFFER (64 * 1024)
+#define FTPD_RATE_MIN_GRANT (8 * 1024)   // a throttled transfer waits for at least this much
+#define FTPD_RATE_QUANTA_PER_SEC 64      // throttle wakeups per second at the tightest limit
+#define FTPD_USER_RATE_CHAINS 1024
+#define FTPD_ACCOUNTS_POLL_MS 1000       // how often accounts.txt is checked for changes
+#define FTPD_METRICS_DUMP_MS 10000       // default interval of the Prometheus dump
+#define FTPD_FILE_CACHE_ENTRIES 256      // descriptors kept open for RETR
+#define FTPD_FILE_CACHE_IDLE_MS 30000    // unused entries are closed after this
+#define FTPD_FILE_CACHE_SWEEP_MS 1000    // how often the first loop closes idle entries
+#define FTPD_FILE_CACHE_CHAINS 256
+
+// Each session is a small state machine driven by one event loop thread.
+// While a transfer is running the control connection is only read until one
+// line is buffered, to catch ABOR; any other command waits for the transfer,
+// so commands are still handled strictly one after another.
+typedef enum {
+    SESSION_IDLE,
+    SESSION_DATA_WAIT,
+    SESSION_SENDING,
+    SESSION_RECEIVING
+} session_state_t;
+
+typedef enum {
+    TRANSFER_LIST,
+    TRANSFER_MLSD,
+    TRANSFER_NLST,
+    TRANSFER_RETR,
+    TRANSFER_STOR
+} transfer_kind_t;
+
+typedef enum {
+    HANDLE_CONTROL,
+    HANDLE_PASV,
+    HANDLE_DATA,
+    HANDLE_WAKE,
+    HANDLE_PASV_POOL,
+    HANDLE_URING
+} handle_kind_t;
+
+struct client_session;
+struct ftp_loop;
+struct uring_xfer;
+struct user_rate;
+
+// A serialized LIST payload shared by every session listing the same
+// directory. Entries stay linked while valid; an invalidated entry is
+// unlinked at once and freed when the last sender lets go of it.
+typedef struct list_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    int format;                   // TRANSFER_LIST, TRANSFER_MLSD or TRANSFER_NLST
+    int wd;                       // inotify watch, -1 in mtime mode
+    struct timespec mtime;
+    long long built_ms;
+    char *payload;
+    size_t len;
+    int refs;
+    int linked;
+    int building;                 // placeholder while the first LIST runs
+    struct list_cache_entry *prev;
+    struct list_cache_entry *next;
+} list_cache_entry_t;
+
+// An open regular file shared by every RETR of the same content; sendfile(),
+// pread() and io_uring all take explicit offsets, so readers never disturb
+// each other. The key includes mtime and size, so a rewritten file gets a
+// new entry while the old one leaves the index and closes with its last
+// reader. Only entries nobody references are evicted.
+typedef struct file_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int fd;
+    int refs;
+    int linked;
+    long long used_ms;            // last acquire or release
+    struct file_cache_entry *prev;   // LRU, most recently used first
+    struct file_cache_entry *next;
+    struct file_cache_entry *chain;  // hash chain on (dev, ino)
+} file_cache_entry_t;
+
+// MODE Z state, allocated only while a compressed transfer runs. Raw bytes
+// (file or LIST payload) go in, deflate output is queued in out.
+typedef struct {
+    ftp_zstream_t stream;
+    const char *raw_ptr;
+    size_t raw_len;
+    int raw_eof;
+    long long wire_bytes;
+    char out[FTP_ZBUF_SIZE];
+} session_zstate_t;
+
+// epoll user data: tells the loop which socket of which session fired.
+typedef struct {
+    handle_kind_t kind;
+    struct client_session *session;
+} loop_handle_t;
+
+// A pre-bound PASV listener from the configured port range. Sessions lease
+// a port per PASV; connections are matched to them by peer address, so one
+// port serves as many sessions as there are distinct client addresses.
 typedef struct {
+    loop_handle_t handle;         // first member: the loop casts back from it
+    int fd;
+    int port;
+    struct client_session *leases;
+} pasv_port_t;
+
+typedef struct client_session {
     int control_fd;
+    int dir_fd;                  // working directory; every path resolves against it
     char current_dir[FTP_MAX_PATH];
     char server_ip[16];
     int server_port;
@@ -14,422 +148,2877 @@ typedef struct {
     int client_port;
     char rename_from[FTP_MAX_PATH];
     char username[FTP_MAX_LINE];
+    int authenticated;
+    long long restart_offset;    // set by REST, consumed by the next command
+    int mode_z;                  // MODE Z negotiated
+    int z_level;                 // OPTS MODE Z LEVEL
+
+    session_state_t state;
+    int closed;
+    struct ftp_loop *loop;
+    struct client_session *next;
+    loop_handle_t control_handle;
+    loop_handle_t pasv_handle;
+    loop_handle_t data_handle;
+    uint32_t control_events;
+    ftp_line_reader_t reader;
+    int dispatching;
+    char reply_buf[FTP_BUFFER_SIZE];
+    size_t reply_len;
+
+    int pasv_listen_fd;
+    pasv_port_t *pasv_port;      // pool lease from the last PASV, else NULL
+    struct in_addr peer_addr;
+    int pasv_pool_fd;            // pool connection accepted for us, guarded by pasv_pool.lock
+    int pasv_ready;              // queued on loop->pasv_ready
+    struct client_session *lease_next;
+    struct client_session *ready_next;
+    int data_fd;
+    long long pasv_deadline;
+    transfer_kind_t transfer;
+    char transfer_path[FTP_MAX_PATH];
+    long long transfer_restart;
+    FILE *transfer_file;
+    int transfer_fd;             // regular file moved with sendfile()/splice(), else -1
+    file_cache_entry_t *file_entry;  // owns transfer_fd for a RETR of a regular file
+    off_t transfer_offset;
+    long long transfer_bytes;
+    long long transfer_started;
+    long long data_wait_started_us;
+    int command_verb;            // metrics verb of the command awaiting its final reply, -1 if none
+    long long command_started_us;
+    int splice_pipe[2];          // kept for the whole session once STOR needs it
+    session_zstate_t *z;
+    struct uring_xfer *uring;    // io_uring transfer in progress, else NULL
+    ftp_bucket_t rate;           // per-session limit, follows session_rate_limit
+    struct user_rate *user_rate; // shared by every session of the logged-in user
+    long long throttle_until;    // data channel parked until then, 0 when not throttled
+    long long rate_credit;       // bytes paid for in advance by the last throttle
+    char *list_buf;              // current listing batch
+    size_t list_cap;
+    list_cache_entry_t *list_entry;  // holds the cached payload being sent
+    ftp_dirscan_t *scan;         // directory scan streaming the listing
+    list_cache_entry_t *list_placeholder;
+    char *list_copy;             // whole listing collected for the cache
+    size_t list_copy_len;
+    size_t list_copy_cap;
+    const char *send_ptr;
+    size_t send_len;
+    size_t chunk;                // per-step transfer size picked by the socket tuning profile
+    char *xfer_buf;              // staging buffer of chunk bytes for buffered and MODE Z transfers
+    size_t xfer_size;
 } client_session_t;
 
-typedef struct {
+typedef struct ftp_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    pthread_mutex_t lock;
+    client_session_t *incoming;  // handed over by accept_ftp_client, guarded by lock
+    client_session_t *sessions;  // owned by the loop thread
+    client_session_t *reaped;    // closed during the current epoll batch
+    client_session_t *pasv_ready;  // pool connections waiting to be claimed, guarded by pasv_pool.lock
+    ftp_uring_t *uring;          // created on the first io_uring transfer
+    int uring_failed;
+    loop_handle_t uring_handle;
+    struct uring_xfer *uring_slots[FTPD_URING_SLOTS];
+    long long throttle_deadline; // earliest throttle_until of its sessions, 0 if none
+    unsigned long quiescent;     // bumped between epoll batches, see accounts_synchronize()
+    int stopped;
+} ftp_loop_t;
+
+typedef enum {
+    URING_BUF_FREE,
+    URING_BUF_READING,
+    URING_BUF_FILLED,
+    URING_BUF_WRITING
+} uring_buf_state_t;
+
+// A RETR or STOR of a regular file driven through the loop's io_uring.
+// Slot n of the loop owns fixed files 2n (file) and 2n+1 (socket) and
+// buffers n * FTPD_URING_DEPTH onwards. The socket side is strictly one
+// operation at a time in stream order; the file side uses explicit offsets,
+// so its reads (RETR) or writes (STOR) overlap with the socket.
+typedef struct uring_xfer {
+    client_session_t *session;   // NULL once the session let go; freed when idle
+    ftp_loop_t *loop;
+    int slot;
+    int receiving;
+    int inflight;
+    int socket_busy;
+    int failed;
+    int eof;
+    off_t eof_offset;            // RETR: end of file seen by a short read
+    off_t offset;                // next file offset to read (RETR) or assign (STOR)
+    unsigned next_fill;          // RETR: buffers are filled and sent in ring order
+    unsigned next_drain;
+    struct {
+        uring_buf_state_t state;
+        off_t offset;
+        size_t len;
+        size_t done;
+    } bufs[FTPD_URING_DEPTH];
+} uring_xfer_t;
+
+static ftp_loop_t loops[FTPD_MAX_LOOPS];
+static int loop_count = 0;
+static unsigned next_loop = 0;
+static pthread_once_t loops_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    pthread_mutex_t lock;
+    int first_port;               // 0 while no range is configured
+    int last_port;
+    pasv_port_t *ports;
+    int count;
+    unsigned next;
+} pasv_pool = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, 0, 0 };
+
+static int io_uring_enabled = 0;
+
+// Bandwidth limits in bytes per second, 0 meaning unlimited. Every file
+// transfer draws from its session's, its user's and the server-wide bucket.
+static ftp_bucket_t global_rate = FTP_BUCKET_INITIALIZER;
+static long long session_rate_limit = 0;
+
+typedef struct user_rate {
     char username[64];
-    char password[64];
-} account_t;
+    ftp_bucket_t bucket;
+    int pinned;                   // set through ftpd_set_user_rate_limit(); reloads keep it
+    struct user_rate *next;
+} user_rate_t;
+
+// Entries are never freed, so sessions keep plain pointers to them.
+static struct {
+    pthread_mutex_t lock;
+    user_rate_t *chains[FTPD_USER_RATE_CHAINS];
+} user_rates = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
+
+// The published account table. Loop threads read it without a lock; a
+// reload swaps in a new table and frees the old one only after every loop
+// has finished the epoll batch it was in (see accounts_synchronize()).
+static ftp_account_table_t *account_table = NULL;
+
+static struct {
+    pthread_mutex_t lock;         // serializes reloads
+    char path[FTP_MAX_PATH];
+    dev_t dev;                    // identity of the file behind the current table
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+} account_store = { PTHREAD_MUTEX_INITIALIZER, "", 0, 0, { 0, 0 }, 0 };
+
+// Prometheus text dump, written by its own thread once the server starts.
+// Off until ftpd_set_metrics_dump() names a file.
+static struct {
+    pthread_mutex_t lock;
+    char path[FTP_MAX_PATH];      // absolute, resolved when the path is set
+    int interval_ms;
+    int started;
+} metrics_dump = { PTHREAD_MUTEX_INITIALIZER, "", FTPD_METRICS_DUMP_MS, 0 };
+
+static void server_log_info(const char *fmt, ...);
+static void server_log_error(const char *fmt, ...);
+
+static user_rate_t *user_rate_get(const char *username, int create) {
+    user_rate_t **chain = &user_rates.chains[ftp_accounts_hash_name(username) % FTPD_USER_RATE_CHAINS];
+    pthread_mutex_lock(&user_rates.lock);
+    user_rate_t *entry = *chain;
+    while (entry && strcmp(entry->username, username) != 0) {
+        entry = entry->next;
+    }
+    if (!entry && create && (entry = calloc(1, sizeof(*entry))) != NULL) {
+        snprintf(entry->username, sizeof(entry->username), "%s", username);
+        ftp_bucket_init(&entry->bucket, 0);
+        entry->next = *chain;
+        *chain = entry;
+    }
+    pthread_mutex_unlock(&user_rates.lock);
+    return entry;
+}
+
+// Users seen so far follow the limits of a reloaded table.
+static void user_rates_refresh(const ftp_account_table_t *table) {
+    pthread_mutex_lock(&user_rates.lock);
+    for (int i = 0; i < FTPD_USER_RATE_CHAINS; i++) {
+        for (user_rate_t *entry = user_rates.chains[i]; entry; entry = entry->next) {
+            if (entry->pinned) continue;
+            const ftp_account_t *account = ftp_accounts_find(table, entry->username);
+            long long rate = account ? account->rate : 0;
+            if (ftp_bucket_rate(&entry->bucket) != rate) {
+                ftp_bucket_set_rate(&entry->bucket, rate);
+            }
+        }
+    }
+    pthread_mutex_unlock(&user_rates.lock);
+}
+
+// Waits until every running loop has passed a quiescent point, i.e. none
+// can still hold a pointer read before the caller's swap.
+static void accounts_synchronize(void) {
+    unsigned long seen[FTPD_MAX_LOOPS];
+    int count = __atomic_load_n(&loop_count, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < count; i++) {
+        seen[i] = __atomic_load_n(&loops[i].quiescent, __ATOMIC_SEQ_CST);
+    }
+    for (int i = 0; i < count; i++) {
+        while (!__atomic_load_n(&loops[i].stopped, __ATOMIC_SEQ_CST) &&
+               __atomic_load_n(&loops[i].quiescent, __ATOMIC_SEQ_CST) == seen[i]) {
+            struct timespec pause = { 0, 10 * 1000 * 1000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+static ftp_account_table_t *default_accounts(void) {
+    ftp_account_table_t *table = ftp_accounts_new();
+    if (table && (ftp_accounts_add(table, "vu", "vu", 0) < 0 || ftp_accounts_add(table, "vuong", "vuong", 0) < 0)) {
+        ftp_accounts_free(table);
+        table = NULL;
+    }
+    return table;
+}
+
+// Builds a new table from account_store.path and publishes it. Logins keep
+// using the old table meanwhile; an unreadable file leaves it in place.
+static int accounts_reload(void) {
+    pthread_mutex_lock(&account_store.lock);
+    struct stat st;
+    int have_file = stat(account_store.path, &st) == 0;
+    int skipped = 0;
+    ftp_account_table_t *table = have_file ? ftp_accounts_load(account_store.path, &skipped) : NULL;
+    if (have_file) {
+        account_store.dev = st.st_dev;
+        account_store.ino = st.st_ino;
+        account_store.mtime = st.st_mtim;
+        account_store.size = st.st_size;
+    }
+    if (!table && __atomic_load_n(&account_table, __ATOMIC_SEQ_CST)) {
+        server_log_error("Cannot reload accounts from %s: %s", account_store.path, strerror(errno));
+        pthread_mutex_unlock(&account_store.lock);
+        return -1;
+    }
+    if (table && ftp_accounts_count(table) == 0) {
+        ftp_accounts_free(table);
+        table = NULL;
+    }
+    if (table) {
+        server_log_info("Loaded %zu account(s) from %s (%d malformed line(s) skipped)",
+                        ftp_accounts_count(table), account_store.path, skipped);
+    } else {
+        table = default_accounts();
+        if (!table) {
+            server_log_error("Cannot build the default accounts: %s", strerror(errno));
+            pthread_mutex_unlock(&account_store.lock);
+            return -1;
+        }
+        server_log_info("No accounts in %s, using the built-in accounts", account_store.path);
+    }
+
+    ftp_account_table_t *old = __atomic_exchange_n(&account_table, table, __ATOMIC_SEQ_CST);
+    user_rates_refresh(table);
+    if (old) {
+        accounts_synchronize();
+        ftp_accounts_free(old);
+    }
+    pthread_mutex_unlock(&account_store.lock);
+    return 0;
+}
+
+static void *accounts_watch(void *arg) {
+    (void)arg;
+    for (;;) {
+        struct timespec pause = { FTPD_ACCOUNTS_POLL_MS / 1000, (FTPD_ACCOUNTS_POLL_MS % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+        struct stat st;
+        if (stat(account_store.path, &st) != 0) continue;
+        pthread_mutex_lock(&account_store.lock);
+        int changed = st.st_dev != account_store.dev || st.st_ino != account_store.ino ||
+                      st.st_size != account_store.size ||
+                      st.st_mtim.tv_sec != account_store.mtime.tv_sec ||
+                      st.st_mtim.tv_nsec != account_store.mtime.tv_nsec;
+        pthread_mutex_unlock(&account_store.lock);
+        if (changed) {
+            accounts_reload();
+        }
+    }
+    return NULL;
+}
+
+// Loads accounts.txt from the current directory once the server starts
+// and keeps following changes to it.
+static int accounts_start(void) {
+    pthread_mutex_lock(&account_store.lock);
+    int first = account_store.path[0] == '\0';
+    if (first) {
+        // Absolute so a later chdir() cannot move the file being watched;
+        // a working directory that does not fit keeps the relative name.
+        char cwd[sizeof(account_store.path)];
+        int n = getcwd(cwd, sizeof(cwd)) ? snprintf(account_store.path, sizeof(account_store.path), "%s/accounts.txt", cwd) : -1;
+        if (n < 0 || (size_t)n >= sizeof(account_store.path)) {
+            server_log_error("Cannot resolve the working directory (%s), using a relative accounts.txt",
+                             n < 0 ? strerror(errno) : "path too long");
+            snprintf(account_store.path, sizeof(account_store.path), "accounts.txt");
+        }
+    }
+    pthread_mutex_unlock(&account_store.lock);
+    if (!first) return 0;
+    if (accounts_reload() < 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accounts_watch, NULL) != 0) {
+        server_log_error("Cannot watch %s for changes", account_store.path);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int ftpd_reload_accounts(void) {
+    if (account_store.path[0] == '\0') {
+        return -1;
+    }
+    return accounts_reload();
+}
+
+// Called on a loop thread; the table stays valid until that loop's next
+// quiescent point. Unknown users still pay for one hash so that replies
+// take the same time either way.
+static bool validate_credentials(const char *user, const char *pass, long long *rate) {
+    static const ftp_account_t nobody;
+    const ftp_account_table_t *table = __atomic_load_n(&account_table, __ATOMIC_SEQ_CST);
+    const ftp_account_t *account = table ? ftp_accounts_find(table, user) : NULL;
+    int ok = ftp_account_check(account ? account : &nobody, pass);
+    if (!account || !ok) {
+        return false;
+    }
+    *rate = account->rate;
+    return true;
+}
+
+// Queued on this thread's log ring; the logger thread does the writing.
+static void server_log(const char *level, const char *fmt, va_list args) {
+    ftp_log_vwrite("SERVER", level, fmt, args);
+}
+
+static void server_log_info(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    server_log("INFO", fmt, args);
+    va_end(args);
+}
+
+static void server_log_error(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    server_log("ERROR", fmt, args);
+    va_end(args);
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct {
+    pthread_mutex_t lock;
+    int inotify_fd;
+    list_cache_entry_t *head;     // most recently used first
+    list_cache_entry_t *tail;
+    size_t bytes;
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+} list_cache = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, NULL, 0, 0, 0, 0 };
+
+static void list_cache_init(void) {
+    list_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (list_cache.inotify_fd < 0) {
+        server_log_error("inotify unavailable (%s), LIST cache falls back to mtime checks", strerror(errno));
+    }
+}
+
+// Caller holds list_cache.lock.
+static void list_cache_unlink(list_cache_entry_t *entry) {
+    if (!entry->linked) return;
+    if (entry->prev) entry->prev->next = entry->next; else list_cache.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else list_cache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    entry->linked = 0;
+    list_cache.bytes -= entry->len;
+    list_cache.count--;
+    if (entry->wd >= 0) {
+        // inotify hands out one wd per inode, so LIST and MLSD entries of a
+        // directory share it; drop the watch with the last of them.
+        list_cache_entry_t *other = list_cache.head;
+        while (other && other->wd != entry->wd) other = other->next;
+        if (!other) inotify_rm_watch(list_cache.inotify_fd, entry->wd);
+        entry->wd = -1;
+    }
+    if (entry->refs == 0 && !entry->building) {
+        free(entry->payload);
+        free(entry);
+    }
+}
+
+static void list_cache_push_front(list_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = list_cache.head;
+    if (list_cache.head) list_cache.head->prev = entry; else list_cache.tail = entry;
+    list_cache.head = entry;
+}
+
+static void list_cache_touch(list_cache_entry_t *entry) {
+    if (list_cache.head == entry) return;
+    entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else list_cache.tail = entry->prev;
+    list_cache_push_front(entry);
+}
+
+// Drops least recently used entries until the cache fits its budget.
+static void list_cache_evict(size_t extra_bytes, int extra_entries) {
+    list_cache_entry_t *entry = list_cache.tail;
+    while (entry && (list_cache.bytes + extra_bytes > FTPD_LIST_CACHE_BYTES ||
+                     list_cache.count + extra_entries > FTPD_LIST_CACHE_ENTRIES)) {
+        list_cache_entry_t *prev = entry->prev;
+        if (!entry->building) list_cache_unlink(entry);
+        entry = prev;
+    }
+}
+
+// Applies pending inotify events. Caller holds list_cache.lock.
+static void list_cache_drain(void) {
+    if (list_cache.inotify_fd < 0) return;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(list_cache.inotify_fd, buf, sizeof(buf));
+        if (n <= 0) return;
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            list_cache_entry_t *entry = list_cache.head;
+            while (entry) {
+                list_cache_entry_t *next = entry->next;
+                // IN_Q_OVERFLOW carries wd -1: everything may be stale.
+                if (ev->wd == -1 || entry->wd == ev->wd) {
+                    list_cache_unlink(entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
+
+// Returns a referenced entry on a hit. On a miss *placeholder may receive a
+// slot that list_cache_publish() fills once the listing has been built.
+static list_cache_entry_t *list_cache_lookup(int dir_fd, int format, list_cache_entry_t **placeholder) {
+    *placeholder = NULL;
+    struct stat st;
+    if (fstat(dir_fd, &st) < 0) return NULL;
+    long long now = monotonic_ms();
+
+    pthread_mutex_lock(&list_cache.lock);
+    list_cache_drain();
+    list_cache_entry_t *entry = list_cache.head;
+    while (entry && !(entry->dev == st.st_dev && entry->ino == st.st_ino && entry->format == format)) {
+        entry = entry->next;
+    }
+    if (entry && !entry->building) {
+        int fresh = list_cache.inotify_fd >= 0 ||
+                    (entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                     now - entry->built_ms < FTPD_LIST_CACHE_TTL_MS);
+        if (fresh) {
+            entry->refs++;
+            list_cache_touch(entry);
+            list_cache.hits++;
+            pthread_mutex_unlock(&list_cache.lock);
+            return entry;
+        }
+        list_cache_unlink(entry);
+        entry = NULL;
+    }
+    list_cache.misses++;
+    if (!entry) {
+        int wd = -1;
+        if (list_cache.inotify_fd >= 0) {
+            char proc_path[64];
+            snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dir_fd);
+            wd = inotify_add_watch(list_cache.inotify_fd, proc_path,
+                                   IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR);
+        }
+        entry = (wd >= 0 || list_cache.inotify_fd < 0) ? calloc(1, sizeof(*entry)) : NULL;
+        if (entry) {
+            list_cache_evict(0, 1);
+            entry->dev = st.st_dev;
+            entry->ino = st.st_ino;
+            entry->format = format;
+            entry->wd = wd;
+            entry->mtime = st.st_mtim;
+            entry->built_ms = now;
+            entry->building = 1;
+            entry->linked = 1;
+            list_cache.count++;
+            list_cache_push_front(entry);
+            *placeholder = entry;
+        } else if (wd >= 0) {
+            list_cache_entry_t *other = list_cache.head;
+            while (other && other->wd != wd) other = other->next;
+            if (!other) inotify_rm_watch(list_cache.inotify_fd, wd);
+        }
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+    return NULL;
+}
+
+// Hands a freshly built payload to the cache. Returns 1 if the cache took
+// ownership (the caller then holds one reference), 0 if the directory
+// changed during the scan or payload is NULL; the caller keeps its buffer.
+static int list_cache_publish(list_cache_entry_t *entry, char *payload, size_t len) {
+    pthread_mutex_lock(&list_cache.lock);
+    list_cache_drain();
+    int kept = entry->linked && payload && len <= FTPD_LIST_CACHE_BYTES / 4;
+    if (kept) {
+        // Still marked building, so eviction steps over it even when newer
+        // entries pushed it towards the tail during the scan.
+        list_cache_evict(len, 0);
+        entry->building = 0;
+        entry->payload = payload;
+        entry->len = len;
+        entry->refs = 1;
+        list_cache.bytes += len;
+    } else if (entry->linked) {
+        entry->building = 0;
+        list_cache_unlink(entry);
+    } else {
+        free(entry);
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+    return kept;
+}
+
+static void list_cache_release(list_cache_entry_t *entry) {
+    pthread_mutex_lock(&list_cache.lock);
+    entry->refs--;
+    if (entry->refs == 0 && !entry->linked) {
+        free(entry->payload);
+        free(entry);
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+static struct {
+    pthread_mutex_t lock;
+    file_cache_entry_t *chains[FTPD_FILE_CACHE_CHAINS];
+    file_cache_entry_t *head;     // most recently used first
+    file_cache_entry_t *tail;
+    int count;
+} file_cache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, NULL, 0 };
+
+static file_cache_entry_t **file_cache_chain(dev_t dev, ino_t ino) {
+    unsigned long long key = ((unsigned long long)ino * 0x9E3779B97F4A7C15ULL) ^ (unsigned long long)dev;
+    return &file_cache.chains[(key >> 32) % FTPD_FILE_CACHE_CHAINS];
+}
+
+// Caller holds file_cache.lock. An unreferenced entry is moved to *dead,
+// to be closed once the lock is dropped.
+static void file_cache_unlink(file_cache_entry_t *entry, file_cache_entry_t **dead) {
+    if (!entry->linked) return;
+    file_cache_entry_t **link = file_cache_chain(entry->dev, entry->ino);
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    if (entry->prev) entry->prev->next = entry->next; else file_cache.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else file_cache.tail = entry->prev;
+    entry->prev = entry->chain = NULL;
+    entry->linked = 0;
+    file_cache.count--;
+    if (entry->refs == 0) {
+        entry->next = *dead;
+        *dead = entry;
+    } else {
+        entry->next = NULL;
+    }
+}
+
+// The last close of a deleted file frees its blocks, so it stays off the lock.
+static void file_cache_bury(file_cache_entry_t *dead) {
+    while (dead) {
+        file_cache_entry_t *next = dead->next;
+        close(dead->fd);
+        free(dead);
+        dead = next;
+    }
+}
+
+static void file_cache_push_front(file_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = file_cache.head;
+    if (file_cache.head) file_cache.head->prev = entry; else file_cache.tail = entry;
+    file_cache.head = entry;
+}
+
+static void file_cache_touch(file_cache_entry_t *entry, long long now) {
+    entry->used_ms = now;
+    if (file_cache.head == entry) return;
+    entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else file_cache.tail = entry->prev;
+    file_cache_push_front(entry);
+}
+
+// Closes idle entries that are too old or over the budget. The list is
+// ordered by used_ms, so the walk stops at the first recent entry once the
+// budget holds; referenced entries are skipped, they are pinned.
+static void file_cache_evict(int extra_entries, long long now, file_cache_entry_t **dead) {
+    file_cache_entry_t *entry = file_cache.tail;
+    while (entry) {
+        file_cache_entry_t *prev = entry->prev;
+        int full = file_cache.count + extra_entries > FTPD_FILE_CACHE_ENTRIES;
+        int idle = now - entry->used_ms > FTPD_FILE_CACHE_IDLE_MS;
+        if (!full && !idle) break;
+        if (entry->refs == 0) {
+            file_cache_unlink(entry, dead);
+            ftp_metrics_file_cache_evicted();
+        }
+        entry = prev;
+    }
+}
+
+// Caller holds file_cache.lock. A linked entry for the same inode with a
+// different mtime or size is stale and is dropped.
+static file_cache_entry_t *file_cache_find(const struct stat *st, file_cache_entry_t **dead) {
+    file_cache_entry_t *entry = *file_cache_chain(st->st_dev, st->st_ino);
+    while (entry && !(entry->dev == st->st_dev && entry->ino == st->st_ino)) entry = entry->chain;
+    if (!entry) return NULL;
+    if (entry->size == st->st_size && entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        return entry;
+    }
+    file_cache_unlink(entry, dead);
+    return NULL;
+}
+
+// Returns a referenced entry for the regular file st describes, opening it
+// on a miss. NULL with errno set if it cannot be opened.
+static file_cache_entry_t *file_cache_acquire(int dir_fd, const char *path, const struct stat *st) {
+    file_cache_entry_t *dead = NULL;
+    long long now = monotonic_ms();
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache_entry_t *entry = file_cache_find(st, &dead);
+    if (entry) {
+        entry->refs++;
+        file_cache_touch(entry, now);
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    file_cache_bury(dead);
+    ftp_metrics_file_cache(entry != NULL);
+    if (entry) return entry;
+
+    // Opening may wait on the filesystem, so it runs unlocked. The entry is
+    // keyed on what was actually opened, which may be newer than *st.
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat opened;
+    entry = calloc(1, sizeof(*entry));
+    if (!entry || fstat(fd, &opened) < 0 || !S_ISREG(opened.st_mode)) {
+        free(entry);
+        close(fd);
+        return NULL;
+    }
+    entry->dev = opened.st_dev;
+    entry->ino = opened.st_ino;
+    entry->mtime = opened.st_mtim;
+    entry->size = opened.st_size;
+    entry->fd = fd;
+    entry->refs = 1;
+
+    dead = NULL;
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache_entry_t *raced = file_cache_find(&opened, &dead);
+    if (raced) {
+        // Another reader opened it meanwhile; share theirs.
+        raced->refs++;
+        file_cache_touch(raced, now);
+        entry->next = dead;
+        dead = entry;
+        entry = raced;
+    } else {
+        file_cache_evict(1, now, &dead);
+        entry->used_ms = now;
+        entry->linked = 1;
+        file_cache_entry_t **chain = file_cache_chain(entry->dev, entry->ino);
+        entry->chain = *chain;
+        *chain = entry;
+        file_cache_push_front(entry);
+        file_cache.count++;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    file_cache_bury(dead);
+    return entry;
+}
+
+static void file_cache_release(file_cache_entry_t *entry) {
+    file_cache_entry_t *dead = NULL;
+    long long now = monotonic_ms();
+    pthread_mutex_lock(&file_cache.lock);
+    if (--entry->refs == 0) {
+        if (entry->linked) {
+            file_cache_touch(entry, now);
+            file_cache_evict(0, now, &dead);
+        } else {
+            dead = entry;
+            entry->next = NULL;
+        }
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    file_cache_bury(dead);
+}
+
+// Closes idle entries even when no RETR comes along to evict them, so a
+// file removed behind the server's back does not stay open for long.
+static void file_cache_sweep(void) {
+    file_cache_entry_t *dead = NULL;
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache_evict(0, monotonic_ms(), &dead);
+    pthread_mutex_unlock(&file_cache.lock);
+    file_cache_bury(dead);
+}
+
+// Called before DELE or RNTO replaces path, so an idle descriptor does not
+// keep a deleted file's blocks allocated.
+static void file_cache_forget(int dir_fd, const char *path) {
+    struct stat st;
+    if (fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) return;
+    file_cache_entry_t *dead = NULL;
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache_entry_t *entry = *file_cache_chain(st.st_dev, st.st_ino);
+    while (entry && !(entry->dev == st.st_dev && entry->ino == st.st_ino)) entry = entry->chain;
+    if (entry) file_cache_unlink(entry, &dead);
+    pthread_mutex_unlock(&file_cache.lock);
+    file_cache_bury(dead);
+}
+
+// Drops the session's pool lease. Caller holds pasv_pool.lock.
+static void pasv_pool_release_locked(client_session_t *session) {
+    pasv_port_t *port = session->pasv_port;
+    if (!port) return;
+    client_session_t **link = &port->leases;
+    while (*link && *link != session) link = &(*link)->lease_next;
+    if (*link) *link = session->lease_next;
+    session->lease_next = NULL;
+    session->pasv_port = NULL;
+    if (session->pasv_pool_fd >= 0) {
+        close(session->pasv_pool_fd);
+        session->pasv_pool_fd = -1;
+    }
+    if (session->pasv_ready) {
+        client_session_t **ready = &session->loop->pasv_ready;
+        while (*ready && *ready != session) ready = &(*ready)->ready_next;
+        if (*ready) *ready = session->ready_next;
+        session->ready_next = NULL;
+        session->pasv_ready = 0;
+    }
+}
+
+static void pasv_pool_release(client_session_t *session) {
+    if (!session->pasv_port) return;
+    pthread_mutex_lock(&pasv_pool.lock);
+    pasv_pool_release_locked(session);
+    pthread_mutex_unlock(&pasv_pool.lock);
+}
+
+// Leases a pool port no other session from the same address holds.
+// Returns the port number, or -1 when the pool is off or exhausted.
+static int pasv_pool_lease(client_session_t *session) {
+    int leased = -1;
+    pthread_mutex_lock(&pasv_pool.lock);
+    pasv_pool_release_locked(session);
+    for (int i = 0; i < pasv_pool.count && leased < 0; i++) {
+        pasv_port_t *port = &pasv_pool.ports[(pasv_pool.next + i) % pasv_pool.count];
+        if (port->fd < 0) continue;
+        client_session_t *other = port->leases;
+        while (other && other->peer_addr.s_addr != session->peer_addr.s_addr) other = other->lease_next;
+        if (other) continue;
+        session->lease_next = port->leases;
+        port->leases = session;
+        session->pasv_port = port;
+        leased = port->port;
+        pasv_pool.next += i + 1;
+    }
+    pthread_mutex_unlock(&pasv_pool.lock);
+    return leased;
+}
+
+// Runs on whichever loop hosts the listener; the connection is parked on
+// the matching session and its own loop is woken to claim it.
+static void pasv_pool_accept(pasv_port_t *port) {
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept4(port->fd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        ftp_loop_t *wake = NULL;
+        pthread_mutex_lock(&pasv_pool.lock);
+        client_session_t *session = port->leases;
+        while (session && !(session->peer_addr.s_addr == peer.sin_addr.s_addr && session->pasv_pool_fd < 0)) {
+            session = session->lease_next;
+        }
+        if (session) {
+            session->pasv_pool_fd = fd;
+            if (!session->pasv_ready) {
+                session->pasv_ready = 1;
+                session->ready_next = session->loop->pasv_ready;
+                session->loop->pasv_ready = session;
+            }
+            wake = session->loop;
+        }
+        pthread_mutex_unlock(&pasv_pool.lock);
+        if (wake) {
+            uint64_t one = 1;
+            if (write(wake->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                server_log_error("Cannot wake event loop: %s", strerror(errno));
+            }
+        } else {
+            char peer_ip[INET_ADDRSTRLEN] = "unknown";
+            inet_ntop(AF_INET, &peer.sin_addr, peer_ip, sizeof(peer_ip));
+            server_log_error("Dropping unexpected data connection from %s on port %d", peer_ip, port->port);
+            close(fd);
+        }
+    }
+}
+
+// Takes the parked pool connection, if any, ending the lease.
+static int session_take_pool_fd(client_session_t *session) {
+    pthread_mutex_lock(&pasv_pool.lock);
+    int fd = session->pasv_pool_fd;
+    if (fd >= 0) {
+        session->pasv_pool_fd = -1;
+        pasv_pool_release_locked(session);
+    }
+    pthread_mutex_unlock(&pasv_pool.lock);
+    return fd;
+}
+
+int ftpd_set_pasv_range(int first_port, int last_port) {
+    if (first_port <= 0 || last_port > 65535 || first_port > last_port) {
+        server_log_error("Invalid PASV port range %d-%d", first_port, last_port);
+        return -1;
+    }
+    pthread_mutex_lock(&pasv_pool.lock);
+    int unchanged = pasv_pool.first_port == first_port && pasv_pool.last_port == last_port;
+    int rc = (pasv_pool.ports && !unchanged) ? -1 : 0;
+    if (rc == 0) {
+        pasv_pool.first_port = first_port;
+        pasv_pool.last_port = last_port;
+    }
+    pthread_mutex_unlock(&pasv_pool.lock);
+    if (rc < 0) {
+        server_log_error("PASV port range is fixed once the server has started");
+    }
+    return rc;
+}
+
+// Binds every port of the configured range once; the listeners are spread
+// over the event loops and stay open for the life of the process.
+static void pasv_pool_start(void) {
+    pthread_mutex_lock(&pasv_pool.lock);
+    if (pasv_pool.ports || pasv_pool.first_port == 0) {
+        pthread_mutex_unlock(&pasv_pool.lock);
+        return;
+    }
+    int count = pasv_pool.last_port - pasv_pool.first_port + 1;
+    pasv_pool.ports = calloc((size_t)count, sizeof(*pasv_pool.ports));
+    if (!pasv_pool.ports) {
+        pthread_mutex_unlock(&pasv_pool.lock);
+        return;
+    }
+    pasv_pool.count = count;
+    int bound = 0;
+    for (int i = 0; i < count; i++) {
+        pasv_port_t *port = &pasv_pool.ports[i];
+        port->handle.kind = HANDLE_PASV_POOL;
+        port->port = pasv_pool.first_port + i;
+        port->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port->port);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &port->handle;
+        if (port->fd < 0 ||
+            setsockopt(port->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            bind(port->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(port->fd, SOMAXCONN) < 0 ||
+            epoll_ctl(loops[i % loop_count].epoll_fd, EPOLL_CTL_ADD, port->fd, &ev) < 0) {
+            server_log_error("PASV port %d unavailable: %s", port->port, strerror(errno));
+            if (port->fd >= 0) close(port->fd);
+            port->fd = -1;
+            continue;
+        }
+        bound++;
+    }
+    pthread_mutex_unlock(&pasv_pool.lock);
+    server_log_info("PASV pool listening on %d of %d ports (%d-%d)", bound, count,
+                    pasv_pool.first_port, pasv_pool.last_port);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static bool transfer_is_listing(transfer_kind_t kind) {
+    return kind == TRANSFER_LIST || kind == TRANSFER_MLSD || kind == TRANSFER_NLST;
+}
+
+static void session_update_interest(client_session_t *session);
+static void session_close(client_session_t *session);
+static void session_process_commands(client_session_t *session);
+static void session_end_list_scan(client_session_t *session, int complete);
+static void uring_xfer_detach(client_session_t *session);
+
+// Control replies are queued per session so a slow reader never blocks the loop.
+static void session_flush_replies(client_session_t *session) {
+    size_t off = 0;
+    while (off < session->reply_len) {
+        ssize_t n = send(session->control_fd, session->reply_buf + off, session->reply_len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            server_log_error("Control write failed for %s:%d: %s", session->client_ip, session->client_port, strerror(errno));
+            session_close(session);
+            return;
+        }
+        off += (size_t)n;
+    }
+    memmove(session->reply_buf, session->reply_buf + off, session->reply_len - off);
+    session->reply_len -= off;
+    session_update_interest(session);
+}
+
+// Queues already formatted reply text, which may span several lines.
+static void session_reply_raw(client_session_t *session, const char *response, size_t len) {
+    if (session->closed) return;
+    if (session->reply_len + len > sizeof(session->reply_buf)) {
+        // The client stopped reading replies; dropping it is the only way to bound memory.
+        server_log_error("Reply queue overflow for %s:%d", session->client_ip, session->client_port);
+        session_close(session);
+        return;
+    }
+    memcpy(session->reply_buf + session->reply_len, response, len);
+    session->reply_len += len;
+    session_flush_replies(session);
+}
+
+static void session_reply(client_session_t *session, int code, const char *message) {
+    char response[FTP_MAX_LINE];
+    int len = snprintf(response, sizeof(response), "%d %s\r\n", code, message);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(response)) len = sizeof(response) - 1;
+    session_reply_raw(session, response, (size_t)len);
+}
+
+// A running transfer listens for one command line, which may be ABOR.
+static int session_awaits_abort(client_session_t *session) {
+    if (session->state != SESSION_SENDING && session->state != SESSION_RECEIVING) return 0;
+    char line[FTP_MAX_LINE];
+    return !line_reader_peek(&session->reader, line, sizeof(line));
+}
+
+static void session_update_interest(client_session_t *session) {
+    if (session->closed) return;
+    uint32_t events = 0;
+    if (session->reply_len > 0) {
+        events |= EPOLLOUT;
+    } else if (session->state == SESSION_IDLE || session_awaits_abort(session)) {
+        events |= EPOLLIN;
+    }
+    if (events == session->control_events) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &session->control_handle;
+    if (epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_MOD, session->control_fd, &ev) == 0) {
+        session->control_events = events;
+    }
+}
+
+static void session_rate_charge(client_session_t *session, long long bytes);
+
+static void session_close_data(client_session_t *session) {
+    session->throttle_until = 0;
+    if (session->rate_credit > 0) {
+        session_rate_charge(session, -session->rate_credit);
+        session->rate_credit = 0;
+    }
+    if (session->uring) {
+        uring_xfer_detach(session);
+    }
+    if (session->data_fd >= 0) {
+        close(session->data_fd);
+        session->data_fd = -1;
+    }
+    if (session->transfer_file) {
+        fclose(session->transfer_file);
+        session->transfer_file = NULL;
+    }
+    if (session->file_entry) {
+        file_cache_release(session->file_entry);
+        session->file_entry = NULL;
+        session->transfer_fd = -1;
+    } else if (session->transfer_fd >= 0) {
+        close(session->transfer_fd);
+        session->transfer_fd = -1;
+    }
+    if (session->scan || session->list_placeholder) {
+        session_end_list_scan(session, 0);
+    }
+    free(session->list_buf);
+    session->list_buf = NULL;
+    session->list_cap = 0;
+    if (session->list_entry) {
+        list_cache_release(session->list_entry);
+        session->list_entry = NULL;
+    }
+    session->send_ptr = NULL;
+    session->send_len = 0;
+    free(session->xfer_buf);
+    session->xfer_buf = NULL;
+    session->xfer_size = 0;
+    if (session->z) {
+        ftp_zstream_end(&session->z->stream);
+        free(session->z);
+        session->z = NULL;
+    }
+}
+
+static void session_close(client_session_t *session) {
+    if (session->closed) return;
+    session->closed = 1;
+    session_close_data(session);
+    if (session->state == SESSION_RECEIVING) {
+        unlinkat(session->dir_fd, session->transfer_path, 0);
+    }
+    splice_pipe_close(session->splice_pipe);
+    if (session->dir_fd >= 0) {
+        close(session->dir_fd);
+        session->dir_fd = -1;
+    }
+    if (session->pasv_listen_fd >= 0) {
+        close(session->pasv_listen_fd);
+        session->pasv_listen_fd = -1;
+    }
+    pasv_pool_release(session);
+    close(session->control_fd);
+    ftp_metrics_session_closed();
+    server_log_info("Session ended with %s:%d", session->client_ip, session->client_port);
+
+    // Other events for this session may still be pending in the current
+    // epoll batch, so the memory is only released once the batch is done.
+    ftp_loop_t *loop = session->loop;
+    client_session_t **link = &loop->sessions;
+    while (*link && *link != session) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = session->next;
+    }
+    session->next = loop->reaped;
+    loop->reaped = session;
+}
+
+// A command counts as done once the session is idle again: right after
+// its handler for most verbs, at the final reply for transfers.
+static void session_command_done(client_session_t *session) {
+    if (session->command_verb < 0) return;
+    ftp_metrics_command(session->command_verb, ftp_metrics_now_us() - session->command_started_us);
+    session->command_verb = -1;
+}
+
+static void session_finish_transfer(client_session_t *session, int code, const char *message) {
+    if (code == FTP_SUCCESS && !transfer_is_listing(session->transfer)) {
+        double seconds = (monotonic_ms() - session->transfer_started) / 1000.0;
+        double rate = seconds > 0 ? session->transfer_bytes / seconds / (1024.0 * 1024.0) : 0.0;
+        server_log_info("%s '%s' %lld bytes in %.3f s (%.1f MB/s) for %s:%d",
+                        session->transfer == TRANSFER_RETR ? "Sent" : "Received",
+                        session->transfer_path, session->transfer_bytes, seconds, rate,
+                        session->client_ip, session->client_port);
+        if (session->z) {
+            server_log_info("MODE Z moved %lld bytes on the wire for '%s'", session->z->wire_bytes, session->transfer_path);
+        }
+    }
+    session_close_data(session);
+    session->state = SESSION_IDLE;
+    session_reply(session, code, message);
+    session_command_done(session);
+    session_update_interest(session);
+    // Commands pipelined behind the transfer are already buffered.
+    session_process_commands(session);
+}
+
+static const char *transfer_name(transfer_kind_t kind) {
+    switch (kind) {
+        case TRANSFER_LIST: return "LIST";
+        case TRANSFER_MLSD: return "MLSD";
+        case TRANSFER_NLST: return "NLST";
+        case TRANSFER_RETR: return "RETR";
+        case TRANSFER_STOR: return "STOR";
+    }
+    return "?";
+}
+
+static int session_watch_data(client_session_t *session, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &session->data_handle;
+    return epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_ADD, session->data_fd, &ev);
+}
+
+static int buffer_append(char **buf, size_t *len, size_t *capacity, const char *data, size_t n) {
+    if (*len + n > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : FTP_BUFFER_SIZE;
+        while (new_capacity < *len + n) new_capacity *= 2;
+        char *grown = realloc(*buf, new_capacity);
+        if (!grown) return -1;
+        *buf = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+// RFC 3659 facts for one entry, without the trailing name.
+static void format_mlsx_facts(char *out, size_t size, const char *type, long long file_size, time_t mtime) {
+    struct tm tm;
+    char modify[16] = "19700101000000";
+    if (gmtime_r(&mtime, &tm)) {
+        strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+    }
+    if (strcmp(type, "file") != 0) {
+        snprintf(out, size, "type=%s;modify=%s;", type, modify);
+    } else {
+        snprintf(out, size, "type=%s;size=%lld;modify=%s;", type, file_size, modify);
+    }
+}
+
+static const char *mlsx_type(mode_t mode, const char *name) {
+    if (!S_ISDIR(mode)) return "file";
+    if (strcmp(name, ".") == 0) return "cdir";
+    if (strcmp(name, "..") == 0) return "pdir";
+    return "dir";
+}
+
+// Formats one listing row; returns 0 for entries that cannot be listed.
+static int format_list_row(transfer_kind_t kind, const ftp_scan_entry_t *entry, char *list_buffer, size_t size) {
+    int len;
+    if (kind == TRANSFER_NLST) {
+        if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) return 0;
+        len = snprintf(list_buffer, size, "%.*s\r\n", (int)size - 3, entry->name);
+    } else if (!entry->stat_ok) {
+        return 0;
+    } else if (kind == TRANSFER_MLSD) {
+        char facts[96];
+        format_mlsx_facts(facts, sizeof(facts), mlsx_type(entry->mode, entry->name), entry->size, entry->mtime);
+        len = snprintf(list_buffer, size, "%s %.*s\r\n", facts, (int)size - 100, entry->name);
+    } else if (S_ISDIR(entry->mode)) {
+        // *** ĐÃ SỬA (Warning) ***
+        // Trừ 50 byte cho phần text cứng, truncate tên file an toàn
+        len = snprintf(list_buffer, size, "drwxr-xr-x 1 user user %lld %.*s\r\n",
+                       entry->size, (int)size - 50, entry->name);
+    } else {
+        // *** ĐÃ SỬA (Warning) ***
+        len = snprintf(list_buffer, size, "-rw-r--r-- 1 user user %lld %.*s\r\n",
+                       entry->size, (int)size - 50, entry->name);
+    }
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
+
+// Stops a listing scan. A payload that was not fully built never reaches
+// the cache.
+static void session_end_list_scan(client_session_t *session, int complete) {
+    ftp_dirscan_close(session->scan);
+    session->scan = NULL;
+    if (session->list_placeholder) {
+        char *payload = complete ? session->list_copy : NULL;
+        if (list_cache_publish(session->list_placeholder, payload, session->list_copy_len)) {
+            // Nothing of it is sent any more, so drop the publisher's reference.
+            list_cache_release(session->list_placeholder);
+            session->list_copy = NULL;
+        }
+        session->list_placeholder = NULL;
+    }
+    free(session->list_copy);
+    session->list_copy = NULL;
+    session->list_copy_len = 0;
+    session->list_copy_cap = 0;
+}
+
+// Formats the next getdents64 batch of a running scan into list_buf.
+// Returns the payload length, 0 when the scan is finished, -1 on error.
+static ssize_t session_list_refill(client_session_t *session, const char **data) {
+    size_t len = 0;
+    while (session->scan && len == 0) {
+        const ftp_scan_entry_t *entries;
+        int count = ftp_dirscan_next(session->scan, &entries);
+        if (count <= 0) {
+            if (count < 0) {
+                server_log_error("Cannot read directory for %s:%d: %s", session->client_ip, session->client_port, strerror(errno));
+            }
+            session_end_list_scan(session, count == 0);
+            return count;
+        }
+        for (int i = 0; i < count; i++) {
+            char list_buffer[FTP_MAX_LINE];
+            int row_len = format_list_row(session->transfer, &entries[i], list_buffer, sizeof(list_buffer));
+            if (row_len > 0 && buffer_append(&session->list_buf, &len, &session->list_cap, list_buffer, (size_t)row_len) < 0) {
+                server_log_error("Out of memory while listing for %s:%d", session->client_ip, session->client_port);
+                session_end_list_scan(session, 0);
+                return -1;
+            }
+        }
+    }
+    if (session->list_placeholder) {
+        // Keep a copy for the cache while it still fits the per-entry limit.
+        if (session->list_copy_len + len > FTPD_LIST_CACHE_BYTES / 4 ||
+            buffer_append(&session->list_copy, &session->list_copy_len, &session->list_copy_cap, session->list_buf, len) < 0) {
+            list_cache_publish(session->list_placeholder, NULL, 0);
+            session->list_placeholder = NULL;
+            free(session->list_copy);
+            session->list_copy = NULL;
+            session->list_copy_len = 0;
+            session->list_copy_cap = 0;
+        }
+    }
+    *data = session->list_buf;
+    return (ssize_t)len;
+}
+
+// Serves listings from the shared cache, streaming a directory scan on a miss.
+static void session_load_list(client_session_t *session) {
+    list_cache_entry_t *placeholder = NULL;
+    list_cache_entry_t *entry = list_cache_lookup(session->dir_fd, session->transfer, &placeholder);
+    if (entry) {
+        session->list_entry = entry;
+        session->send_ptr = entry->payload;
+        session->send_len = entry->len;
+        return;
+    }
+    session->send_ptr = NULL;
+    session->send_len = 0;
+    session->scan = ftp_dirscan_open(session->dir_fd, session->transfer == TRANSFER_NLST ? 0 : FTP_SCAN_STAT);
+    if (!session->scan) {
+        server_log_error("Cannot open directory for %s:%d: %s", session->client_ip, session->client_port, strerror(errno));
+        if (placeholder) list_cache_publish(placeholder, NULL, 0);
+        return;
+    }
+    session->list_placeholder = placeholder;
+}
+
+// ---- bandwidth shaping ---------------------------------------------------
+
+static int session_buckets(client_session_t *session, ftp_bucket_t **buckets) {
+    long long limit = __atomic_load_n(&session_rate_limit, __ATOMIC_RELAXED);
+    if (ftp_bucket_rate(&session->rate) != limit) {
+        ftp_bucket_set_rate(&session->rate, limit);
+    }
+    int count = 0;
+    buckets[count++] = &session->rate;
+    if (session->user_rate) buckets[count++] = &session->user_rate->bucket;
+    buckets[count++] = &global_rate;
+    return count;
+}
+
+// Parks the data channel; loop_resume_throttled() picks it up again. The
+// io_uring path simply queues no socket operation in the meantime.
+static void session_throttle(client_session_t *session, long long delay_us) {
+    session->throttle_until = monotonic_ms() + (delay_us + 999) / 1000;
+    ftp_loop_t *loop = session->loop;
+    if (loop->throttle_deadline == 0 || session->throttle_until < loop->throttle_deadline) {
+        loop->throttle_deadline = session->throttle_until;
+    }
+    if (!session->uring) {
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.ptr = &session->data_handle;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->data_fd, &ev);
+    }
+}
+
+// How many of want bytes the current transfer may move now. Listings are
+// not shaped. Returns 0 after throttling the session.
+static size_t session_rate_grant(client_session_t *session, size_t want) {
+    if (transfer_is_listing(session->transfer)) return want;
+    // io_uring completions keep stepping a throttled transfer.
+    if (session->throttle_until > 0) return 0;
+    if (session->rate_credit > 0) {
+        return want < (size_t)session->rate_credit ? want : (size_t)session->rate_credit;
+    }
+    ftp_bucket_t *buckets[3];
+    int count = session_buckets(session, buckets);
+    long long allowed = (long long)want;
+    long long slowest = 0;
+    for (int i = 0; i < count; i++) {
+        long long available = ftp_bucket_available(buckets[i]);
+        if (available < allowed) allowed = available;
+        long long rate = ftp_bucket_rate(buckets[i]);
+        if (rate > 0 && (slowest == 0 || rate < slowest)) slowest = rate;
+    }
+    long long needed = want < FTPD_RATE_MIN_GRANT ? (long long)want : FTPD_RATE_MIN_GRANT;
+    if (allowed >= needed) return (size_t)allowed;
+
+    // Out of tokens: pay for the next quantum up front, overdrawing the
+    // buckets, and sleep until the debt is repaid. Later sessions queue up
+    // behind the overdraft, so sessions sharing a bucket take turns instead
+    // of racing for every refill.
+    long long quantum = slowest / FTPD_RATE_QUANTA_PER_SEC;
+    if (quantum < FTPD_RATE_MIN_GRANT) quantum = FTPD_RATE_MIN_GRANT;
+    long long delay = 0;
+    for (int i = 0; i < count; i++) {
+        ftp_bucket_take(buckets[i], quantum);
+        long long d = ftp_bucket_delay_us(buckets[i], 0);
+        if (d > delay) delay = d;
+    }
+    session->rate_credit = quantum;
+    if (delay == 0) {
+        return want < (size_t)quantum ? want : (size_t)quantum;
+    }
+    session_throttle(session, delay);
+    return 0;
+}
+
+// Bytes already paid for by a throttle are not charged again; a negative
+// count hands unused credit back.
+static void session_rate_charge(client_session_t *session, long long bytes) {
+    if (bytes == 0 || transfer_is_listing(session->transfer)) return;
+    if (bytes > 0) {
+        long long prepaid = bytes < session->rate_credit ? bytes : session->rate_credit;
+        session->rate_credit -= prepaid;
+        bytes -= prepaid;
+        if (bytes == 0) return;
+    }
+    ftp_bucket_t *buckets[3];
+    int count = session_buckets(session, buckets);
+    for (int i = 0; i < count; i++) {
+        ftp_bucket_take(buckets[i], bytes);
+    }
+}
+
+int ftpd_set_rate_limits(long long global_limit, long long session_limit) {
+    if (global_limit < 0 || session_limit < 0) {
+        return -1;
+    }
+    ftp_bucket_set_rate(&global_rate, global_limit);
+    __atomic_store_n(&session_rate_limit, session_limit, __ATOMIC_RELAXED);
+    server_log_info("Rate limits: server %lld B/s, per session %lld B/s (0 = unlimited)", global_limit, session_limit);
+    return 0;
+}
+
+int ftpd_set_user_rate_limit(const char *username, long long limit) {
+    if (!username || !*username || limit < 0) {
+        return -1;
+    }
+    user_rate_t *user_rate = user_rate_get(username, 1);
+    if (!user_rate) {
+        return -1;
+    }
+    user_rate->pinned = 1;
+    ftp_bucket_set_rate(&user_rate->bucket, limit);
+    server_log_info("Rate limit for user %s: %lld B/s (0 = unlimited)", username, limit);
+    return 0;
+}
+
+// Counts payload bytes: file or listing bytes, not the MODE Z wire bytes.
+static void session_count_bytes(client_session_t *session, long long bytes) {
+    session->transfer_bytes += bytes;
+    ftp_metrics_bytes(session->transfer == TRANSFER_STOR, bytes);
+}
+
+static void session_retr_failed(client_session_t *session) {
+    server_log_error("Error sending file '%s' to %s:%d", session->transfer_path, session->client_ip, session->client_port);
+    session_finish_transfer(session, FTP_ACTION_FAILED, "Error reading file or sending data");
+}
+
+// Regular files go straight from the page cache to the socket.
+static void session_pump_sendfile(client_session_t *session) {
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        size_t chunk = session_rate_grant(session, session->chunk);
+        if (chunk == 0) return;
+        ssize_t n = send_file_chunk(session->data_fd, session->transfer_fd, &session->transfer_offset, chunk);
+        if (n > 0) {
+            session_count_bytes(session, n);
+            session_rate_charge(session, n);
+            continue;
+        }
+        if (n == 0) {
+            session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            session_retr_failed(session);
+        }
+        return;
+    }
+}
+
+// Reads the next raw block for a compressed RETR. Returns bytes, 0 at EOF.
+static ssize_t session_read_raw(client_session_t *session) {
+    if (session->transfer_fd >= 0) {
+        ssize_t n;
+        do {
+            n = pread(session->transfer_fd, session->xfer_buf, session->xfer_size, session->transfer_offset);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) session->transfer_offset += n;
+        return n;
+    }
+    size_t n = fread(session->xfer_buf, 1, session->xfer_size, session->transfer_file);
+    if (n == 0 && ferror(session->transfer_file)) return -1;
+    return (ssize_t)n;
+}
+
+static void session_pump_send_z(client_session_t *session) {
+    session_zstate_t *z = session->z;
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        if (session->send_len > 0) {
+            size_t chunk = session_rate_grant(session, session->send_len);
+            if (chunk == 0) return;
+            ssize_t sent = send(session->data_fd, session->send_ptr, chunk, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (transfer_is_listing(session->transfer)) {
+                    session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+                } else {
+                    session_retr_failed(session);
+                }
+                return;
+            }
+            session->send_ptr += sent;
+            session->send_len -= (size_t)sent;
+            z->wire_bytes += sent;
+            session_rate_charge(session, sent);
+            continue;
+        }
+        if (z->stream.ended) {
+            session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+            return;
+        }
+        if (z->raw_len == 0 && !z->raw_eof) {
+            if (transfer_is_listing(session->transfer)) {
+                ssize_t n = session_list_refill(session, &z->raw_ptr);
+                if (n < 0) {
+                    session_finish_transfer(session, FTP_ACTION_FAILED, "Error reading directory");
+                    return;
+                }
+                z->raw_len = (size_t)n;
+                z->raw_eof = (n == 0);
+            } else {
+                ssize_t n = session_read_raw(session);
+                if (n < 0) {
+                    session_retr_failed(session);
+                    return;
+                }
+                z->raw_ptr = session->xfer_buf;
+                z->raw_len = (size_t)n;
+                z->raw_eof = (n == 0);
+                session_count_bytes(session, n);
+            }
+        }
+        size_t consumed = 0;
+        ssize_t produced = ftp_zstream_process(&z->stream, z->raw_ptr, z->raw_len, &consumed,
+                                               z->out, sizeof(z->out), z->raw_eof);
+        if (produced < 0) {
+            session_retr_failed(session);
+            return;
+        }
+        z->raw_ptr += consumed;
+        z->raw_len -= consumed;
+        session->send_ptr = z->out;
+        session->send_len = (size_t)produced;
+    }
+}
+
+// Pushes queued data until the socket would block. Each wakeup is bounded so
+// that one fast transfer cannot starve the other sessions on the same loop.
+static void session_pump_send(client_session_t *session) {
+    if (session->z) {
+        session_pump_send_z(session);
+        return;
+    }
+    if (session->transfer_fd >= 0) {
+        session_pump_sendfile(session);
+        return;
+    }
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        if (session->send_len == 0) {
+            if (transfer_is_listing(session->transfer)) {
+                ssize_t n = session_list_refill(session, &session->send_ptr);
+                if (n > 0) {
+                    session->send_len = (size_t)n;
+                    continue;
+                }
+                if (n < 0) {
+                    session_finish_transfer(session, FTP_ACTION_FAILED, "Error reading directory");
+                } else {
+                    session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+                }
+                return;
+            }
+            size_t n = fread(session->xfer_buf, 1, session->xfer_size, session->transfer_file);
+            if (n == 0) {
+                if (ferror(session->transfer_file)) {
+                    session_retr_failed(session);
+                } else {
+                    session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+                }
+                return;
+            }
+            session->send_ptr = session->xfer_buf;
+            session->send_len = n;
+        }
+        size_t chunk = session_rate_grant(session, session->send_len);
+        if (chunk == 0) return;
+        ssize_t sent = send(session->data_fd, session->send_ptr, chunk, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (transfer_is_listing(session->transfer)) {
+                // LIST never reported data-channel errors; keep that behaviour.
+                session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+            } else {
+                session_retr_failed(session);
+            }
+            return;
+        }
+        session->send_ptr += sent;
+        session->send_len -= (size_t)sent;
+        session_count_bytes(session, sent);
+        session_rate_charge(session, sent);
+    }
+}
+
+static void session_stor_failed(client_session_t *session) {
+    if (session->transfer_file) {
+        fclose(session->transfer_file);
+        session->transfer_file = NULL;
+    }
+    if (session->transfer_fd >= 0) {
+        close(session->transfer_fd);
+        session->transfer_fd = -1;
+    }
+    unlinkat(session->dir_fd, session->transfer_path, 0);
+    server_log_error("Error receiving file '%s' from %s:%d", session->transfer_path, session->client_ip, session->client_port);
+    session_finish_transfer(session, FTP_ACTION_FAILED, "Error receiving file or writing data");
+}
+
+// Regular files are filled socket -> pipe -> file without a user-space copy.
+static void session_pump_splice(client_session_t *session) {
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        size_t chunk = session_rate_grant(session, session->chunk);
+        if (chunk == 0) return;
+        ssize_t n = receive_file_chunk(session->data_fd, session->splice_pipe, session->transfer_fd, chunk);
+        if (n > 0) {
+            session_count_bytes(session, n);
+            session_rate_charge(session, n);
+            continue;
+        }
+        if (n == 0) {
+            session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+        } else if (n == -2 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // The pipe may still hold bytes from the failed step.
+            splice_pipe_close(session->splice_pipe);
+            session_stor_failed(session);
+        }
+        return;
+    }
+}
+
+static void session_pump_recv_z(client_session_t *session) {
+    session_zstate_t *z = session->z;
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        size_t chunk = session_rate_grant(session, session->xfer_size);
+        if (chunk == 0) return;
+        ssize_t n = recv(session->data_fd, session->xfer_buf, chunk, 0);
+        if (n == 0) {
+            if (z->stream.ended) {
+                session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+            } else {
+                session_stor_failed(session);
+            }
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            session_stor_failed(session);
+            return;
+        }
+        z->wire_bytes += n;
+        session_rate_charge(session, n);
+        size_t used = 0;
+        while (!z->stream.ended) {
+            size_t consumed = 0;
+            ssize_t produced = ftp_zstream_process(&z->stream, session->xfer_buf + used, (size_t)n - used, &consumed,
+                                                   z->out, sizeof(z->out), 0);
+            if (produced < 0 ||
+                fwrite(z->out, 1, (size_t)produced, session->transfer_file) != (size_t)produced) {
+                session_stor_failed(session);
+                return;
+            }
+            session_count_bytes(session, produced);
+            used += consumed;
+            if ((size_t)produced < sizeof(z->out) && used == (size_t)n) break;
+        }
+    }
+}
+
+static void session_pump_recv(client_session_t *session) {
+    if (session->z) {
+        session_pump_recv_z(session);
+        return;
+    }
+    if (session->transfer_fd >= 0) {
+        session_pump_splice(session);
+        return;
+    }
+    for (int burst = 0; burst < FTPD_TRANSFER_BURST; burst++) {
+        size_t chunk = session_rate_grant(session, session->xfer_size);
+        if (chunk == 0) return;
+        ssize_t n = recv(session->data_fd, session->xfer_buf, chunk, 0);
+        if (n > 0) {
+            session_rate_charge(session, n);
+            if (fwrite(session->xfer_buf, 1, (size_t)n, session->transfer_file) == (size_t)n) {
+                session_count_bytes(session, n);
+                continue;
+            }
+        } else if (n == 0) {
+            session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        session_stor_failed(session);
+        return;
+    }
+}
+
+// ---- io_uring transfers -------------------------------------------------
+
+static int loop_start_uring(ftp_loop_t *loop) {
+    loop->uring = ftp_uring_create(FTPD_URING_SLOTS * FTPD_URING_DEPTH, FTPD_URING_BUFFER, FTPD_URING_SLOTS * 2);
+    if (!loop->uring) {
+        loop->uring_failed = 1;
+        server_log_error("Cannot set up io_uring (%s), this loop keeps the epoll transfer path", strerror(errno));
+        return -1;
+    }
+    loop->uring_handle.kind = HANDLE_URING;
+    loop->uring_handle.session = NULL;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->uring_handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ftp_uring_fd(loop->uring), &ev) < 0) {
+        server_log_error("Cannot watch io_uring completions: %s", strerror(errno));
+        ftp_uring_destroy(loop->uring);
+        loop->uring = NULL;
+        loop->uring_failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_xfer_free(uring_xfer_t *xfer) {
+    ftp_loop_t *loop = xfer->loop;
+    // Dropping the fixed files releases the ring's references to them.
+    int fds[2] = { -1, -1 };
+    ftp_uring_set_files(loop->uring, (unsigned)xfer->slot * 2, fds, 2);
+    loop->uring_slots[xfer->slot] = NULL;
+    free(xfer);
+}
+
+// Called when the session closes its data connection. Operations still in
+// flight keep the transfer alive; shutting the socket down makes the ones
+// blocked on it complete right away.
+static void uring_xfer_detach(client_session_t *session) {
+    uring_xfer_t *xfer = session->uring;
+    session->uring = NULL;
+    xfer->session = NULL;
+    if (xfer->inflight == 0) {
+        uring_xfer_free(xfer);
+    } else if (session->data_fd >= 0) {
+        shutdown(session->data_fd, SHUT_RDWR);
+    }
+}
+
+static uint64_t uring_user_data(uring_xfer_t *xfer, unsigned index) {
+    return (uint64_t)(uintptr_t)xfer | index;
+}
+
+static unsigned uring_buffer(uring_xfer_t *xfer, unsigned index) {
+    return (unsigned)xfer->slot * FTPD_URING_DEPTH + index;
+}
+
+static void uring_queue_read(uring_xfer_t *xfer, unsigned index, unsigned file, size_t len, off_t offset) {
+    if (ftp_uring_read(xfer->loop->uring, (unsigned)xfer->slot * 2 + file, uring_buffer(xfer, index), 0,
+                       len, offset, uring_user_data(xfer, index)) < 0) {
+        xfer->failed = 1;
+        return;
+    }
+    xfer->bufs[index].state = URING_BUF_READING;
+    xfer->bufs[index].offset = offset;
+    xfer->inflight++;
+}
+
+// file is 0 for the file slot and 1 for the socket, which takes no offset.
+static void uring_queue_write(uring_xfer_t *xfer, unsigned index, unsigned file, size_t len) {
+    size_t done = xfer->bufs[index].done;
+    off_t offset = file == 0 ? xfer->bufs[index].offset + (off_t)done : 0;
+    if (ftp_uring_write(xfer->loop->uring, (unsigned)xfer->slot * 2 + file, uring_buffer(xfer, index), done,
+                        len, offset, uring_user_data(xfer, index)) < 0) {
+        xfer->failed = 1;
+        return;
+    }
+    xfer->bufs[index].state = URING_BUF_WRITING;
+    xfer->inflight++;
+}
+
+// RETR: keep every free buffer reading ahead and the socket writing the
+// oldest filled one. Reads past a short read are dropped unsent.
+static void uring_retr_queue(uring_xfer_t *xfer) {
+    while (!xfer->eof && !xfer->failed) {
+        unsigned index = xfer->next_fill % FTPD_URING_DEPTH;
+        if (xfer->bufs[index].state != URING_BUF_FREE) break;
+        uring_queue_read(xfer, index, 0, FTPD_URING_BUFFER, xfer->offset);
+        if (xfer->failed) break;
+        xfer->offset += FTPD_URING_BUFFER;
+        xfer->next_fill++;
+    }
+    while (!xfer->socket_busy && !xfer->failed && xfer->next_drain != xfer->next_fill) {
+        unsigned index = xfer->next_drain % FTPD_URING_DEPTH;
+        if (xfer->bufs[index].state != URING_BUF_FILLED) break;
+        if (xfer->bufs[index].len == 0 || (xfer->eof && xfer->bufs[index].offset >= xfer->eof_offset)) {
+            xfer->bufs[index].state = URING_BUF_FREE;
+            xfer->next_drain++;
+            continue;
+        }
+        size_t chunk = session_rate_grant(xfer->session, xfer->bufs[index].len - xfer->bufs[index].done);
+        if (chunk == 0) break;
+        uring_queue_write(xfer, index, 1, chunk);
+        xfer->socket_busy = !xfer->failed;
+    }
+}
+
+static void uring_retr_complete(uring_xfer_t *xfer, unsigned index, int res) {
+    if (xfer->bufs[index].state == URING_BUF_READING) {
+        if (res < 0) {
+            errno = -res;
+            xfer->failed = 1;
+            return;
+        }
+        xfer->bufs[index].state = URING_BUF_FILLED;
+        xfer->bufs[index].len = (size_t)res;
+        xfer->bufs[index].done = 0;
+        if (res < FTPD_URING_BUFFER) {
+            off_t end = xfer->bufs[index].offset + res;
+            if (!xfer->eof || end < xfer->eof_offset) xfer->eof_offset = end;
+            xfer->eof = 1;
+        }
+        return;
+    }
+    xfer->socket_busy = 0;
+    if (res <= 0) {
+        errno = res < 0 ? -res : EPIPE;
+        xfer->failed = 1;
+        return;
+    }
+    xfer->bufs[index].done += (size_t)res;
+    session_count_bytes(xfer->session, res);
+    session_rate_charge(xfer->session, res);
+    if (xfer->bufs[index].done < xfer->bufs[index].len) {
+        xfer->bufs[index].state = URING_BUF_FILLED;
+    } else {
+        xfer->bufs[index].state = URING_BUF_FREE;
+        xfer->next_drain++;
+    }
+}
+
+// STOR: one socket read at a time, each filled buffer written to the file
+// at the offset its bytes arrived at.
+static void uring_stor_queue(uring_xfer_t *xfer) {
+    for (unsigned index = 0; index < FTPD_URING_DEPTH && !xfer->failed; index++) {
+        if (xfer->bufs[index].state == URING_BUF_FILLED) {
+            uring_queue_write(xfer, index, 0, xfer->bufs[index].len - xfer->bufs[index].done);
+        }
+    }
+    for (unsigned index = 0; index < FTPD_URING_DEPTH && !xfer->socket_busy && !xfer->eof && !xfer->failed; index++) {
+        if (xfer->bufs[index].state == URING_BUF_FREE) {
+            size_t chunk = session_rate_grant(xfer->session, FTPD_URING_BUFFER);
+            if (chunk == 0) break;
+            uring_queue_read(xfer, index, 1, chunk, 0);
+            xfer->socket_busy = !xfer->failed;
+        }
+    }
+}
+
+static void uring_stor_complete(uring_xfer_t *xfer, unsigned index, int res) {
+    if (xfer->bufs[index].state == URING_BUF_READING) {
+        xfer->socket_busy = 0;
+        if (res < 0) {
+            errno = -res;
+            xfer->failed = 1;
+        } else if (res == 0) {
+            xfer->bufs[index].state = URING_BUF_FREE;
+            xfer->eof = 1;
+        } else {
+            session_rate_charge(xfer->session, res);
+            xfer->bufs[index].state = URING_BUF_FILLED;
+            xfer->bufs[index].offset = xfer->offset;
+            xfer->bufs[index].len = (size_t)res;
+            xfer->bufs[index].done = 0;
+            xfer->offset += res;
+        }
+        return;
+    }
+    if (res <= 0) {
+        errno = res < 0 ? -res : ENOSPC;
+        xfer->failed = 1;
+        return;
+    }
+    xfer->bufs[index].done += (size_t)res;
+    session_count_bytes(xfer->session, res);
+    xfer->bufs[index].state = xfer->bufs[index].done < xfer->bufs[index].len ? URING_BUF_FILLED : URING_BUF_FREE;
+}
+
+// Queues the next operations or finishes the transfer. The session may be
+// gone afterwards, so callers must not touch xfer again.
+static void uring_xfer_step(uring_xfer_t *xfer) {
+    client_session_t *session = xfer->session;
+    if (xfer->receiving) {
+        uring_stor_queue(xfer);
+    } else {
+        uring_retr_queue(xfer);
+    }
+    if (xfer->failed) {
+        if (xfer->receiving) {
+            session_stor_failed(session);
+        } else {
+            session_retr_failed(session);
+        }
+        return;
+    }
+    int done = xfer->receiving ? xfer->eof && xfer->inflight == 0
+                               : xfer->eof && xfer->inflight == 0 && xfer->next_drain == xfer->next_fill;
+    if (done) {
+        session_finish_transfer(session, FTP_SUCCESS, "Transfer complete");
+    }
+}
+
+static void uring_on_complete(uint64_t user_data, int res, void *ctx) {
+    (void)ctx;
+    uring_xfer_t *xfer = (uring_xfer_t *)(uintptr_t)(user_data & ~(uint64_t)(FTPD_URING_DEPTH - 1));
+    unsigned index = (unsigned)(user_data & (FTPD_URING_DEPTH - 1));
+    xfer->inflight--;
+    if (!xfer->session) {
+        if (xfer->inflight == 0) uring_xfer_free(xfer);
+        return;
+    }
+    if (xfer->receiving) {
+        uring_stor_complete(xfer, index, res);
+    } else {
+        uring_retr_complete(xfer, index, res);
+    }
+    uring_xfer_step(xfer);
+}
+
+static void loop_reap_uring(ftp_loop_t *loop) {
+    ftp_uring_reap(loop->uring, uring_on_complete, loop);
+    if (ftp_uring_submit(loop->uring) < 0) {
+        server_log_error("io_uring submit failed: %s", strerror(errno));
+    }
+}
+
+// Moves a plain RETR/STOR of a regular file onto the loop's io_uring.
+// Returns -1 to leave the transfer to the epoll path.
+static int session_start_uring(client_session_t *session) {
+    if (!__atomic_load_n(&io_uring_enabled, __ATOMIC_RELAXED) || session->z ||
+        session->transfer_fd < 0 || transfer_is_listing(session->transfer)) {
+        return -1;
+    }
+    ftp_loop_t *loop = session->loop;
+    if (!loop->uring && (loop->uring_failed || loop_start_uring(loop) < 0)) {
+        return -1;
+    }
+    int slot = 0;
+    while (slot < FTPD_URING_SLOTS && loop->uring_slots[slot]) slot++;
+    if (slot == FTPD_URING_SLOTS) {
+        return -1;
+    }
+    // malloc() alignment leaves the low bits free for the buffer index.
+    uring_xfer_t *xfer = calloc(1, sizeof(*xfer));
+    if (!xfer) {
+        return -1;
+    }
+    int fds[2] = { session->transfer_fd, session->data_fd };
+    if (ftp_uring_set_files(loop->uring, (unsigned)slot * 2, fds, 2) < 0) {
+        server_log_error("Cannot register transfer files with io_uring: %s", strerror(errno));
+        free(xfer);
+        return -1;
+    }
+    // On a non-blocking socket io_uring hands EAGAIN back instead of
+    // waiting for readiness itself.
+    int flags = fcntl(session->data_fd, F_GETFL);
+    if (flags >= 0) fcntl(session->data_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    xfer->session = session;
+    xfer->loop = loop;
+    xfer->slot = slot;
+    xfer->receiving = session->state == SESSION_RECEIVING;
+    xfer->offset = xfer->receiving ? 0 : session->transfer_offset;
+    loop->uring_slots[slot] = xfer;
+    session->uring = xfer;
+    uring_xfer_step(xfer);
+    if (ftp_uring_submit(loop->uring) < 0) {
+        server_log_error("io_uring submit failed: %s", strerror(errno));
+    }
+    return 0;
+}
+
+int ftpd_use_io_uring(int enable) {
+    if (enable && !ftp_uring_supported()) {
+        server_log_error("io_uring is not available on this kernel, keeping the epoll transfer path");
+        return -1;
+    }
+    __atomic_store_n(&io_uring_enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+    server_log_info("Data transfers use %s", enable ? "io_uring" : "epoll");
+    return 0;
+}
+
+// "auto", "lan", "wan" or "lowmem"; applies to connections set up afterwards.
+int ftpd_set_socket_profile(const char *profile) {
+    if (ftp_tune_set_profile(profile) < 0) {
+        server_log_error("Unknown socket tuning profile '%s'", profile);
+        return -1;
+    }
+    server_log_info("Socket tuning profile: %s", ftp_tune_profile_name());
+    return 0;
+}
+
+// Returns -1 if the file cannot be opened, -2 if the REST offset is unusable.
+static int session_open_retr(client_session_t *session) {
+    struct stat st;
+    if (fstatat(session->dir_fd, session->transfer_path, &st, 0) < 0) return -1;
+    if (S_ISREG(st.st_mode)) {
+        // Regular files share one descriptor per content across sessions.
+        file_cache_entry_t *entry = file_cache_acquire(session->dir_fd, session->transfer_path, &st);
+        if (!entry) return -1;
+        if (session->transfer_restart > entry->size) {
+            file_cache_release(entry);
+            return -2;
+        }
+        session->file_entry = entry;
+        session->transfer_fd = entry->fd;
+        session->transfer_offset = (off_t)session->transfer_restart;
+        return 0;
+    }
+    int fd = openat(session->dir_fd, session->transfer_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (session->transfer_restart > 0 && lseek(fd, (off_t)session->transfer_restart, SEEK_SET) < 0) {
+        close(fd);
+        return -2;
+    }
+    // FIFOs and devices keep using the buffered stdio path.
+    session->transfer_file = fdopen(fd, "rb");
+    if (!session->transfer_file) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int session_open_stor(client_session_t *session) {
+    int fd = openat(session->dir_fd, session->transfer_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    // Compressed uploads are inflated in user space, so splice() cannot help.
+    if (!session->mode_z && splice_target_ok(fd) &&
+        (session->splice_pipe[0] >= 0 || splice_pipe_open(session->splice_pipe) == 0)) {
+        session->transfer_fd = fd;
+        return 0;
+    }
+    session->transfer_file = fdopen(fd, "wb");
+    if (!session->transfer_file) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static int session_start_z(client_session_t *session) {
+    session_zstate_t *z = calloc(1, sizeof(*z));
+    if (!z) return -1;
+    int rc = (session->state == SESSION_RECEIVING) ? ftp_zstream_init_inflate(&z->stream)
+                                                    : ftp_zstream_init_deflate(&z->stream, session->z_level);
+    if (rc < 0) {
+        free(z);
+        return -1;
+    }
+    if (transfer_is_listing(session->transfer)) {
+        // The listing is already in memory; feed it as the raw input.
+        z->raw_ptr = session->send_ptr;
+        z->raw_len = session->send_len;
+        session->send_len = 0;
+    }
+    session->z = z;
+    return 0;
+}
+
+// Failure after the 150 reply: a STOR also drops its partial file.
+static void session_abort_start(client_session_t *session, const char *reason) {
+    if (session->state == SESSION_RECEIVING) {
+        session_stor_failed(session);
+    } else {
+        session_finish_transfer(session, FTP_ACTION_FAILED, reason);
+    }
+}
+
+static void session_start_transfer(client_session_t *session) {
+    ftp_metrics_data_connect(ftp_metrics_now_us() - session->data_wait_started_us);
+    session->chunk = ftp_tune_data_socket(session->data_fd, session->transfer != TRANSFER_STOR);
+    session->transfer_bytes = 0;
+    session->transfer_started = monotonic_ms();
+    if (transfer_is_listing(session->transfer)) {
+        session_reply(session, FTP_DATA_CONN_OPEN, "Opening ASCII mode data connection");
+        session_load_list(session);
+        session->state = SESSION_SENDING;
+    } else if (session->transfer == TRANSFER_RETR) {
+        int rc = session_open_retr(session);
+        if (rc == -2) {
+            server_log_error("Invalid restart offset %lld for RETR '%s' from %s:%d", session->transfer_restart, session->transfer_path, session->client_ip, session->client_port);
+            session_finish_transfer(session, FTP_FILE_NOT_FOUND, "Restart offset beyond end of file");
+            return;
+        }
+        if (rc < 0) {
+            server_log_error("File not found for RETR '%s' requested by %s:%d", session->transfer_path, session->client_ip, session->client_port);
+            session_finish_transfer(session, FTP_FILE_NOT_FOUND, "File not found");
+            return;
+        }
+        session_reply(session, FTP_DATA_CONN_OPEN, "Opening BINARY mode data connection");
+        session->state = SESSION_SENDING;
+    } else {
+        if (session_open_stor(session) < 0) {
+            // *** ĐÃ SỬA (Error) ***
+            // Đã sửa FTP_FILE_ACTION_FAILED thành FTP_ACTION_FAILED
+            server_log_error("Cannot create file '%s' for STOR from %s:%d: %s", session->transfer_path, session->client_ip, session->client_port, strerror(errno));
+            session_finish_transfer(session, FTP_ACTION_FAILED, "Cannot create file");
+            return;
+        }
+        session_reply(session, FTP_DATA_CONN_OPEN, "Opening BINARY mode data connection");
+        session->state = SESSION_RECEIVING;
+    }
+    if (session->closed) return;
+    // Starts listening for ABOR on the control connection.
+    session_update_interest(session);
+
+    // sendfile() and splice() move file data without it; listings have their own.
+    if (!transfer_is_listing(session->transfer) && (session->transfer_fd < 0 || session->mode_z)) {
+        session->xfer_buf = malloc(session->chunk);
+        if (!session->xfer_buf) {
+            server_log_error("Cannot allocate transfer buffer for %s:%d", session->client_ip, session->client_port);
+            session_abort_start(session, "Out of memory");
+            return;
+        }
+        session->xfer_size = session->chunk;
+    }
+
+    if (session->mode_z && session_start_z(session) < 0) {
+        server_log_error("Cannot start MODE Z stream for %s:%d", session->client_ip, session->client_port);
+        session_abort_start(session, "Cannot start compression");
+        return;
+    }
 
-static account_t accounts[32];
-static int account_count = 0;
-static bool accounts_loaded = false;
+    if (session_start_uring(session) == 0) {
+        return;
+    }
+    uint32_t events = (session->state == SESSION_SENDING) ? EPOLLOUT : EPOLLIN;
+    if (session_watch_data(session, events) < 0) {
+        server_log_error("Cannot watch data connection for %s:%d: %s", session->client_ip, session->client_port, strerror(errno));
+        session_finish_transfer(session, FTP_ACTION_FAILED, "Data connection failed");
+        return;
+    }
+    if (session->state == SESSION_SENDING) {
+        session_pump_send(session);
+    } else {
+        session_pump_recv(session);
+    }
+}
 
-static void add_default_accounts(void) {
-    account_count = 0;
-    snprintf(accounts[account_count].username, sizeof(accounts[account_count].username), "vu");
-    snprintf(accounts[account_count].password, sizeof(accounts[account_count].password), "vu");
-    account_count++;
-    snprintf(accounts[account_count].username, sizeof(accounts[account_count].username), "vuong");
-    snprintf(accounts[account_count].password, sizeof(accounts[account_count].password), "vuong");
-    account_count++;
+static void session_data_failed(client_session_t *session) {
+    server_log_error("%s data connection failed for %s:%d", transfer_name(session->transfer), session->client_ip, session->client_port);
+    session_finish_transfer(session, FTP_ACTION_FAILED, "Data connection failed");
 }
 
-static void load_accounts(const char *path) {
-    accounts_loaded = true;
-    account_count = 0;
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        add_default_accounts();
-        return;
+// Returns 0 while the client has not connected yet.
+static int session_accept_data(client_session_t *session) {
+    int fd = accept4(session->pasv_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
     }
-    char line[256];
-    while (fgets(line, sizeof(line), f) && account_count < (int)(sizeof(accounts) / sizeof(accounts[0]))) {
-        char user[64], pass[64];
-        if (line[0] == '#' || strlen(line) < 3) continue;
-        if (sscanf(line, "%63s %63s", user, pass) == 2) {
-            snprintf(accounts[account_count].username, sizeof(accounts[account_count].username), "%s", user);
-            snprintf(accounts[account_count].password, sizeof(accounts[account_count].password), "%s", pass);
-            account_count++;
+    close(session->pasv_listen_fd);
+    session->pasv_listen_fd = -1;
+    if (fd < 0) {
+        session_data_failed(session);
+        return 1;
+    }
+    session->data_fd = fd;
+    session_start_transfer(session);
+    return 1;
+}
+
+static void session_begin_transfer(client_session_t *session, transfer_kind_t kind, const char *path) {
+    session->transfer = kind;
+    if (kind != TRANSFER_RETR) {
+        session->transfer_restart = 0;
+    }
+    snprintf(session->transfer_path, sizeof(session->transfer_path), "%s", path);
+    session->data_wait_started_us = ftp_metrics_now_us();
+    if (session->pasv_port) {
+        // The client usually connects right after the 227 reply, so the
+        // connection is often parked already.
+        session->state = SESSION_DATA_WAIT;
+        session->pasv_deadline = monotonic_ms() + FTPD_PASV_TIMEOUT_MS;
+        session_update_interest(session);
+        int fd = session_take_pool_fd(session);
+        if (fd >= 0) {
+            session->data_fd = fd;
+            session_start_transfer(session);
         }
+        return;
+    }
+    if (session->pasv_listen_fd < 0) {
+        session_data_failed(session);
+        return;
+    }
+    session->state = SESSION_DATA_WAIT;
+    session->pasv_deadline = monotonic_ms() + FTPD_PASV_TIMEOUT_MS;
+    session_update_interest(session);
+    if (session_accept_data(session)) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &session->pasv_handle;
+    if (epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_ADD, session->pasv_listen_fd, &ev) < 0) {
+        close(session->pasv_listen_fd);
+        session->pasv_listen_fd = -1;
+        session_data_failed(session);
     }
-    fclose(f);
-    if (account_count == 0) {
-        add_default_accounts();
+}
+
+// Fallback when no PASV range is configured or the pool has no free port:
+// a private listener on an ephemeral port.
+static int session_listen_ephemeral(client_session_t *session) {
+    session->pasv_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    if (bind(session->pasv_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return -1;
     }
+    listen(session->pasv_listen_fd, 1);
+    struct sockaddr_in local_addr;
+    socklen_t len = sizeof(local_addr);
+    getsockname(session->pasv_listen_fd, (struct sockaddr *)&local_addr, &len);
+    return ntohs(local_addr.sin_port);
 }
 
-static bool validate_credentials(const char *user, const char *pass) {
-    if (!accounts_loaded) {
-        load_accounts("accounts.txt");
+static void session_enter_passive(client_session_t *session) {
+    if (session->pasv_listen_fd >= 0) {
+        close(session->pasv_listen_fd);
+        session->pasv_listen_fd = -1;
     }
-    for (int i = 0; i < account_count; i++) {
-        if (strcmp(accounts[i].username, user) == 0 &&
-            strcmp(accounts[i].password, pass) == 0) {
-            return true;
+    int pasv_port = pasv_pool_lease(session);
+    if (pasv_port < 0) {
+        pasv_port = session_listen_ephemeral(session);
+    }
+    if (pasv_port < 0) {
+        server_log_error("Failed to enter passive mode: %s", strerror(errno));
+        session_reply(session, FTP_ACTION_FAILED, "Cannot enter passive mode");
+        return;
+    }
+
+    struct sockaddr_in ctrl_local;
+    socklen_t ctrl_len = sizeof(ctrl_local);
+    if (getsockname(session->control_fd, (struct sockaddr *)&ctrl_local, &ctrl_len) == 0) {
+        if (!inet_ntop(AF_INET, &ctrl_local.sin_addr, session->server_ip, sizeof(session->server_ip))) {
+            strncpy(session->server_ip, "127.0.0.1", sizeof(session->server_ip) - 1);
+            session->server_ip[sizeof(session->server_ip) - 1] = '\0';
         }
     }
-    return false;
+
+    struct in_addr ip_addr;
+    if (inet_pton(AF_INET, session->server_ip, &ip_addr) <= 0) {
+        inet_pton(AF_INET, "127.0.0.1", &ip_addr);
+    }
+    unsigned char *ip_bytes = (unsigned char *)&ip_addr.s_addr;
+    char pasv_response[FTP_MAX_LINE];
+    snprintf(pasv_response, sizeof(pasv_response),
+            "Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
+            ip_bytes[0], ip_bytes[1], ip_bytes[2], ip_bytes[3],
+            pasv_port / 256, pasv_port % 256);
+    session_reply(session, FTP_PASV_MODE, pasv_response);
+    server_log_info("PASV announced %d.%d.%d.%d:%d to %s:%d",
+                    ip_bytes[0], ip_bytes[1], ip_bytes[2], ip_bytes[3],
+                    pasv_port, session->client_ip, session->client_port);
+}
+
+// CWD only swaps this session's directory descriptor; the process-wide
+// working directory is never touched, so sessions cannot see each other's.
+static int session_change_dir(client_session_t *session, const char *path) {
+    int fd = openat(session->dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    close(session->dir_fd);
+    session->dir_fd = fd;
+
+    char link[64];
+    char resolved[FTP_MAX_PATH];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, resolved, sizeof(resolved) - 1);
+    if (n > 0) {
+        resolved[n] = '\0';
+        snprintf(session->current_dir, sizeof(session->current_dir), "%s", resolved);
+    } else if (path[0] == '/') {
+        snprintf(session->current_dir, sizeof(session->current_dir), "%s", path);
+    } else {
+        size_t len = strlen(session->current_dir);
+        snprintf(session->current_dir + len, sizeof(session->current_dir) - len, "/%s", path);
+    }
+    return 0;
 }
 
-static void server_log(const char *level, const char *fmt, va_list args) {
-    fprintf(stderr, "[SERVER %s] ", level);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+static int require_login(client_session_t *session, const char *command) {
+    if (session->authenticated) return 1;
+    server_log_error("%s denied for unauthenticated client %s:%d", command, session->client_ip, session->client_port);
+    session_reply(session, FTP_LOGIN_FAILED, "Not logged in");
+    return 0;
 }
 
-static void server_log_info(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    server_log("INFO", fmt, args);
-    va_end(args);
+static void session_reply_stats(client_session_t *session) {
+    char response[FTP_BUFFER_SIZE];
+    int len = snprintf(response, sizeof(response), "%d-Server statistics\r\n", FTP_SYSTEM_STATUS);
+    size_t end_room = 16;
+    len += (int)ftp_metrics_report(response + len, sizeof(response) - len - end_room);
+    len += snprintf(response + len, sizeof(response) - len, "%d End\r\n", FTP_SYSTEM_STATUS);
+    session_reply_raw(session, response, (size_t)len);
 }
 
-static void server_log_error(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    server_log("ERROR", fmt, args);
-    va_end(args);
+// Clients may put the Telnet IP and Synch bytes in front of ABOR.
+static const char *skip_telnet_bytes(const char *line) {
+    while ((unsigned char)*line >= 0x80) line++;
+    return line;
 }
 
-void *handle_client(void *arg) {
-    client_session_t *session = (client_session_t *)arg;
-    int control_fd = session->control_fd;
-    char buffer[FTP_MAX_LINE];
-    char command[FTP_MAX_LINE];
-    char cmd_arg[FTP_MAX_LINE];
-    int authenticated = 0;
-    int data_fd = -1;
-    int pasv_listen_fd = -1;
-    int pasv_port = 0;
-    session->rename_from[0] = '\0';
-    session->username[0] = '\0';
-    
-    getcwd(session->current_dir, sizeof(session->current_dir));
-    
-    server_log_info("Session started with %s:%d", session->client_ip, session->client_port);
-    send_ftp_response(control_fd, FTP_READY, "FTP Server Ready");
-    
-    while (1) {
-        if (read_ftp_command(control_fd, buffer, sizeof(buffer)) <= 0) {
-            server_log_info("Connection closed or read error for %s:%d", session->client_ip, session->client_port);
-            break;
+static void session_handle_command(client_session_t *session, const char *buffer) {
+    char command[FTP_MAX_LINE] = "";
+    char cmd_arg[FTP_MAX_LINE] = "";
+
+    // Parse command
+    sscanf(skip_telnet_bytes(buffer), "%s %[^\r\n]", command, cmd_arg);
+    session->command_verb = ftp_metrics_verb(command);
+    session->command_started_us = ftp_metrics_now_us();
+
+    // REST only applies to the command right after it.
+    long long restart = session->restart_offset;
+    session->restart_offset = 0;
+
+    if (strcasecmp(command, "USER") == 0) {
+        snprintf(session->username, sizeof(session->username), "%s", cmd_arg);
+        session->authenticated = 0;
+        session->user_rate = NULL;
+        session_reply(session, FTP_NEED_PASSWORD, "Password required");
+    }
+    else if (strcasecmp(command, "PASS") == 0) {
+        if (strlen(session->username) == 0) {
+            session_reply(session, FTP_LOGIN_FAILED, "Username required");
+            return;
         }
-        
-        // Parse command
-        sscanf(buffer, "%s %[^\r\n]", command, cmd_arg);
-        
-        if (strcasecmp(command, "USER") == 0) {
-            snprintf(session->username, sizeof(session->username), "%s", cmd_arg);
-            authenticated = 0;
-            send_ftp_response(control_fd, FTP_NEED_PASSWORD, "Password required");
-        }
-        else if (strcasecmp(command, "PASS") == 0) {
-            if (strlen(session->username) == 0) {
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Username required");
-                continue;
-            }
-            if (validate_credentials(session->username, cmd_arg)) {
-                authenticated = 1;
-                send_ftp_response(control_fd, FTP_LOGIN_SUCCESS, "Login successful");
-            } else {
-                authenticated = 0;
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Login failed");
+        long long user_limit = 0;
+        if (validate_credentials(session->username, cmd_arg, &user_limit)) {
+            session->authenticated = 1;
+            session->user_rate = user_rate_get(session->username, 1);
+            if (session->user_rate && !session->user_rate->pinned &&
+                ftp_bucket_rate(&session->user_rate->bucket) != user_limit) {
+                ftp_bucket_set_rate(&session->user_rate->bucket, user_limit);
             }
+            session_reply(session, FTP_LOGIN_SUCCESS, "Login successful");
+        } else {
+            session->authenticated = 0;
+            session->user_rate = NULL;
+            session_reply(session, FTP_LOGIN_FAILED, "Login failed");
+        }
+    }
+    else if (strcasecmp(command, "PWD") == 0) {
+        char response[FTP_MAX_LINE];
+
+        // *** ĐÃ SỬA (Warning) ***
+        // Truncate an toàn, trừ 5 byte cho ("" và \0)
+        snprintf(response, sizeof(response), "\"%.*s\"", (int)sizeof(response) - 5, session->current_dir);
+
+        session_reply(session, FTP_PATHNAME_CREATED, response);
+    }
+    else if (strcasecmp(command, "CWD") == 0) {
+        if (session_change_dir(session, cmd_arg) == 0) {
+            session_reply(session, FTP_FILE_ACTION_OK, "Directory changed");
+        } else {
+            server_log_error("Failed to change directory to '%s' for %s:%d", cmd_arg, session->client_ip, session->client_port);
+            session_reply(session, FTP_FILE_NOT_FOUND, "Directory not found");
+        }
+    }
+    else if (strcasecmp(command, "PASV") == 0) {
+        session_enter_passive(session);
+    }
+    else if (strcasecmp(command, "LIST") == 0) {
+        if (!require_login(session, "LIST")) return;
+        session_begin_transfer(session, TRANSFER_LIST, ".");
+    }
+    else if (strcasecmp(command, "MLSD") == 0) {
+        if (!require_login(session, "MLSD")) return;
+        session_begin_transfer(session, TRANSFER_MLSD, ".");
+    }
+    else if (strcasecmp(command, "NLST") == 0) {
+        if (!require_login(session, "NLST")) return;
+        session_begin_transfer(session, TRANSFER_NLST, ".");
+    }
+    else if (strcasecmp(command, "MLST") == 0) {
+        if (!require_login(session, "MLST")) return;
+        const char *target = cmd_arg[0] ? cmd_arg : ".";
+        struct stat st;
+        if (fstatat(session->dir_fd, target, &st, 0) < 0) {
+            session_reply(session, FTP_FILE_NOT_FOUND, "No such file or directory");
+            return;
+        }
+        char facts[96];
+        char response[FTP_MAX_LINE * 2];
+        format_mlsx_facts(facts, sizeof(facts), S_ISDIR(st.st_mode) ? "dir" : "file", (long long)st.st_size, st.st_mtime);
+        int len = snprintf(response, sizeof(response), "%d-Listing %s\r\n %s %s\r\n%d End\r\n",
+                           FTP_FILE_ACTION_OK, target, facts, target, FTP_FILE_ACTION_OK);
+        if (len > 0 && (size_t)len < sizeof(response)) {
+            session_reply_raw(session, response, (size_t)len);
+        } else {
+            session_reply(session, 501, "Path too long");
+        }
+    }
+    else if (strcasecmp(command, "DELE") == 0) {
+        if (!require_login(session, "DELE")) return;
+        file_cache_forget(session->dir_fd, cmd_arg);
+        if (unlinkat(session->dir_fd, cmd_arg, 0) == 0) {
+            session_reply(session, FTP_FILE_ACTION_OK, "File deleted");
+        } else {
+            server_log_error("Failed to delete '%s': %s", cmd_arg, strerror(errno));
+            session_reply(session, FTP_ACTION_FAILED, "Delete failed");
+        }
+    }
+    else if (strcasecmp(command, "RNFR") == 0) {
+        if (!require_login(session, "RNFR")) return;
+        snprintf(session->rename_from, sizeof(session->rename_from), "%s", cmd_arg);
+        session_reply(session, FTP_PENDING_MORE_INFO, "Ready for destination name");
+    }
+    else if (strcasecmp(command, "RNTO") == 0) {
+        if (!require_login(session, "RNTO")) return;
+        if (session->rename_from[0] == '\0') {
+            session_reply(session, FTP_ACTION_FAILED, "No source specified");
+            return;
+        }
+        file_cache_forget(session->dir_fd, cmd_arg);
+        if (renameat(session->dir_fd, session->rename_from, session->dir_fd, cmd_arg) == 0) {
+            session_reply(session, FTP_FILE_ACTION_OK, "Renamed");
+        } else {
+            server_log_error("Failed to rename '%s' -> '%s': %s", session->rename_from, cmd_arg, strerror(errno));
+            session_reply(session, FTP_ACTION_FAILED, "Rename failed");
+        }
+        session->rename_from[0] = '\0';
+    }
+    else if (strcasecmp(command, "REST") == 0) {
+        if (!require_login(session, "REST")) return;
+        char *end = NULL;
+        errno = 0;
+        long long offset = strtoll(cmd_arg, &end, 10);
+        if (cmd_arg[0] == '\0' || *end != '\0' || errno != 0 || offset < 0) {
+            session_reply(session, 501, "Invalid restart offset");
+            return;
+        }
+        session->restart_offset = offset;
+        char response[FTP_MAX_LINE];
+        snprintf(response, sizeof(response), "Restarting at %lld. Send RETR to resume", offset);
+        session_reply(session, FTP_PENDING_MORE_INFO, response);
+    }
+    else if (strcasecmp(command, "MODE") == 0) {
+        if (strcasecmp(cmd_arg, "Z") == 0) {
+            session->mode_z = 1;
+            session_reply(session, FTP_COMMAND_OK, "MODE Z ok");
+        } else if (strcasecmp(cmd_arg, "S") == 0) {
+            session->mode_z = 0;
+            session_reply(session, FTP_COMMAND_OK, "MODE S ok");
+        } else {
+            session_reply(session, 504, "Unsupported transfer mode");
+        }
+    }
+    else if (strcasecmp(command, "OPTS") == 0) {
+        int level = 0;
+        if (strncasecmp(cmd_arg, "MODE Z LEVEL ", 13) == 0 &&
+            sscanf(cmd_arg + 13, "%d", &level) == 1 && level >= 0 && level <= 9) {
+            session->z_level = level;
+            session_reply(session, FTP_COMMAND_OK, "MODE Z LEVEL set");
+        } else {
+            session_reply(session, 501, "Unsupported option");
         }
-        else if (strcasecmp(command, "PWD") == 0) {
+    }
+    else if (strcasecmp(command, "SIZE") == 0) {
+        if (!require_login(session, "SIZE")) return;
+        struct stat st;
+        if (fstatat(session->dir_fd, cmd_arg, &st, 0) == 0 && S_ISREG(st.st_mode)) {
             char response[FTP_MAX_LINE];
-            
-            // *** ĐÃ SỬA (Warning) ***
-            // Truncate an toàn, trừ 5 byte cho ("" và \0)
-            snprintf(response, sizeof(response), "\"%.*s\"", (int)sizeof(response) - 5, session->current_dir);
-            
-            send_ftp_response(control_fd, FTP_PATHNAME_CREATED, response);
-        }
-        else if (strcasecmp(command, "CWD") == 0) {
-            if (chdir(cmd_arg) == 0) {
-                getcwd(session->current_dir, sizeof(session->current_dir));
-                send_ftp_response(control_fd, FTP_FILE_ACTION_OK, "Directory changed");
-            } else {
-                server_log_error("Failed to change directory to '%s' for %s:%d", cmd_arg, session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_FILE_NOT_FOUND, "Directory not found");
-            }
+            snprintf(response, sizeof(response), "%lld", (long long)st.st_size);
+            session_reply(session, FTP_FILE_STATUS, response);
+        } else {
+            session_reply(session, FTP_FILE_NOT_FOUND, "File not found");
         }
-        else if (strcasecmp(command, "PASV") == 0) {
-            // ... (Không thay đổi)
-            if (pasv_listen_fd >= 0) {
-                close(pasv_listen_fd);
-            }
-            pasv_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in addr;
-            memset(&addr, 0, sizeof(addr));
-            addr.sin_family = AF_INET;
-            addr.sin_addr.s_addr = INADDR_ANY;
-            addr.sin_port = 0;
-            if (bind(pasv_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-                server_log_error("Failed to enter passive mode: %s", strerror(errno));
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Cannot enter passive mode");
-                continue;
-            }
-            listen(pasv_listen_fd, 1);
-            struct sockaddr_in local_addr;
-            socklen_t len = sizeof(local_addr);
-            getsockname(pasv_listen_fd, (struct sockaddr *)&local_addr, &len);
-            pasv_port = ntohs(local_addr.sin_port);
-
-            struct sockaddr_in ctrl_local;
-            socklen_t ctrl_len = sizeof(ctrl_local);
-            if (getsockname(control_fd, (struct sockaddr *)&ctrl_local, &ctrl_len) == 0) {
-                if (!inet_ntop(AF_INET, &ctrl_local.sin_addr, session->server_ip, sizeof(session->server_ip))) {
-                    strncpy(session->server_ip, "127.0.0.1", sizeof(session->server_ip) - 1);
-                    session->server_ip[sizeof(session->server_ip) - 1] = '\0';
-                }
-            }
+    }
+    else if (strcasecmp(command, "RETR") == 0) {
+        if (!require_login(session, "RETR")) return;
+        session->transfer_restart = restart;
+        session_begin_transfer(session, TRANSFER_RETR, cmd_arg);
+    }
+    else if (strcasecmp(command, "STOR") == 0) {
+        if (!require_login(session, "STOR")) return;
+        session_begin_transfer(session, TRANSFER_STOR, cmd_arg);
+    }
+    else if (strcasecmp(command, "SITE") == 0) {
+        if (!require_login(session, "SITE")) return;
+        if (strcasecmp(cmd_arg, "STATS") == 0) {
+            session_reply_stats(session);
+        } else {
+            session_reply(session, 504, "Unsupported SITE command");
+        }
+    }
+    else if (strcasecmp(command, "ABOR") == 0) {
+        // A running transfer was already closed with 426 before we got here.
+        session_reply(session, FTP_SUCCESS, "ABOR successful");
+    }
+    else if (strcasecmp(command, "NOOP") == 0) {
+        session_reply(session, FTP_COMMAND_OK, "NOOP ok");
+    }
+    else if (strcasecmp(command, "QUIT") == 0) {
+        session_reply(session, FTP_GOODBYE, "Goodbye");
+        session_close(session);
+    }
+    else {
+        // Mặc định là '502 Command not implemented' thay vì '200'
+        server_log_error("Unsupported command '%s' from %s:%d", command, session->client_ip, session->client_port);
+        session_reply(session, 502, "Command not implemented");
+    }
+}
 
-            struct in_addr ip_addr;
-            if (inet_pton(AF_INET, session->server_ip, &ip_addr) <= 0) {
-                inet_pton(AF_INET, "127.0.0.1", &ip_addr);
-            }
-            unsigned char *ip_bytes = (unsigned char *)&ip_addr.s_addr;
-            char pasv_response[FTP_MAX_LINE];
-            snprintf(pasv_response, sizeof(pasv_response),
-                    "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
-                    ip_bytes[0], ip_bytes[1], ip_bytes[2], ip_bytes[3],
-                    pasv_port / 256, pasv_port % 256);
-            send(control_fd, pasv_response, strlen(pasv_response), 0);
-            send(control_fd, "\r\n", 2, 0);
-            server_log_info("PASV announced %d.%d.%d.%d:%d to %s:%d",
-                            ip_bytes[0], ip_bytes[1], ip_bytes[2], ip_bytes[3],
-                            pasv_port, session->client_ip, session->client_port);
-        }
-        else if (strcasecmp(command, "LIST") == 0) {
-            // ... (Không thay đổi)
-            if (!authenticated) {
-                server_log_error("LIST denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
-                continue;
-            }
-            if (pasv_listen_fd >= 0) {
-                fd_set read_fds;
-                struct timeval timeout;
-                FD_ZERO(&read_fds);
-                FD_SET(pasv_listen_fd, &read_fds);
-                timeout.tv_sec = 5;
-                timeout.tv_usec = 0;
-                if (select(pasv_listen_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-                    data_fd = accept(pasv_listen_fd, NULL, NULL);
-                } else {
-                    data_fd = -1;
-                }
-                close(pasv_listen_fd);
-                pasv_listen_fd = -1;
-            }
-            if (data_fd < 0) {
-                server_log_error("LIST data connection failed for %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Data connection failed");
-                continue;
-            }
-            send_ftp_response(control_fd, FTP_DATA_CONN_OPEN, "Opening ASCII mode data connection");
-            DIR *dir = opendir(".");
-            if (dir) {
-                struct dirent *entry;
-                char list_buffer[FTP_MAX_LINE];
-                while ((entry = readdir(dir)) != NULL) {
-                    struct stat st;
-                    if (stat(entry->d_name, &st) == 0) {
-                        if (S_ISDIR(st.st_mode)) {
-                            // *** ĐÃ SỬA (Warning) ***
-                            // Trừ 50 byte cho phần text cứng, truncate tên file an toàn
-                            snprintf(list_buffer, sizeof(list_buffer), "drwxr-xr-x 1 user user %ld %.*s\r\n",
-                                    st.st_size, (int)sizeof(list_buffer) - 50, entry->d_name);
-                        } else {
-                            // *** ĐÃ SỬA (Warning) ***
-                            snprintf(list_buffer, sizeof(list_buffer), "-rw-r--r-- 1 user user %ld %.*s\r\n",
-                                    st.st_size, (int)sizeof(list_buffer) - 50, entry->d_name);
-                        }
-                        send(data_fd, list_buffer, strlen(list_buffer), 0);
-                    }
-                }
-                closedir(dir);
-            }
-            close(data_fd);
-            data_fd = -1;
-            send_ftp_response(control_fd, FTP_SUCCESS, "Transfer complete");
-        }
-        else if (strcasecmp(command, "DELE") == 0) {
-            if (!authenticated) {
-                server_log_error("DELE denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
-                continue;
-            }
-            if (unlink(cmd_arg) == 0) {
-                send_ftp_response(control_fd, FTP_FILE_ACTION_OK, "File deleted");
-            } else {
-                server_log_error("Failed to delete '%s': %s", cmd_arg, strerror(errno));
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Delete failed");
-            }
+// Runs the complete commands already buffered, one after another, for as
+// long as the session can take a new one: idle and with no reply backlog.
+static void session_process_commands(client_session_t *session) {
+    if (session->dispatching) return;
+    session->dispatching = 1;
+    char line[FTP_MAX_LINE];
+    while (!session->closed && session->state == SESSION_IDLE && session->reply_len == 0 &&
+           line_reader_next(&session->reader, line, sizeof(line))) {
+        session_handle_command(session, line);
+        if (session->state == SESSION_IDLE) {
+            session_command_done(session);
         }
-        else if (strcasecmp(command, "RNFR") == 0) {
-            if (!authenticated) {
-                server_log_error("RNFR denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
-                continue;
-            }
-            snprintf(session->rename_from, sizeof(session->rename_from), "%s", cmd_arg);
-            send_ftp_response(control_fd, 350, "Ready for destination name");
+    }
+    session->dispatching = 0;
+}
+
+// Ends the running transfer with 426 if the buffered command is ABOR, which
+// then runs as an ordinary command and gets its own 226.
+static void session_check_abort(client_session_t *session) {
+    char line[FTP_MAX_LINE];
+    if (!line_reader_peek(&session->reader, line, sizeof(line))) return;
+    const char *command = skip_telnet_bytes(line);
+    if (strncasecmp(command, "ABOR", 4) != 0 || (command[4] != '\0' && command[4] != ' ')) {
+        session_update_interest(session);
+        return;
+    }
+    // A transfer cut short by the client is neither an error nor a sample
+    // of how long the command takes.
+    session->command_verb = -1;
+    session_finish_transfer(session, FTP_TRANSFER_ABORTED, "Transfer aborted");
+}
+
+static void session_on_control(client_session_t *session, uint32_t events) {
+    if (events & EPOLLOUT) {
+        session_flush_replies(session);
+        session_process_commands(session);
+    }
+    if (session->closed || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    int transferring = session->reply_len == 0 && session_awaits_abort(session);
+    if ((session->state != SESSION_IDLE || session->reply_len > 0) && !transferring) {
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            server_log_info("Connection closed or read error for %s:%d", session->client_ip, session->client_port);
+            session_close(session);
         }
-        else if (strcasecmp(command, "RNTO") == 0) {
-            if (!authenticated) {
-                server_log_error("RNTO denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
-                continue;
-            }
-            if (session->rename_from[0] == '\0') {
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "No source specified");
-                continue;
-            }
-            if (rename(session->rename_from, cmd_arg) == 0) {
-                send_ftp_response(control_fd, FTP_FILE_ACTION_OK, "Renamed");
-            } else {
-                server_log_error("Failed to rename '%s' -> '%s': %s", session->rename_from, cmd_arg, strerror(errno));
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Rename failed");
-            }
-            session->rename_from[0] = '\0';
+        return;
+    }
+
+    ssize_t n = line_reader_fill(&session->reader, session->control_fd);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        server_log_info("Connection closed or read error for %s:%d", session->client_ip, session->client_port);
+        session_close(session);
+        return;
+    }
+    if (transferring) {
+        session_check_abort(session);
+    } else {
+        session_process_commands(session);
+    }
+}
+
+static void session_on_pasv(client_session_t *session) {
+    if (session->state == SESSION_DATA_WAIT && session->pasv_listen_fd >= 0) {
+        session_accept_data(session);
+    }
+}
+
+static void session_on_data(client_session_t *session) {
+    // Stale events for a data socket closed earlier in this batch are harmless:
+    // the pump functions only act on the transfer that is currently running.
+    if (session->data_fd < 0) return;
+    if (session->state == SESSION_SENDING) {
+        session_pump_send(session);
+    } else if (session->state == SESSION_RECEIVING) {
+        session_pump_recv(session);
+    }
+}
+
+static void loop_adopt_incoming(ftp_loop_t *loop) {
+    uint64_t ticks;
+    while (read(loop->wake_fd, &ticks, sizeof(ticks)) > 0) {
+    }
+    pthread_mutex_lock(&loop->lock);
+    client_session_t *incoming = loop->incoming;
+    loop->incoming = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (incoming) {
+        client_session_t *session = incoming;
+        incoming = session->next;
+        session->next = loop->sessions;
+        loop->sessions = session;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &session->control_handle;
+        session->control_events = EPOLLIN;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, session->control_fd, &ev) < 0) {
+            server_log_error("Cannot watch control connection for %s:%d: %s", session->client_ip, session->client_port, strerror(errno));
+            session_close(session);
+            continue;
         }
-        else if (strcasecmp(command, "RETR") == 0) {
-            if (!authenticated) {
-                server_log_error("RETR denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
-                continue;
-            }
-            
-            // Accept data connection
-            if (pasv_listen_fd >= 0) {
-                // ... (logic accept data_fd không đổi)
-                fd_set read_fds;
-                struct timeval timeout;
-                FD_ZERO(&read_fds);
-                FD_SET(pasv_listen_fd, &read_fds);
-                timeout.tv_sec = 5;
-                timeout.tv_usec = 0;
-                if (select(pasv_listen_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-                    data_fd = accept(pasv_listen_fd, NULL, NULL);
-                } else {
-                    data_fd = -1;
-                }
-                close(pasv_listen_fd);
-                pasv_listen_fd = -1;
-            }
-            
-            if (data_fd < 0) {
-                server_log_error("RETR data connection failed for %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Data connection failed");
-                continue;
+        server_log_info("Session started with %s:%d", session->client_ip, session->client_port);
+        session_reply(session, FTP_READY, "FTP Server Ready");
+    }
+}
+
+// Hands parked pool connections to sessions already waiting for them;
+// the others pick theirs up when the transfer command arrives.
+static void loop_claim_pasv(ftp_loop_t *loop) {
+    pthread_mutex_lock(&pasv_pool.lock);
+    client_session_t *ready = loop->pasv_ready;
+    loop->pasv_ready = NULL;
+    for (client_session_t *session = ready; session; session = session->ready_next) {
+        session->pasv_ready = 0;
+    }
+    pthread_mutex_unlock(&pasv_pool.lock);
+
+    while (ready) {
+        client_session_t *session = ready;
+        ready = session->ready_next;
+        session->ready_next = NULL;
+        if (session->closed || session->state != SESSION_DATA_WAIT) continue;
+        int fd = session_take_pool_fd(session);
+        if (fd >= 0) {
+            session->data_fd = fd;
+            session_start_transfer(session);
+        }
+    }
+}
+
+static void loop_expire_data_waits(ftp_loop_t *loop) {
+    long long now = monotonic_ms();
+    for (client_session_t *session = loop->sessions; session; ) {
+        client_session_t *next = session->next;
+        if (session->state == SESSION_DATA_WAIT && now >= session->pasv_deadline) {
+            if (session->pasv_listen_fd >= 0) {
+                close(session->pasv_listen_fd);
+                session->pasv_listen_fd = -1;
             }
-            
-            FILE *file = fopen(cmd_arg, "rb");
-            if (file) {
-                send_ftp_response(control_fd, FTP_DATA_CONN_OPEN, "Opening BINARY mode data connection");
-                
-                // Lời gọi này giờ đã khớp với header (không còn warning)
-                if (send_file_over_socket(data_fd, file) < 0) {
-                    server_log_error("Error sending file '%s' to %s:%d", cmd_arg, session->client_ip, session->client_port);
-                    send_ftp_response(control_fd, FTP_ACTION_FAILED, "Error reading file or sending data");
-                } else {
-                    send_ftp_response(control_fd, FTP_SUCCESS, "Transfer complete");
-                }
-                
-                fclose(file); 
-                close(data_fd);
-                data_fd = -1;
-            } else {
-                close(data_fd);
-                data_fd = -1;
-                server_log_error("File not found for RETR '%s' requested by %s:%d", cmd_arg, session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_FILE_NOT_FOUND, "File not found");
+            pasv_pool_release(session);
+            ftp_metrics_pasv_timeout();
+            session_data_failed(session);
+        }
+        session = next;
+    }
+}
+
+static void session_resume(client_session_t *session) {
+    session->throttle_until = 0;
+    if (session->uring) {
+        uring_xfer_step(session->uring);
+        if (ftp_uring_submit(session->loop->uring) < 0) {
+            server_log_error("io_uring submit failed: %s", strerror(errno));
+        }
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = (session->state == SESSION_SENDING) ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = &session->data_handle;
+    if (epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_MOD, session->data_fd, &ev) < 0) {
+        session_data_failed(session);
+        return;
+    }
+    session_on_data(session);
+}
+
+static void loop_resume_throttled(ftp_loop_t *loop) {
+    long long now = monotonic_ms();
+    if (loop->throttle_deadline == 0 || now < loop->throttle_deadline) return;
+    // Sessions that throttle again while resuming set a fresh deadline.
+    loop->throttle_deadline = 0;
+    for (client_session_t *session = loop->sessions; session; ) {
+        client_session_t *next = session->next;
+        if (session->throttle_until > 0) {
+            if (now >= session->throttle_until) {
+                session_resume(session);
+            } else if (loop->throttle_deadline == 0 || session->throttle_until < loop->throttle_deadline) {
+                loop->throttle_deadline = session->throttle_until;
             }
         }
-        else if (strcasecmp(command, "STOR") == 0) {
-            if (!authenticated) {
-                server_log_error("STOR denied for unauthenticated client %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_LOGIN_FAILED, "Not logged in");
+        session = next;
+    }
+}
+
+static void loop_reap(ftp_loop_t *loop) {
+    while (loop->reaped) {
+        client_session_t *session = loop->reaped;
+        loop->reaped = session->next;
+        ftp_bucket_destroy(&session->rate);
+        free(session);
+    }
+}
+
+static void *event_loop_run(void *arg) {
+    ftp_loop_t *loop = (ftp_loop_t *)arg;
+    struct epoll_event events[FTPD_MAX_EVENTS];
+    loop_handle_t wake_handle = { HANDLE_WAKE, NULL };
+    struct epoll_event wake_ev;
+    wake_ev.events = EPOLLIN;
+    wake_ev.data.ptr = &wake_handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &wake_ev) < 0) {
+        server_log_error("Cannot watch event loop wakeup: %s", strerror(errno));
+        return NULL;
+    }
+
+    long long cache_sweep_ms = 0;
+    while (1) {
+        // Nothing from the previous batch is referenced past this point.
+        __atomic_store_n(&loop->quiescent, loop->quiescent + 1, __ATOMIC_SEQ_CST);
+        int timeout = FTPD_LOOP_TICK_MS;
+        if (loop->throttle_deadline > 0) {
+            long long wait = loop->throttle_deadline - monotonic_ms();
+            if (wait < timeout) timeout = wait > 0 ? (int)wait : 0;
+        }
+        int n = epoll_wait(loop->epoll_fd, events, FTPD_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            server_log_error("epoll_wait failed: %s", strerror(errno));
+            __atomic_store_n(&loop->stopped, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            loop_handle_t *handle = (loop_handle_t *)events[i].data.ptr;
+            if (handle->kind == HANDLE_WAKE) {
+                loop_adopt_incoming(loop);
+                loop_claim_pasv(loop);
                 continue;
             }
-            
-            // Accept data connection
-            if (pasv_listen_fd >= 0) {
-                // ... (logic accept data_fd không đổi)
-                fd_set read_fds;
-                struct timeval timeout;
-                FD_ZERO(&read_fds);
-                FD_SET(pasv_listen_fd, &read_fds);
-                timeout.tv_sec = 5;
-                timeout.tv_usec = 0;
-                if (select(pasv_listen_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-                    data_fd = accept(pasv_listen_fd, NULL, NULL);
-                } else {
-                    data_fd = -1;
-                }
-                close(pasv_listen_fd);
-                pasv_listen_fd = -1;
+            if (handle->kind == HANDLE_PASV_POOL) {
+                pasv_pool_accept((pasv_port_t *)handle);
+                continue;
             }
-            
-            if (data_fd < 0) {
-                server_log_error("STOR data connection failed for %s:%d", session->client_ip, session->client_port);
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Data connection failed");
+            if (handle->kind == HANDLE_URING) {
+                loop_reap_uring(loop);
                 continue;
             }
-            
-            FILE *file = fopen(cmd_arg, "wb");
-            if (file) {
-                send_ftp_response(control_fd, FTP_DATA_CONN_OPEN, "Opening BINARY mode data connection");
-                
-                // Lời gọi này giờ đã khớp với header (không còn warning)
-                if (receive_file_over_socket(data_fd, file) < 0) {
-                    fclose(file); 
-                    close(data_fd);
-                    data_fd = -1;
-                    unlink(cmd_arg); 
-                    server_log_error("Error receiving file '%s' from %s:%d", cmd_arg, session->client_ip, session->client_port);
-                    send_ftp_response(control_fd, FTP_ACTION_FAILED, "Error receiving file or writing data");
-                    continue;
-                }
-                
-                fclose(file); 
-                close(data_fd);
-                data_fd = -1;
-                send_ftp_response(control_fd, FTP_SUCCESS, "Transfer complete");
-            } else {
-                close(data_fd);
-                data_fd = -1;
-                
-                // *** ĐÃ SỬA (Error) ***
-                // Đã sửa FTP_FILE_ACTION_FAILED thành FTP_ACTION_FAILED
-                server_log_error("Cannot create file '%s' for STOR from %s:%d: %s", cmd_arg, session->client_ip, session->client_port, strerror(errno));
-                send_ftp_response(control_fd, FTP_ACTION_FAILED, "Cannot create file");
+            client_session_t *session = handle->session;
+            if (session->closed) continue;
+            switch (handle->kind) {
+                case HANDLE_CONTROL: session_on_control(session, events[i].events); break;
+                case HANDLE_PASV: session_on_pasv(session); break;
+                case HANDLE_DATA: session_on_data(session); break;
+                case HANDLE_WAKE:
+                case HANDLE_PASV_POOL:
+                case HANDLE_URING: break;
             }
         }
-        else if (strcasecmp(command, "QUIT") == 0) {
-            send_ftp_response(control_fd, FTP_GOODBYE, "Goodbye");
+        loop_expire_data_waits(loop);
+        if (loop == &loops[0] && monotonic_ms() >= cache_sweep_ms) {
+            file_cache_sweep();
+            cache_sweep_ms = monotonic_ms() + FTPD_FILE_CACHE_SWEEP_MS;
+        }
+        loop_resume_throttled(loop);
+        loop_reap(loop);
+    }
+    return NULL;
+}
+
+static void init_event_loops(void) {
+    // sendfile() has no MSG_NOSIGNAL; a client hanging up mid-transfer must
+    // surface as EPIPE instead of killing the process.
+    signal(SIGPIPE, SIG_IGN);
+    list_cache_init();
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = (cores < 1) ? 1 : (cores > FTPD_MAX_LOOPS ? FTPD_MAX_LOOPS : (int)cores);
+    for (int i = 0; i < wanted; i++) {
+        ftp_loop_t *loop = &loops[loop_count];
+        memset(loop, 0, sizeof(*loop));
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+            server_log_error("Cannot create event loop: %s", strerror(errno));
+            if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+            if (loop->wake_fd >= 0) close(loop->wake_fd);
+            break;
+        }
+        pthread_mutex_init(&loop->lock, NULL);
+        if (pthread_create(&loop->thread, NULL, event_loop_run, loop) != 0) {
+            server_log_error("Cannot start event loop thread");
+            close(loop->epoll_fd);
+            close(loop->wake_fd);
+            pthread_mutex_destroy(&loop->lock);
             break;
         }
-        else {
-            // Mặc định là '502 Command not implemented' thay vì '200'
-            server_log_error("Unsupported command '%s' from %s:%d", command, session->client_ip, session->client_port);
-            send_ftp_response(control_fd, 502, "Command not implemented");
+        pthread_detach(loop->thread);
+        loop_count++;
+    }
+    server_log_info("Started %d event loop thread(s)", loop_count);
+}
+
+static void *metrics_dump_run(void *arg) {
+    (void)arg;
+    int failing = 0;
+    for (;;) {
+        pthread_mutex_lock(&metrics_dump.lock);
+        int interval_ms = metrics_dump.interval_ms;
+        pthread_mutex_unlock(&metrics_dump.lock);
+        struct timespec pause = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+
+        char path[FTP_MAX_PATH];
+        pthread_mutex_lock(&metrics_dump.lock);
+        snprintf(path, sizeof(path), "%s", metrics_dump.path);
+        pthread_mutex_unlock(&metrics_dump.lock);
+        if (path[0] == '\0') continue;
+        // Report a failing dump once, not every interval.
+        if (ftp_metrics_write_prometheus(path) < 0) {
+            if (!failing) server_log_error("Cannot write metrics to %s: %s", path, strerror(errno));
+            failing = 1;
+        } else {
+            failing = 0;
         }
     }
-    
-    if (pasv_listen_fd >= 0) close(pasv_listen_fd);
-    if (data_fd >= 0) close(data_fd);
-    close(control_fd);
-    server_log_info("Session ended with %s:%d", session->client_ip, session->client_port);
-    free(session);
     return NULL;
 }
 
-// ... (Hàm start_ftp_server và accept_ftp_client không thay đổi)
+static void metrics_dump_start(void) {
+    pthread_mutex_lock(&metrics_dump.lock);
+    int first = !metrics_dump.started;
+    metrics_dump.started = 1;
+    pthread_mutex_unlock(&metrics_dump.lock);
+    if (!first) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_dump_run, NULL) != 0) {
+        server_log_error("Cannot start the metrics dump");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// An empty path turns the dump off; the interval applies from the next dump.
+// A relative path is resolved against the working directory at the time of
+// the call, so set it before changing into the served root.
+int ftpd_set_metrics_dump(const char *path, int interval_ms) {
+    if (!path || interval_ms <= 0) {
+        return -1;
+    }
+    char resolved[sizeof(metrics_dump.path)];
+    int n;
+    if (path[0] == '\0' || path[0] == '/') {
+        n = snprintf(resolved, sizeof(resolved), "%s", path);
+    } else {
+        char cwd[sizeof(resolved)];
+        n = getcwd(cwd, sizeof(cwd)) ? snprintf(resolved, sizeof(resolved), "%s/%s", cwd, path) : -1;
+    }
+    if (n < 0 || (size_t)n >= sizeof(resolved)) {
+        return -1;
+    }
+    pthread_mutex_lock(&metrics_dump.lock);
+    snprintf(metrics_dump.path, sizeof(metrics_dump.path), "%s", resolved);
+    metrics_dump.interval_ms = interval_ms;
+    pthread_mutex_unlock(&metrics_dump.lock);
+    if (resolved[0]) {
+        server_log_info("Metrics dumped to %s every %d ms", resolved, interval_ms);
+    } else {
+        server_log_info("Metrics dump disabled");
+    }
+    return 0;
+}
+
+static void dispatch_session(client_session_t *session) {
+    unsigned index = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % (unsigned)loop_count;
+    ftp_loop_t *loop = &loops[index];
+    session->loop = loop;
+    pthread_mutex_lock(&loop->lock);
+    session->next = loop->incoming;
+    loop->incoming = session;
+    pthread_mutex_unlock(&loop->lock);
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        server_log_error("Cannot wake event loop: %s", strerror(errno));
+    }
+}
+
 int start_ftp_server(const char *bind_ip, int port) {
+    pthread_once(&loops_once, init_event_loops);
+    if (loop_count == 0) {
+        server_log_error("No event loop available");
+        return -1;
+    }
+    pasv_pool_start();
+    if (accounts_start() < 0) {
+        return -1;
+    }
+    metrics_dump_start();
+
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         server_log_error("Failed to create server socket: %s", strerror(errno));
@@ -473,8 +3062,37 @@ int accept_ftp_client(int server_fd, const char *server_ip) {
     int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &len);
     
     if (client_fd >= 0) {
-        client_session_t *session = malloc(sizeof(client_session_t));
+        client_session_t *session = calloc(1, sizeof(client_session_t));
+        int dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!session || dir_fd < 0 || set_nonblocking(client_fd) < 0) {
+            server_log_error("Cannot set up session: %s", strerror(errno));
+            if (dir_fd >= 0) close(dir_fd);
+            free(session);
+            close(client_fd);
+            return -1;
+        }
+        session->dir_fd = dir_fd;
+        line_reader_init(&session->reader);
+        ftp_tune_control_socket(client_fd);
         session->control_fd = client_fd;
+        session->pasv_listen_fd = -1;
+        session->pasv_pool_fd = -1;
+        session->peer_addr = client_addr.sin_addr;
+        session->data_fd = -1;
+        session->transfer_fd = -1;
+        session->splice_pipe[0] = -1;
+        session->splice_pipe[1] = -1;
+        session->state = SESSION_IDLE;
+        session->command_verb = -1;
+        session->z_level = FTPD_DEFAULT_ZLEVEL;
+        ftp_bucket_init(&session->rate, __atomic_load_n(&session_rate_limit, __ATOMIC_RELAXED));
+        session->control_handle.kind = HANDLE_CONTROL;
+        session->control_handle.session = session;
+        session->pasv_handle.kind = HANDLE_PASV;
+        session->pasv_handle.session = session;
+        session->data_handle.kind = HANDLE_DATA;
+        session->data_handle.session = session;
+        getcwd(session->current_dir, sizeof(session->current_dir));
         session->server_ip[0] = '\0';
         if (server_ip && strlen(server_ip) > 0 && strcmp(server_ip, "0.0.0.0") != 0) {
             strncpy(session->server_ip, server_ip, sizeof(session->server_ip) - 1);
@@ -498,10 +3116,9 @@ int accept_ftp_client(int server_fd, const char *server_ip) {
         }
         session->client_port = ntohs(client_addr.sin_port);
         server_log_info("Accepted connection from %s:%d", session->client_ip, session->client_port);
-        
-        pthread_t thread;
-        pthread_create(&thread, NULL, handle_client, session);
-        pthread_detach(thread);
+
+        ftp_metrics_session_opened();
+        dispatch_session(session);
     } else if (errno != EINTR) {
         server_log_error("Failed to accept client connection: %s", strerror(errno));
     }
@@ -1,12 +1,27 @@
 #include <gtk/gtk.h>
 #include <limits.h>
 #include "ftp_common.h"
+#include "ftp_log.h"
+#include "ftp_ratelimit.h"
 
 extern int start_ftp_server(const char *bind_ip, int port);
 extern int accept_ftp_client(int server_fd, const char *server_ip);
+extern int ftpd_set_pasv_range(int first_port, int last_port);
+extern int ftpd_use_io_uring(int enable);
+extern int ftpd_set_socket_profile(const char *profile);
+extern int ftpd_set_rate_limits(long long global_limit, long long session_limit);
+extern int ftpd_set_user_rate_limit(const char *username, long long limit);
+extern int ftpd_set_metrics_dump(const char *path, int interval_ms);
 
 static GtkWidget *ip_entry;
 static GtkWidget *port_entry;
+static GtkWidget *pasv_range_entry;
+static GtkWidget *metrics_file_entry;
+static GtkWidget *io_uring_check;
+static GtkWidget *socket_profile_combo;
+static GtkWidget *global_limit_entry;
+static GtkWidget *session_limit_entry;
+static GtkWidget *user_limit_entry;
 static GtkWidget *start_button;
 static GtkWidget *stop_button;
 static GtkWidget *status_text;
@@ -19,11 +34,30 @@ static int server_fd = -1;
 static gboolean server_running = FALSE;
 static GThread *server_thread = NULL;
 
-static void append_status(const char *message) {
+#define STATUS_MAX_LINES 2000
+#define METRICS_DUMP_MS 10000
+
+// Server log batches arrive on the logger thread. They are merged here
+// until the idle callback showing the previous ones has run.
+static struct {
+    GMutex lock;
+    GString *pending;
+    gboolean scheduled;
+} log_view;
+
+static void status_insert(const char *text, gssize len) {
     GtkTextIter iter;
     gtk_text_buffer_get_end_iter(status_buffer, &iter);
-    gtk_text_buffer_insert(status_buffer, &iter, message, -1);
-    gtk_text_buffer_insert(status_buffer, &iter, "\n", -1);
+    gtk_text_buffer_insert(status_buffer, &iter, text, len);
+
+    // Drop the oldest lines so a busy server cannot grow the view forever.
+    gint lines = gtk_text_buffer_get_line_count(status_buffer);
+    if (lines > STATUS_MAX_LINES) {
+        GtkTextIter start, cut;
+        gtk_text_buffer_get_start_iter(status_buffer, &start);
+        gtk_text_buffer_get_iter_at_line(status_buffer, &cut, lines - STATUS_MAX_LINES);
+        gtk_text_buffer_delete(status_buffer, &start, &cut);
+    }
     
     // Auto-scroll to bottom
     if (status_scrolled) {
@@ -35,6 +69,38 @@ static void append_status(const char *message) {
     }
 }
 
+static void append_status(const char *message) {
+    gchar *line = g_strconcat(message, "\n", NULL);
+    status_insert(line, -1);
+    g_free(line);
+}
+
+static gboolean show_log_batches(gpointer data) {
+    (void)data;
+    g_mutex_lock(&log_view.lock);
+    GString *batch = log_view.pending;
+    log_view.pending = NULL;
+    log_view.scheduled = FALSE;
+    g_mutex_unlock(&log_view.lock);
+    if (batch) {
+        status_insert(batch->str, (gssize)batch->len);
+        g_string_free(batch, TRUE);
+    }
+    return FALSE;
+}
+
+static void on_log_batch(const char *batch, size_t len, void *ctx) {
+    (void)ctx;
+    g_mutex_lock(&log_view.lock);
+    if (!log_view.pending) log_view.pending = g_string_sized_new(len);
+    g_string_append_len(log_view.pending, batch, (gssize)len);
+    if (!log_view.scheduled) {
+        log_view.scheduled = TRUE;
+        g_idle_add(show_log_batches, NULL);
+    }
+    g_mutex_unlock(&log_view.lock);
+}
+
 static void on_browse_root_clicked(GtkWidget *widget, gpointer data) {
     (void)data;
     GtkWidget *dialog = gtk_file_chooser_dialog_new(
@@ -54,31 +120,80 @@ static void on_browse_root_clicked(GtkWidget *widget, gpointer data) {
     gtk_widget_destroy(dialog);
 }
 
-static gboolean append_status_idle(gpointer data) {
-    gchar *msg = (gchar *)data;
-    append_status(msg);
-    g_free(msg);
-    return FALSE;
-}
-
 static gpointer server_thread_func(gpointer data) {
     (void)data; // Suppress unused parameter warning
     while (server_running && server_fd >= 0) {
+        // Accepted connections show up through the server log.
         int client_fd = accept_ftp_client(server_fd, 
             gtk_entry_get_text(GTK_ENTRY(ip_entry)));
-        if (client_fd >= 0) {
-            gchar *msg = g_strdup_printf("Client connected: %d", client_fd);
-            g_idle_add(append_status_idle, msg);
-        } else if (server_running) {
+        if (client_fd < 0 && server_running) {
             g_usleep(100000); // 100ms
         }
     }
     return NULL;
 }
 
+// Empty fields mean unlimited. Limits can change while the server runs.
+static gboolean apply_rate_limits(void) {
+    long long global_limit = 0, session_limit = 0;
+    const char *global_str = gtk_entry_get_text(GTK_ENTRY(global_limit_entry));
+    const char *session_str = gtk_entry_get_text(GTK_ENTRY(session_limit_entry));
+    if ((strlen(global_str) > 0 && ftp_parse_rate(global_str, &global_limit) < 0) ||
+        (strlen(session_str) > 0 && ftp_parse_rate(session_str, &session_limit) < 0)) {
+        append_status("Invalid rate limit (use bytes/s, e.g. 512K or 10M)");
+        return FALSE;
+    }
+    ftpd_set_rate_limits(global_limit, session_limit);
+
+    // "user rate" pairs, separated by commas
+    char users[256];
+    snprintf(users, sizeof(users), "%s", gtk_entry_get_text(GTK_ENTRY(user_limit_entry)));
+    char *next = users;
+    while (next && *next) {
+        char *item = next;
+        next = strchr(item, ',');
+        if (next) *next++ = '\0';
+        if (strspn(item, " \t") == strlen(item)) continue;
+        char name[64], rate_str[32];
+        long long rate = 0;
+        if (sscanf(item, "%63s %31s", name, rate_str) != 2 || ftp_parse_rate(rate_str, &rate) < 0 ||
+            ftpd_set_user_rate_limit(name, rate) < 0) {
+            char msg[320];
+            snprintf(msg, sizeof(msg), "Invalid user rate limit '%s'", item);
+            append_status(msg);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void on_apply_limits_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    if (apply_rate_limits()) {
+        append_status("Rate limits updated");
+    }
+}
+
+// Takes effect for connections made afterwards, so it stays editable.
+static void on_socket_profile_changed(GtkComboBox *combo, gpointer data) {
+    (void)data;
+    const char *profile = gtk_combo_box_get_active_id(combo);
+    if (profile) {
+        ftpd_set_socket_profile(profile);
+    }
+}
+
 static void on_start_clicked(GtkWidget *widget, gpointer data) {
     (void)widget; (void)data; // Suppress unused parameter warnings
     if (server_running) return;
+
+    // Empty keeps the metrics dump off. Set before the chdir below so a
+    // relative path does not land inside the served root.
+    const char *metrics_path = gtk_entry_get_text(GTK_ENTRY(metrics_file_entry));
+    if (ftpd_set_metrics_dump(metrics_path, METRICS_DUMP_MS) < 0) {
+        append_status("Invalid metrics file path");
+        return;
+    }
     
     const char *root_dir = gtk_entry_get_text(GTK_ENTRY(root_dir_entry));
     if (root_dir && strlen(root_dir) > 0) {
@@ -97,6 +212,27 @@ static void on_start_clicked(GtkWidget *widget, gpointer data) {
         return;
     }
     
+    // Optional "first-last" PASV range; empty keeps ephemeral data ports.
+    const char *range_str = gtk_entry_get_text(GTK_ENTRY(pasv_range_entry));
+    if (range_str && strlen(range_str) > 0) {
+        int first_port = 0, last_port = 0;
+        if (sscanf(range_str, "%d-%d", &first_port, &last_port) != 2 ||
+            ftpd_set_pasv_range(first_port, last_port) < 0) {
+            append_status("Invalid or unchangeable PASV port range");
+            return;
+        }
+    }
+
+    if (!apply_rate_limits()) {
+        return;
+    }
+
+    gboolean want_uring = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(io_uring_check));
+    if (ftpd_use_io_uring(want_uring) < 0) {
+        append_status("io_uring is not available, using the epoll transfer path");
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(io_uring_check), FALSE);
+    }
+
     server_fd = start_ftp_server(ip, port);
     if (server_fd < 0) {
         append_status("Failed to start server");
@@ -108,8 +244,12 @@ static void on_start_clicked(GtkWidget *widget, gpointer data) {
     gtk_widget_set_sensitive(stop_button, TRUE);
     gtk_widget_set_sensitive(ip_entry, FALSE);
     gtk_widget_set_sensitive(port_entry, FALSE);
+    // The listeners stay bound for the life of the process.
+    gtk_widget_set_sensitive(pasv_range_entry, FALSE);
+    gtk_widget_set_sensitive(metrics_file_entry, FALSE);
     gtk_widget_set_sensitive(root_dir_entry, FALSE);
     gtk_widget_set_sensitive(root_dir_button, FALSE);
+    gtk_widget_set_sensitive(io_uring_check, FALSE);
     
     char msg[256];
     snprintf(msg, sizeof(msg), "Server started on %s:%d", ip, port);
@@ -131,8 +271,10 @@ static void on_stop_clicked(GtkWidget *widget, gpointer data) {
     
     gtk_widget_set_sensitive(start_button, TRUE);
     gtk_widget_set_sensitive(stop_button, FALSE);
+    gtk_widget_set_sensitive(io_uring_check, TRUE);
     gtk_widget_set_sensitive(ip_entry, TRUE);
     gtk_widget_set_sensitive(port_entry, TRUE);
+    gtk_widget_set_sensitive(metrics_file_entry, TRUE);
     gtk_widget_set_sensitive(root_dir_entry, TRUE);
     gtk_widget_set_sensitive(root_dir_button, TRUE);
     
@@ -146,6 +288,7 @@ static void on_destroy(GtkWidget *widget, gpointer data) {
     if (server_fd >= 0) {
         close(server_fd);
     }
+    ftp_log_set_sink(NULL, NULL);
     gtk_main_quit();
 }
 
@@ -183,6 +326,63 @@ int main(int argc, char *argv[]) {
     gtk_box_pack_start(GTK_BOX(port_box), port_entry, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), port_box, FALSE, FALSE, 0);
 
+    // PASV port range
+    GtkWidget *pasv_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *pasv_label = gtk_label_new("PASV Ports:");
+    gtk_widget_set_size_request(pasv_label, 100, -1);
+    pasv_range_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(pasv_range_entry), "e.g. 50000-50099 (empty: any port)");
+    gtk_box_pack_start(GTK_BOX(pasv_box), pasv_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(pasv_box), pasv_range_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), pasv_box, FALSE, FALSE, 0);
+
+    // Prometheus metrics file
+    GtkWidget *metrics_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *metrics_label = gtk_label_new("Metrics File:");
+    gtk_widget_set_size_request(metrics_label, 100, -1);
+    metrics_file_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(metrics_file_entry), "e.g. /var/tmp/ftpd_metrics.prom (empty: off)");
+    gtk_box_pack_start(GTK_BOX(metrics_box), metrics_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(metrics_box), metrics_file_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), metrics_box, FALSE, FALSE, 0);
+
+    io_uring_check = gtk_check_button_new_with_label("Use io_uring for file transfers");
+    gtk_box_pack_start(GTK_BOX(vbox), io_uring_check, FALSE, FALSE, 0);
+
+    // Socket tuning profile
+    GtkWidget *profile_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *profile_label = gtk_label_new("Socket Tuning:");
+    gtk_widget_set_size_request(profile_label, 100, -1);
+    socket_profile_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(socket_profile_combo), "auto", "Auto (from measured RTT)");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(socket_profile_combo), "lan", "LAN");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(socket_profile_combo), "wan", "WAN (large buffers)");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(socket_profile_combo), "lowmem", "Low memory");
+    gtk_combo_box_set_active_id(GTK_COMBO_BOX(socket_profile_combo), "auto");
+    g_signal_connect(socket_profile_combo, "changed", G_CALLBACK(on_socket_profile_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(profile_box), profile_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(profile_box), socket_profile_combo, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), profile_box, FALSE, FALSE, 0);
+
+    // Bandwidth limits, bytes per second
+    GtkWidget *limit_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *limit_label = gtk_label_new("Rate Limits:");
+    gtk_widget_set_size_request(limit_label, 100, -1);
+    global_limit_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(global_limit_entry), "Server, e.g. 50M");
+    session_limit_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(session_limit_entry), "Per session, e.g. 5M");
+    user_limit_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(user_limit_entry), "Users, e.g. vu 1M, a 512K");
+    GtkWidget *apply_limits_button = gtk_button_new_with_label("Apply");
+    g_signal_connect(apply_limits_button, "clicked", G_CALLBACK(on_apply_limits_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(limit_box), limit_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(limit_box), global_limit_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(limit_box), session_limit_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(limit_box), user_limit_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(limit_box), apply_limits_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), limit_box, FALSE, FALSE, 0);
+
     // Root directory
     GtkWidget *root_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     GtkWidget *root_label = gtk_label_new("Root Dir:");
@@ -227,6 +427,7 @@ int main(int argc, char *argv[]) {
     gtk_box_pack_start(GTK_BOX(vbox), status_scrolled, TRUE, TRUE, 0);
     
     append_status("FTP Server - Ready to start");
+    ftp_log_set_sink(on_log_batch, NULL);
     
     gtk_widget_show_all(window);
     gtk_main();